@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Compare the cp and mv builtins with running /bin/cp and /bin/mv from lsh.
+#
+# Usage: bench/copy.sh [SMALL_FILES [HUGE_MB]]
+#
+# Two workloads, each as an lsh script run once per repetition:
+#
+#   small  SMALL_FILES (default 2000) files of 4 KB, copied one command per
+#          file, then all in one command, then moved one command per file
+#   huge   four files of HUGE_MB (default 64) megabytes, copied in one
+#          command
+#
+# Each time is the fastest of REPS runs (default 3), with the destination
+# emptied before each.  Files are created in TMPDIR (default /tmp), whose
+# file system decides whether the builtin can use reflinks; it is printed
+# first.  LSH and CC can be set in the environment.
+
+set -e
+
+SMALL=${1:-2000}
+HUGE_MB=${2:-64}
+REPS=${REPS:-3}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-copy.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+CP=$(command -v cp)
+MV=$(command -v mv)
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+mkdir "$work/small" "$work/huge" "$work/dst"
+head -c 4096 /dev/urandom > "$work/block"
+i=0
+while [ "$i" -lt "$SMALL" ]; do
+  cp "$work/block" "$work/small/f$i"
+  i=$((i + 1))
+done
+for i in 1 2 3 4; do
+  head -c $((HUGE_MB * 1024 * 1024)) /dev/urandom > "$work/huge/h$i"
+done
+
+# script NAME CMD writes NAME.lsh, running CMD on each small file in turn.
+script() {
+  i=0
+  while [ "$i" -lt "$SMALL" ]; do
+    echo "$2 $work/small/f$i $work/dst/"
+    i=$((i + 1))
+  done > "$work/$1.lsh"
+}
+script cp-each cp
+script bin-cp-each "$CP"
+# lsh doesn't glob, so the list is expanded here.
+echo cp "$work"/small/* "$work/dst/" > "$work/cp-all.lsh"
+echo "$CP" "$work"/small/* "$work/dst/" > "$work/bin-cp-all.lsh"
+echo "cp $work/huge/h1 $work/huge/h2 $work/huge/h3 $work/huge/h4 $work/dst/" \
+  > "$work/cp-huge.lsh"
+echo "$CP $work/huge/h1 $work/huge/h2 $work/huge/h3 $work/huge/h4 $work/dst/" \
+  > "$work/bin-cp-huge.lsh"
+# The moves go from a copy in dst back into small.
+sed "s|$work/small/\\(f[0-9]*\\) $work/dst/|$work/dst/\\1 $work/small/|" \
+  "$work/cp-each.lsh" | sed "s|^cp |mv |" > "$work/mv-each.lsh"
+sed "s|^mv |$MV |" "$work/mv-each.lsh" > "$work/bin-mv-each.lsh"
+
+# best SCRIPT [SETUP] prints the fastest wall time of REPS runs, in
+# milliseconds, emptying dst (and running SETUP) before each.
+best() {
+  b=
+  i=0
+  while [ "$i" -lt "$REPS" ]; do
+    rm -rf "$work/dst"
+    mkdir "$work/dst"
+    if [ -n "$2" ]; then
+      "$LSH" "$work/$2.lsh" > /dev/null
+    fi
+    t=$("$work/measure" "$LSH" "$work/$1.lsh" | cut -d' ' -f1)
+    if [ -z "$b" ] || awk "BEGIN { exit !($t < $b) }"; then
+      b=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$b"
+}
+
+echo "file system: $(stat -f -c %T "$work")"
+printf '%-30s %10s %10s\n' workload builtin_ms external_ms
+printf '%-30s %10s %10s\n' "cp $SMALL x 4 KB, one each" \
+  "$(best cp-each)" "$(best bin-cp-each)"
+printf '%-30s %10s %10s\n' "cp $SMALL x 4 KB, one command" \
+  "$(best cp-all)" "$(best bin-cp-all)"
+printf '%-30s %10s %10s\n' "mv $SMALL x 4 KB, one each" \
+  "$(best mv-each cp-all)" "$(best bin-mv-each cp-all)"
+printf '%-30s %10s %10s\n' "cp 4 x $HUGE_MB MB, one command" \
+  "$(best cp-huge)" "$(best bin-cp-huge)"
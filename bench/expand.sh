@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Time parameter expansion on a 1 MB value.
+#
+# Usage: bench/expand.sh [BYTES]
+#
+# Sets a variable to BYTES (default 1048576) random characters from "abcd"
+# and prints the time each expansion takes on it: the length, a substring,
+# prefix and suffix removal and substitution, with both literal patterns
+# (which go through memmem()) and globs (which go through the NFA matcher).
+# Each is the fastest of REPS runs (default 5) of a script that does it once,
+# less the time of a script that only sets the variable.  LSH and CC can be
+# set in the environment.
+
+set -e
+
+BYTES=${1:-1048576}
+REPS=${REPS:-5}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-expand.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+awk -v n="$BYTES" 'BEGIN {
+  srand(1)
+  printf "export BIG="
+  for (i = 0; i < n; i++)
+    printf "%c", 97 + int(rand() * 4)
+  print ""
+}' > "$work/base.lsh"
+
+# best SCRIPT prints the fastest wall time of REPS runs, in milliseconds.
+best() {
+  b=
+  i=0
+  while [ "$i" -lt "$REPS" ]; do
+    t=$("$work/measure" "$LSH" "$1" | cut -d' ' -f1)
+    if [ -z "$b" ] || awk "BEGIN { exit !($t < $b) }"; then
+      b=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$b"
+}
+
+base=$(best "$work/base.lsh")
+echo "setting a $BYTES byte variable: ${base}ms"
+printf '%-22s %10s\n' expansion ms
+for expr in '${#BIG}' '${BIG:500000:100}' '${BIG#abc}' '${BIG##a*d}' \
+            '${BIG##a?*[cd]}' '${BIG%%b*}' '${BIG%%[ab]*}' '${BIG%?a*}' \
+            '${BIG//ab/x}' '${BIG//a?/x}' '${BIG//a*b/x}' '${BIG//[ab]?c/x}'; do
+  { cat "$work/base.lsh"; echo "export R=$expr"; } > "$work/expr.lsh"
+  t=$(best "$work/expr.lsh")
+  printf '%-22s %10s\n' "$expr" "$(awk "BEGIN { printf \"%.3f\", $t - $base }")"
+done
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Compare the fgrep builtin with GNU grep -F on a large log.
+#
+# Usage: bench/fgrep.sh [MB]
+#
+# Generates a 64 MB piece of web-server-style log lines and repeats it to
+# make a file of MB megabytes (default 4096), then times both searches for a
+# string found on about one line in a thousand: plain, -c, -v, and -i with
+# the string in upper case.  GNU grep runs with LC_ALL=C, as the builtin
+# only folds ASCII case.  Both write into a pipe to cat, since GNU grep stops
+# at the first match when its output is /dev/null; -v therefore measures the
+# cost of writing nearly the whole file.  Each time is the fastest of REPS runs
+# (default 3), and the two outputs are checked to be identical on the 64 MB
+# piece first.  LSH and CC can be set in the environment; temporary files go
+# in TMPDIR, which needs room for the log.
+
+set -e
+
+MB=${1:-4096}
+REPS=${REPS:-3}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-fgrepbench.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+GREP=$(command -v grep)
+CAT=$(command -v cat)
+PIECE=64
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+awk -v n=$((PIECE * 1024 * 1024)) 'BEGIN {
+  srand(1)
+  split("GET POST PUT DELETE", method, " ")
+  split("200 200 200 200 301 304 404 500", code, " ")
+  while (bytes < n) {
+    if (rand() < 0.001)
+      msg = "upstream error=connection-reset"
+    else
+      msg = sprintf("served in %d ms", int(rand() * 500))
+    line = sprintf("2024-05-%02d %02d:%02d:%02d 10.%d.%d.%d %s " \
+                   "/api/v1/item/%d %s %s", int(rand() * 28) + 1,
+                   int(rand() * 24), int(rand() * 60), int(rand() * 60),
+                   int(rand() * 256), int(rand() * 256), int(rand() * 256),
+                   method[int(rand() * 4) + 1], int(rand() * 1e6),
+                   code[int(rand() * 8) + 1], msg)
+    print line
+    bytes += length(line) + 1
+  }
+}' > "$work/piece"
+i=0
+: > "$work/input"
+while [ "$i" -lt $(((MB + PIECE - 1) / PIECE)) ]; do
+  cat "$work/piece" >> "$work/input"
+  i=$((i + 1))
+done
+
+# best COMMAND... prints the fastest wall time of REPS runs, in milliseconds.
+best() {
+  b=
+  i=0
+  while [ "$i" -lt "$REPS" ]; do
+    t=$("$work/measure" "$@" | cut -d' ' -f1)
+    if [ -z "$b" ] || awk "BEGIN { exit !($t < $b) }"; then
+      b=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$b"
+}
+
+echo "input: $(($(wc -c < "$work/input") / 1024 / 1024)) MB," \
+  "$(wc -l < "$work/input") lines"
+printf '%-6s %10s %10s\n' mode lsh_ms gnu_ms
+for mode in plain count invert icase; do
+  # One word, as lsh has no quoting.
+  needle=connection-reset
+  case $mode in
+    plain) opts= ;;
+    count) opts=-c ;;
+    invert) opts=-v ;;
+    icase) opts=-i needle=CONNECTION-RESET ;;
+  esac
+  echo "fgrep $opts $needle $work/piece" > "$work/fgrep.lsh"
+  "$LSH" "$work/fgrep.lsh" > "$work/lsh.out"
+  LC_ALL=C "$GREP" -F $opts "$needle" "$work/piece" > "$work/gnu.out"
+  if ! cmp -s "$work/lsh.out" "$work/gnu.out"; then
+    echo "fgrep: outputs differ for $mode" >&2
+    exit 1
+  fi
+  echo "fgrep $opts $needle $work/input | $CAT" > "$work/fgrep.lsh"
+  echo "LC_ALL=C $GREP -F $opts $needle $work/input | $CAT" > "$work/grep.sh"
+  lsh=$(best "$LSH" "$work/fgrep.lsh")
+  gnu=$(best sh "$work/grep.sh")
+  printf '%-6s %10s %10s\n' "$mode" "$lsh" "$gnu"
+done
@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Compare lsh with bash and dash on equivalent scripts.
+#
+# Usage: bench/run.sh [N]
+#
+# N scales the workloads (default 1000).  Set LSH to benchmark an existing
+# binary instead of building src/main.c, CC to choose the compiler, and REPS
+# for the number of repetitions per cell (the fastest is reported).  Shells
+# that are not installed are skipped.  Nothing here needs network access.
+#
+# Workloads, all written in the subset every shell understands (one command
+# per line, whitespace-separated words, no quoting):
+#
+#   loop      N external commands, unrolled since lsh has no loops
+#   pipeline  N/10 two-stage pipelines of external commands
+#   builtin   N cd and export builtins
+#   glob      N/10 pathname expansions; lsh does not glob, so it is skipped
+#   startup   an empty script, run N/10 times
+#
+# Columns are totals for the workload: wall time, processes created
+# system-wide, peak RSS of the shell, voluntary and involuntary context
+# switches, and read and write system calls of the shell and everything it
+# waited for.
+
+set -e
+
+N=${1:-1000}
+REPS=${REPS:-3}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+find_tool() {
+  for dir in /bin /usr/bin; do
+    if [ -x "$dir/$1" ]; then
+      echo "$dir/$1"
+      return
+    fi
+  done
+  echo "bench: $1 not found" >&2
+  exit 1
+}
+TRUE=$(find_tool true)
+SEQ=$(find_tool seq)
+WC=$(find_tool wc)
+
+# repeat COUNT LINE... writes the lines COUNT times.
+repeat() {
+  count=$1
+  shift
+  i=0
+  while [ "$i" -lt "$count" ]; do
+    for line in "$@"; do
+      echo "$line"
+    done
+    i=$((i + 1))
+  done
+}
+
+mkdir "$work/files"
+i=0
+while [ "$i" -lt 100 ]; do
+  : > "$work/files/f$i"
+  i=$((i + 1))
+done
+
+repeat "$N" "$TRUE" > "$work/loop.sh"
+repeat $((N / 10)) "$SEQ 100 | $WC -l" > "$work/pipeline.sh"
+repeat $((N / 3)) "cd /tmp" "cd /" "export BENCH_X=1" > "$work/builtin.sh"
+repeat $((N / 10)) "echo $work/files/*" > "$work/glob.sh"
+: > "$work/startup.sh"
+
+printf '%-9s %-5s %10s %7s %9s %7s %7s %8s %8s\n' workload shell wall_ms \
+  forks rss_kb vcsw ivcsw syscr syscw
+for workload in loop pipeline builtin glob startup; do
+  for shell in lsh bash dash; do
+    if [ "$shell" = lsh ]; then
+      bin=$LSH
+      if [ "$workload" = glob ]; then
+        printf '%-9s %-5s %10s\n' "$workload" "$shell" "n/a"
+        continue
+      fi
+    elif ! bin=$(command -v "$shell"); then
+      continue
+    fi
+    count=1
+    if [ "$workload" = startup ]; then
+      count=$((N / 10))
+    fi
+
+    best=
+    rep=0
+    while [ "$rep" -lt "$REPS" ]; do
+      result=$("$work/measure" -n "$count" "$bin" "$work/$workload.sh" \
+               2>/dev/null) || true
+      wall=${result%% *}
+      if [ -z "$best" ] || awk "BEGIN { exit !($wall < ${best%% *}) }"; then
+        best=$result
+      fi
+      rep=$((rep + 1))
+    done
+    printf '%-9s %-5s %10s %7s %9s %7s %7s %8s %8s\n' "$workload" "$shell" \
+      $best
+  done
+done
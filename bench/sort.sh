@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Compare the sort builtin with GNU sort at several thread counts.
+#
+# Usage: bench/sort.sh [MB]
+#
+# Generates MB megabytes (default 64) of random lines, each a number and a
+# word, and times both sorts on them with --parallel=N for each N in THREADS
+# (default "1 2 4 8"), in three modes: byte order in memory, -n in memory,
+# and byte order with a memory budget of an eighth of the input (-S), which
+# makes both spill runs to disk and merge them.  GNU sort runs with LC_ALL=C,
+# which is the only order the builtin knows.  Each time is the fastest of
+# REPS runs (default 3), and the two outputs are checked to be identical
+# first.  LSH and CC can be set in the environment; temporary files go in
+# TMPDIR.
+
+set -e
+
+MB=${1:-64}
+REPS=${REPS:-3}
+THREADS=${THREADS:-1 2 4 8}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-sortbench.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+SORT=$(command -v sort)
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+awk -v n=$((MB * 1024 * 1024)) 'BEGIN {
+  srand(1)
+  while (bytes < n) {
+    line = sprintf("%d %x", int(rand() * 2e9) - 1e9, int(rand() * 2^31))
+    print line
+    bytes += length(line) + 1
+  }
+}' > "$work/input"
+budget=$((MB * 1024 * 1024 / 8))
+
+# best COMMAND... prints the fastest wall time of REPS runs, in milliseconds.
+best() {
+  b=
+  i=0
+  while [ "$i" -lt "$REPS" ]; do
+    t=$("$work/measure" "$@" | cut -d' ' -f1)
+    if [ -z "$b" ] || awk "BEGIN { exit !($t < $b) }"; then
+      b=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$b"
+}
+
+echo "input: ${MB} MB, $(wc -l < "$work/input") lines"
+printf '%-9s %7s %10s %10s\n' mode threads lsh_ms gnu_ms
+for mode in memory numeric external; do
+  case $mode in
+    memory) opts= ;;
+    numeric) opts=-n ;;
+    external) opts="-S $budget" ;;
+  esac
+  for n in $THREADS; do
+    echo "sort --parallel=$n $opts -T $work $work/input" > "$work/sort.lsh"
+    "$LSH" "$work/sort.lsh" > "$work/lsh.out"
+    LC_ALL=C "$SORT" --parallel="$n" $opts -T "$work" "$work/input" \
+      > "$work/gnu.out"
+    if ! cmp -s "$work/lsh.out" "$work/gnu.out"; then
+      echo "sort: outputs differ for $mode with $n threads" >&2
+      exit 1
+    fi
+    lsh=$(best "$LSH" "$work/sort.lsh")
+    gnu=$(best env LC_ALL=C "$SORT" --parallel="$n" $opts -T "$work" \
+          "$work/input")
+    printf '%-9s %7s %10s %10s\n' "$mode" "$n" "$lsh" "$gnu"
+  done
+done
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Check that lsh starts quickly even with a large rc file.
+#
+# Usage: bench/startup.sh [TARGET_MS]
+#
+# Starts an interactive lsh (input from /dev/null, so it exits at its first
+# prompt) RUNS times, with no rc file and with a generated rc file of LINES
+# lines (mostly comments, as real ones are, plus exports and a cd), and
+# prints the average wall time per start of each.  Exec and dynamic loading
+# are outside the shell's control and vary a lot between machines, so the
+# check is on what --startup-stats reports from main() to the first prompt
+# with the large rc file: the fastest of RUNS/10 starts must be within
+# TARGET_MS (default 1).  LSH, CC, RUNS and LINES can be set in the
+# environment.
+
+set -e
+
+TARGET_MS=${1:-1}
+RUNS=${RUNS:-200}
+LINES=${LINES:-20000}
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/lsh-startup.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+$CC -O2 -o "$work/measure" "$here/measure.c"
+if [ -z "$LSH" ]; then
+  LSH=$work/lsh
+  $CC -O2 -pthread -o "$LSH" "$here/../src/main.c"
+fi
+
+# One line in 100 does something; the rest is commentary and spacing.
+awk -v n="$LINES" 'BEGIN {
+  for (i = 0; i < n; i++) {
+    if (i % 100 == 0)
+      printf "export LSH_BENCH_%d=value_%d\n", i, i
+    else if (i % 100 == 50)
+      print ""
+    else
+      printf "# setting %d: a comment explaining some configuration\n", i
+  }
+  print "cd /"
+}' > "$work/lshrc"
+: > "$work/empty"
+
+# per_run RCFILE prints the average milliseconds per start.
+per_run() {
+  LSHRC=$1 "$work/measure" -n "$RUNS" "$LSH" < /dev/null \
+    | awk -v runs="$RUNS" '{ printf "%.3f", $1 / runs }'
+}
+
+empty=$(per_run "$work/empty")
+large=$(per_run "$work/lshrc")
+echo "no rc file:           ${empty}ms per start"
+echo "rc file, $LINES lines: ${large}ms per start"
+LSHRC=$work/lshrc "$LSH" --startup-stats < /dev/null 2>&1 >/dev/null \
+  | sed 's/^/  /'
+
+best=
+i=0
+while [ "$i" -lt $((RUNS / 10)) ]; do
+  ms=$(LSHRC=$work/lshrc "$LSH" --startup-stats < /dev/null 2>&1 >/dev/null \
+       | awk '/from main/ { sub("ms", "", $3); print $3 }')
+  if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+    best=$ms
+  fi
+  i=$((i + 1))
+done
+echo "main() to first prompt with the large rc file: ${best}ms" \
+  "(target ${TARGET_MS}ms)"
+
+if awk "BEGIN { exit !($best > $TARGET_MS) }"; then
+  echo "FAIL: start-up exceeds ${TARGET_MS}ms"
+  exit 1
+fi
+echo "OK"
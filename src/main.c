@@ -10,12 +10,95 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sched.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+  Static probes.  With <sys/sdt.h> (systemtap-sdt-dev) available, the shell
+  carries USDT probes in provider "lsh" that bpftrace, perf or SystemTap can
+  attach to in a running shell.  Each probe has a semaphore in the .probes
+  section, which tracers raise while attached, so durations are only measured
+  when someone is listening.  Without the header the probes compile to
+  nothing.
+
+    read_line_return(line, ns)   split_line_return(ntokens, ns)
+    builtin(name, ns)            fork(name, pid, ns)
+    exec(name)                   wait(pid, status, ns)
+*/
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define LSH_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef LSH_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define LSH_PROBE_SEMAPHORE(name) \
+  volatile unsigned short lsh_##name##_semaphore \
+  __attribute__((unused, section(".probes")))
+#define LSH_PROBE_ENABLED(name) __builtin_expect(lsh_##name##_semaphore, 0)
+#define LSH_PROBE1(name, a) STAP_PROBE1(lsh, name, a)
+#define LSH_PROBE2(name, a, b) STAP_PROBE2(lsh, name, a, b)
+#define LSH_PROBE3(name, a, b, c) STAP_PROBE3(lsh, name, a, b, c)
+#else
+#define LSH_PROBE_SEMAPHORE(name) extern int lsh_##name##_semaphore_unused
+#define LSH_PROBE_ENABLED(name) 0
+#define LSH_PROBE1(name, a) do { (void)(a); } while (0)
+#define LSH_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define LSH_PROBE3(name, a, b, c) \
+  do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+LSH_PROBE_SEMAPHORE(read_line_return);
+LSH_PROBE_SEMAPHORE(split_line_return);
+LSH_PROBE_SEMAPHORE(builtin);
+LSH_PROBE_SEMAPHORE(fork);
+LSH_PROBE_SEMAPHORE(exec);
+LSH_PROBE_SEMAPHORE(wait);
+
+/**
+   @brief Monotonic time in nanoseconds, for probe durations.
+ */
+static inline uint64_t lsh_probe_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 /*
   Function Declarations for builtin shell commands:
@@ -23,6 +106,26 @@
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
+int lsh_export(char **args);
+int lsh_jobs_builtin(char **args);
+int lsh_kill(char **args);
+int lsh_sleep(char **args);
+int lsh_head(char **args);
+int lsh_tail(char **args);
+int lsh_wc(char **args);
+int lsh_fgrep(char **args);
+int lsh_cut(char **args);
+int lsh_sort(char **args);
+int lsh_count(char **args);
+int lsh_jget(char **args);
+int lsh_seq(char **args);
+int lsh_cp(char **args);
+int lsh_mv(char **args);
+int lsh_hashsum(char **args);
+int lsh_onchange(char **args);
+int lsh_ulimit(char **args);
+int lsh_jtop(char **args);
+int lsh_profile(char **args);
 
 /*
   List of builtin commands, followed by their corresponding functions.
@@ -30,13 +133,53 @@ int lsh_exit(char **args);
 char *builtin_str[] = {
   "cd",
   "help",
-  "exit"
+  "exit",
+  "export",
+  "jobs",
+  "kill",
+  "sleep",
+  "head",
+  "tail",
+  "wc",
+  "fgrep",
+  "cut",
+  "sort",
+  "count",
+  "jget",
+  "seq",
+  "cp",
+  "mv",
+  "hashsum",
+  "onchange",
+  "ulimit",
+  "jtop",
+  "profile"
 };
 
 int (*builtin_func[]) (char **) = {
   &lsh_cd,
   &lsh_help,
-  &lsh_exit
+  &lsh_exit,
+  &lsh_export,
+  &lsh_jobs_builtin,
+  &lsh_kill,
+  &lsh_sleep,
+  &lsh_head,
+  &lsh_tail,
+  &lsh_wc,
+  &lsh_fgrep,
+  &lsh_cut,
+  &lsh_sort,
+  &lsh_count,
+  &lsh_jget,
+  &lsh_seq,
+  &lsh_cp,
+  &lsh_mv,
+  &lsh_hashsum,
+  &lsh_onchange,
+  &lsh_ulimit,
+  &lsh_jtop,
+  &lsh_profile
 };
 
 int lsh_num_builtins() {
@@ -44,240 +187,8691 @@ int lsh_num_builtins() {
 }
 
 /*
-  Builtin function implementations.
+  Per-command arena.  Anything allocated while expanding and running a single
+  command line comes from here, and is released in one go by lsh_loop() once
+  the command has finished.
 */
+#define LSH_ARENA_BLOCKSIZE (64 * 1024)
+
+struct lsh_arena_block {
+  struct lsh_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct lsh_arena {
+  struct lsh_arena_block *head;
+};
+
+struct lsh_arena lsh_cmd_arena = { NULL };
 
 /**
-   @brief Builtin command: change directory.
-   @param args List of args.  args[0] is "cd".  args[1] is the directory.
-   @return Always returns 1, to continue executing.
+   @brief Allocate memory from an arena.
+   @param arena The arena to allocate from.
+   @param size Number of bytes needed.
+   @return Pointer to the memory, aligned for any type.  Never NULL.
  */
-int lsh_cd(char **args)
+void *lsh_arena_alloc(struct lsh_arena *arena, size_t size)
 {
-  if (args[1] == NULL) {
-    fprintf(stderr, "lsh: expected argument to \"cd\"\n");
-  } else {
-    if (chdir(args[1]) != 0) {
-      perror("lsh");
+  struct lsh_arena_block *block = arena->head;
+  size_t start;
+
+  size = (size + 15) & ~(size_t)15;
+  if (!block || block->size - block->used < size) {
+    size_t blocksize = size > LSH_ARENA_BLOCKSIZE ? size : LSH_ARENA_BLOCKSIZE;
+    block = malloc(sizeof(struct lsh_arena_block) + blocksize);
+    if (!block) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
     }
+    block->size = blocksize;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+  start = block->used;
+  block->used += size;
+  return block->data + start;
+}
+
+/**
+   @brief Try to grow the most recent allocation in place.
+   @param arena The arena the allocation came from.
+   @param ptr The allocation.
+   @param oldsize Size it was allocated with.
+   @param newsize Size it should have.
+   @return 1 if the allocation now has newsize bytes, 0 if it could not grow.
+ */
+int lsh_arena_extend(struct lsh_arena *arena, void *ptr, size_t oldsize,
+                     size_t newsize)
+{
+  struct lsh_arena_block *block = arena->head;
+  size_t start;
+
+  if (!block || (char *)ptr < block->data
+      || (char *)ptr >= block->data + block->size) {
+    return 0;
   }
+  start = (char *)ptr - block->data;
+  oldsize = (oldsize + 15) & ~(size_t)15;
+  newsize = (newsize + 15) & ~(size_t)15;
+  if (start + oldsize != block->used || start + newsize > block->size) {
+    return 0;
+  }
+  block->used = start + newsize;
   return 1;
 }
 
 /**
-   @brief Builtin command: print help.
-   @param args List of args.  Not examined.
-   @return Always returns 1, to continue executing.
+   @brief Release everything allocated from an arena.
+   @param arena The arena.
+   The first block is kept around so that the next command doesn't need to
+   call malloc() at all.
  */
-int lsh_help(char **args)
+void lsh_arena_reset(struct lsh_arena *arena)
 {
-  int i;
-  printf("Stephen Brennan's LSH\n");
-  printf("Type program names and arguments, and hit enter.\n");
-  printf("The following are built in:\n");
+  struct lsh_arena_block *block = arena->head, *next;
 
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
+  if (!block) {
+    return;
+  }
+  while (block->next) {
+    next = block->next;
+    block->next = next->next;
+    free(next);
   }
+  block->used = 0;
+}
 
-  printf("Use the man command for information on other programs.\n");
-  return 1;
+/*
+  A point in an arena's history, for commands that run other commands many
+  times within one command line and must not keep what each run allocated.
+*/
+struct lsh_arena_mark {
+  struct lsh_arena_block *block;
+  size_t used;
+};
+
+/**
+   @brief Remember how much of an arena is in use.
+   @param arena The arena.
+   @param mark Filled in, for lsh_arena_release().
+ */
+void lsh_arena_mark(struct lsh_arena *arena, struct lsh_arena_mark *mark)
+{
+  mark->block = arena->head;
+  mark->used = arena->head ? arena->head->used : 0;
 }
 
 /**
-   @brief Builtin command: exit.
-   @param args List of args.  Not examined.
-   @return Always returns 0, to terminate execution.
+   @brief Release everything allocated from an arena since a mark.
+   @param arena The arena.
+   @param mark From lsh_arena_mark().
+   Blocks are kept newest first, so this frees the ones added since the mark
+   and rewinds the one that was current then.
  */
-int lsh_exit(char **args)
+void lsh_arena_release(struct lsh_arena *arena,
+                       const struct lsh_arena_mark *mark)
 {
-  return 0;
+  struct lsh_arena_block *block;
+
+  while (arena->head && arena->head != mark->block) {
+    block = arena->head;
+    arena->head = block->next;
+    free(block);
+  }
+  if (arena->head) {
+    arena->head->used = mark->used;
+  }
 }
 
 /**
-  @brief Launch a program and wait for it to terminate.
-  @param args Null terminated list of arguments (including program).
-  @return Always returns 1, to continue execution.
+   @brief Free an arena and all of its blocks.
+   @param arena The arena.
  */
-int lsh_launch(char **args)
+void lsh_arena_free(struct lsh_arena *arena)
 {
-  pid_t pid;
-  int status;
+  struct lsh_arena_block *block = arena->head, *next;
 
-  pid = fork();
-  if (pid == 0) {
-    // Child process
-    if (execvp(args[0], args) == -1) {
-      perror("lsh");
-    }
-    exit(EXIT_FAILURE);
-  } else if (pid < 0) {
-    // Error forking
-    perror("lsh");
-  } else {
-    // Parent process
-    do {
-      waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+  while (block) {
+    next = block->next;
+    free(block);
+    block = next;
   }
+  arena->head = NULL;
+}
 
-  return 1;
+/*
+  File descriptor registry.  Every descriptor the shell itself keeps open is
+  registered here and opened close-on-exec.  Children go through
+  lsh_fd_sanitize() between fork and exec, which marks everything from 3 up
+  close-on-exec in a single close_range() call, skipping only descriptors
+  explicitly marked to be inherited by the command being launched.  That keeps
+  launch cost independent of how many descriptors the shell holds.
+*/
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+#define LSH_FD_INHERIT 1
+
+struct lsh_fd {
+  int fd;
+  int flags;
+};
+
+struct lsh_fd *lsh_fds = NULL;
+int lsh_fd_count = 0;
+int lsh_fd_cap = 0;
+
+/**
+   @brief Register a descriptor owned by the shell and make it close-on-exec.
+   @param fd The descriptor.
+   @return fd, so that calls can be wrapped around open() and friends.
+ */
+int lsh_fd_register(int fd)
+{
+  struct lsh_fd *newfds;
+
+  if (fd < 0) {
+    return fd;
+  }
+  if (lsh_fd_count >= lsh_fd_cap) {
+    lsh_fd_cap = lsh_fd_cap ? lsh_fd_cap * 2 : 16;
+    newfds = realloc(lsh_fds, lsh_fd_cap * sizeof(struct lsh_fd));
+    if (!newfds) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    lsh_fds = newfds;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  lsh_fds[lsh_fd_count].fd = fd;
+  lsh_fds[lsh_fd_count].flags = 0;
+  lsh_fd_count++;
+  return fd;
 }
 
 /**
-   @brief Execute shell built-in or launch program.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate
+   @brief Remove a descriptor from the registry and close it.
+   @param fd The descriptor.
+   @return Result of close().
  */
-int lsh_execute(char **args)
+int lsh_fd_close(int fd)
 {
   int i;
 
-  if (args[0] == NULL) {
-    // An empty command was entered.
-    return 1;
+  for (i = 0; i < lsh_fd_count; i++) {
+    if (lsh_fds[i].fd == fd) {
+      lsh_fds[i] = lsh_fds[--lsh_fd_count];
+      break;
+    }
   }
+  return close(fd);
+}
 
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
+/**
+   @brief Mark whether a registered descriptor is passed on to children.
+   @param fd The descriptor.
+   @param inherit Nonzero to let children launched from now on inherit it.
+ */
+void lsh_fd_set_inherit(int fd, int inherit)
+{
+  int i;
+
+  for (i = 0; i < lsh_fd_count; i++) {
+    if (lsh_fds[i].fd == fd) {
+      if (inherit) {
+        lsh_fds[i].flags |= LSH_FD_INHERIT;
+      } else {
+        lsh_fds[i].flags &= ~LSH_FD_INHERIT;
+      }
+      return;
     }
   }
+}
+
+/**
+   @brief Mark every descriptor from lo up close-on-exec by listing
+   /proc/self/fd, for kernels without close_range().
+   @param lo Lowest descriptor to mark.
+   Uses only system calls, since it runs between fork and exec.
+ */
+static void lsh_fd_cloexec_from(int lo)
+{
+  char buf[4096];
+  struct dirent64 *d;
+  long n, off;
+  int dir, fd;
 
-  return lsh_launch(args);
+  dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) {
+    return;
+  }
+  while ((n = syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct dirent64 *)(buf + off);
+      fd = atoi(d->d_name);
+      if (d->d_name[0] != '.' && fd >= lo && fd != dir) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+  }
+  close(dir);
 }
 
 /**
-   @brief Read a line of input from stdin.
-   @return The line from stdin.
+   @brief Mark every descriptor above stderr close-on-exec, except inherited
+   ones.  Called in the child between fork and exec.
  */
-char *lsh_read_line(void)
+void lsh_fd_sanitize(void)
 {
-#ifdef LSH_USE_STD_GETLINE
-  char *line = NULL;
-  ssize_t bufsize = 0; // have getline allocate a buffer for us
-  if (getline(&line, &bufsize, stdin) == -1) {
-    if (feof(stdin)) {
-      exit(EXIT_SUCCESS);  // We received an EOF
-    } else  {
-      perror("lsh: getline\n");
-      exit(EXIT_FAILURE);
+  struct lsh_fd tmp;
+  int nkeep = 0, i, j;
+  unsigned int lo = 3;
+
+  // The child's copy of the registry is ours to reorder: move the inherited
+  // descriptors to the front, sorted, without allocating.
+  for (i = 0; i < lsh_fd_count; i++) {
+    if ((lsh_fds[i].flags & LSH_FD_INHERIT) && lsh_fds[i].fd >= 3) {
+      tmp = lsh_fds[i];
+      lsh_fds[i] = lsh_fds[nkeep];
+      for (j = nkeep; j > 0 && lsh_fds[j - 1].fd > tmp.fd; j--) {
+        lsh_fds[j] = lsh_fds[j - 1];
+      }
+      lsh_fds[j] = tmp;
+      nkeep++;
     }
   }
-  return line;
-#else
-#define LSH_RL_BUFSIZE 1024
-  int bufsize = LSH_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
 
-  if (!buffer) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+#ifdef SYS_close_range
+  for (i = 0; i <= nkeep; i++) {
+    unsigned int hi = i < nkeep ? (unsigned int)lsh_fds[i].fd - 1 : ~0U;
+    if (lo <= hi
+        && syscall(SYS_close_range, lo, hi, CLOSE_RANGE_CLOEXEC) != 0) {
+      goto fallback;
+    }
+    if (i < nkeep) {
+      lo = lsh_fds[i].fd + 1;
+    }
+  }
+  goto inherit;
+fallback:
+#endif
+  (void)lo;
+  lsh_fd_cloexec_from(3);
+inherit:
+  for (i = 0; i < nkeep; i++) {
+    fcntl(lsh_fds[i].fd, F_SETFD, 0);
   }
+}
 
-  while (1) {
-    // Read a character
-    c = getchar();
+/**
+   @brief Close the shell's own descriptors in a child that runs a builtin.
+   Without an exec, close-on-exec never takes effect, and a builtin holding
+   the write end of its own input pipe would never see end of file.
+ */
+void lsh_fd_drop_private(void)
+{
+  int i, n = 0;
 
-    if (c == EOF) {
-      exit(EXIT_SUCCESS);
-    } else if (c == '\n') {
-      buffer[position] = '\0';
-      return buffer;
+  for (i = 0; i < lsh_fd_count; i++) {
+    if (lsh_fds[i].flags & LSH_FD_INHERIT) {
+      lsh_fds[n++] = lsh_fds[i];
     } else {
-      buffer[position] = c;
-    }
-    position++;
-
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += LSH_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
-      if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
+      close(lsh_fds[i].fd);
     }
   }
-#endif
+  lsh_fd_count = n;
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
+/*
+  Growable string whose storage lives in an arena.
+*/
+struct lsh_buf {
+  struct lsh_arena *arena;
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
 /**
-   @brief Split a line into tokens (very naively).
-   @param line The line.
-   @return Null-terminated array of tokens.
+   @brief Start an empty string in an arena.
+   @param buf The string.
+   @param arena Arena to allocate from.
+   @param hint Expected length of the string.
  */
-char **lsh_split_line(char *line)
+void lsh_buf_init(struct lsh_buf *buf, struct lsh_arena *arena, size_t hint)
 {
-  int bufsize = LSH_TOK_BUFSIZE, position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token, **tokens_backup;
+  buf->arena = arena;
+  buf->cap = hint < 32 ? 32 : hint + 1;
+  buf->data = lsh_arena_alloc(arena, buf->cap);
+  buf->len = 0;
+  buf->data[0] = '\0';
+}
 
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+/**
+   @brief Append bytes to an arena string, keeping it NUL terminated.
+   @param buf The string.
+   @param data Bytes to append.
+   @param len Number of bytes.
+ */
+void lsh_buf_append(struct lsh_buf *buf, const char *data, size_t len)
+{
+  if (buf->len + len + 1 > buf->cap) {
+    size_t newcap = buf->cap * 2;
+    char *newdata;
+
+    if (newcap < buf->len + len + 1) {
+      newcap = buf->len + len + 1;
+    }
+    if (lsh_arena_extend(buf->arena, buf->data, buf->cap, newcap)) {
+      buf->cap = newcap;
+    } else {
+      newdata = lsh_arena_alloc(buf->arena, newcap);
+      memcpy(newdata, buf->data, buf->len);
+      buf->data = newdata;
+      buf->cap = newcap;
+    }
   }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
 
-  token = strtok(line, LSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
+/*
+  Bulk input and output for the text-processing builtins.  Regular files are
+  mapped whole; anything else (pipes, terminals) is read in large blocks.
+  Output is gathered into a large buffer and written with few big write()s.
+*/
+#define LSH_IO_BLOCKSIZE (1024 * 1024)
+#define LSH_OUT_BUFSIZE (256 * 1024)
 
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
-      tokens_backup = tokens;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
-      if (!tokens) {
-		free(tokens_backup);
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
+/**
+   @brief Write a whole buffer to a descriptor, retrying short writes.
+   @return 0 on success, -1 on error (errno is set).
+ */
+int lsh_write_all(int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      return -1;
     }
-
-    token = strtok(NULL, LSH_TOK_DELIM);
+    data += n;
+    len -= n;
   }
-  tokens[position] = NULL;
-  return tokens;
+  return 0;
 }
 
+struct lsh_out {
+  int fd;
+  int error;
+  size_t len;
+  char *buf;
+};
+
 /**
-   @brief Loop getting input and executing it.
+   @brief Set up a buffered output stream in the command arena.
+   @param out The stream.
+   @param fd Descriptor it writes to.
  */
-void lsh_loop(void)
+void lsh_out_init(struct lsh_out *out, int fd)
 {
-  char *line;
-  char **args;
-  int status;
+  // Anything stdio has buffered must come out first.
+  fflush(stdout);
+  out->fd = fd;
+  out->error = 0;
+  out->len = 0;
+  out->buf = lsh_arena_alloc(&lsh_cmd_arena, LSH_OUT_BUFSIZE);
+}
 
-  do {
-    printf("> ");
-    line = lsh_read_line();
-    args = lsh_split_line(line);
-    status = lsh_execute(args);
+/**
+   @brief Write out everything buffered so far.
+   @param out The stream.
+   @return 0 on success, -1 if this or any earlier write failed.
+ */
+int lsh_out_flush(struct lsh_out *out)
+{
+  if (out->len > 0 && !out->error
+      && lsh_write_all(out->fd, out->buf, out->len) != 0) {
+    out->error = errno;
+  }
+  out->len = 0;
+  return out->error ? -1 : 0;
+}
 
-    free(line);
-    free(args);
-  } while (status);
+/**
+   @brief Append bytes to an output stream.
+   @param out The stream.
+   @param data Bytes to write.
+   @param len Number of bytes.
+   Writes at least as large as the buffer bypass it.
+ */
+void lsh_out_write(struct lsh_out *out, const char *data, size_t len)
+{
+  if (out->len + len > LSH_OUT_BUFSIZE) {
+    lsh_out_flush(out);
+    if (len >= LSH_OUT_BUFSIZE) {
+      if (!out->error && lsh_write_all(out->fd, data, len) != 0) {
+        out->error = errno;
+      }
+      return;
+    }
+  }
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
 }
 
 /**
-   @brief Main entry point.
-   @param argc Argument count.
-   @param argv Argument vector.
-   @return status code
+   @brief printf() to an output stream.
+   Formats straight into the buffer, flushing it first if the text doesn't
+   fit.  Text longer than the whole buffer is formatted on the heap.
  */
-int main(int argc, char **argv)
+void lsh_out_printf(struct lsh_out *out, const char *fmt, ...)
 {
-  // Load config files, if any.
+  size_t room = LSH_OUT_BUFSIZE - out->len;
+  va_list ap;
+  char *big;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(out->buf + out->len, room, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    return;
+  } else if ((size_t)n < room) {
+    out->len += n;
+    return;
+  }
+
+  lsh_out_flush(out);
+  if ((size_t)n < LSH_OUT_BUFSIZE) {
+    va_start(ap, fmt);
+    vsnprintf(out->buf, LSH_OUT_BUFSIZE, fmt, ap);
+    va_end(ap);
+    out->len = n;
+    return;
+  }
+  big = malloc((size_t)n + 1);
+  if (!big) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  va_start(ap, fmt);
+  vsnprintf(big, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  lsh_out_write(out, big, n);
+  free(big);
+}
+
+/**
+   @brief Open an input file for a builtin.
+   @param name File name, or "-" for standard input.
+   @return A registered descriptor, or -1 (after printing an error).
+ */
+int lsh_open_input(const char *cmd, const char *name)
+{
+  int fd;
+
+  if (strcmp(name, "-") == 0) {
+    return STDIN_FILENO;
+  }
+  fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, name, strerror(errno));
+    return -1;
+  }
+  return lsh_fd_register(fd);
+}
+
+/**
+   @brief Close a descriptor returned by lsh_open_input().
+ */
+void lsh_close_input(int fd)
+{
+  if (fd != STDIN_FILENO) {
+    lsh_fd_close(fd);
+  }
+}
+
+/**
+   @brief Map a regular file into memory.
+   @param fd The file.
+   @param len Set to its length.
+   @return The mapping, or NULL if fd is not a non-empty regular file or could
+   not be mapped.  Release it with munmap().
+ */
+char *lsh_map_input(int fd, size_t *len)
+{
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  *len = st.st_size;
+  return map;
+}
+
+/*
+  Callback for lsh_scan_fd().  Returns 0 to keep going, nonzero to stop.
+*/
+typedef int (*lsh_scan_fn)(const char *data, size_t len, void *ctx);
+
+/**
+   @brief Feed the whole contents of a descriptor to a callback.
+   @param fd The descriptor.
+   @param fn Called with one mapping of the whole file, or once per block.
+   @param ctx Passed through to fn.
+   @return 0 at end of input, 1 if fn stopped early, -1 on a read error.
+ */
+int lsh_scan_fd(int fd, lsh_scan_fn fn, void *ctx)
+{
+  char *map, *block;
+  size_t len;
+  ssize_t n;
+  int r;
+
+  map = lsh_map_input(fd, &len);
+  if (map) {
+    madvise(map, len, MADV_SEQUENTIAL);
+    r = fn(map, len, ctx) ? 1 : 0;
+    munmap(map, len);
+    return r;
+  }
+
+  block = lsh_arena_alloc(&lsh_cmd_arena, LSH_IO_BLOCKSIZE);
+  while ((n = read(fd, block, LSH_IO_BLOCKSIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (fn(block, n, ctx)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Feed the contents of a descriptor to a callback in whole lines.
+   @param fd The descriptor.
+   @param fn Called with buffers that end just after a newline (except
+   possibly the very last one, if the input doesn't end with a newline).
+   @param ctx Passed through to fn.
+   @return 0 at end of input, 1 if fn stopped early, -1 on a read error.
+ */
+int lsh_scan_lines(int fd, lsh_scan_fn fn, void *ctx)
+{
+  char *map, *buf, *newbuf, *nl;
+  size_t len, cap = LSH_IO_BLOCKSIZE, used = 0, whole;
+  ssize_t n;
+  int r = 0;
+
+  map = lsh_map_input(fd, &len);
+  if (map) {
+    madvise(map, len, MADV_SEQUENTIAL);
+    r = fn(map, len, ctx) ? 1 : 0;
+    munmap(map, len);
+    return r;
+  }
+
+  buf = malloc(cap);
+  if (!buf) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  while (1) {
+    if (used == cap) {
+      // A single line longer than the buffer.
+      cap *= 2;
+      newbuf = realloc(buf, cap);
+      if (!newbuf) {
+        free(buf);
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      buf = newbuf;
+    }
+    n = read(fd, buf + used, cap - used);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      r = -1;
+      break;
+    } else if (n == 0) {
+      if (used > 0 && fn(buf, used, ctx)) {
+        r = 1;
+      }
+      break;
+    }
+    nl = memrchr(buf + used, '\n', n);
+    used += n;
+    if (!nl) {
+      continue;
+    }
+    whole = nl - buf + 1;
+    if (fn(buf, whole, ctx)) {
+      r = 1;
+      break;
+    }
+    memmove(buf, buf + whole, used - whole);
+    used -= whole;
+  }
+  free(buf);
+  return r;
+}
+
+/**
+   @brief Count occurrences of a byte.
+   @param data Bytes to search.
+   @param len Number of bytes.
+   @param c Byte to count.
+   @return Number of occurrences.
+ */
+size_t lsh_count_byte(const char *data, size_t len, char c)
+{
+  size_t count = 0, i = 0;
+
+#if defined(__AVX2__)
+  __m256i needle = _mm256_set1_epi8(c);
+  for (; i + 64 <= len; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+    uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, needle));
+    uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, needle));
+    count += __builtin_popcountll(lo | (hi << 32));
+  }
+#elif defined(__SSE2__)
+  __m128i needle = _mm_set1_epi8(c);
+  for (; i + 64 <= len; i += 64) {
+    uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(data + i)), needle));
+    uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(data + i + 16)), needle));
+    uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(data + i + 32)), needle));
+    uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)(data + i + 48)), needle));
+    count += __builtin_popcountll(m0 | (m1 << 16) | (m2 << 32) | (m3 << 48));
+  }
+#else
+  const char *p;
+  while (i < len && (p = memchr(data + i, c, len - i)) != NULL) {
+    count++;
+    i = p - data + 1;
+  }
+  return count;
+#endif
+  for (; i < len; i++) {
+    count += (data[i] == c);
+  }
+  return count;
+}
+
+/**
+   @brief Parse a line count argument for head and tail.
+   @return The count, or -1 if it is not a non-negative integer.
+ */
+long lsh_parse_count(const char *str)
+{
+  char *end;
+  long n;
+
+  n = strtol(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || n < 0) {
+    return -1;
+  }
+  return n;
+}
+
+/**
+   @brief Parse "-n N", "-nN" and "-N" options shared by head and tail.
+   @param args Argument list; args[0] is the command name.
+   @param lines Set to the requested count (left alone if not given).
+   @return Index of the first file argument, or -1 on a usage error.
+ */
+int lsh_parse_lines_opt(char **args, long *lines)
+{
+  int i = 1;
+
+  while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0') {
+    if (strcmp(args[i], "--") == 0) {
+      return i + 1;
+    } else if (strcmp(args[i], "-n") == 0 && args[i + 1]) {
+      *lines = lsh_parse_count(args[++i]);
+    } else if (strncmp(args[i], "-n", 2) == 0) {
+      *lines = lsh_parse_count(args[i] + 2);
+    } else {
+      *lines = lsh_parse_count(args[i] + 1);
+    }
+    if (*lines < 0) {
+      fprintf(stderr, "lsh: %s: invalid number of lines \"%s\"\n", args[0],
+              args[i]);
+      return -1;
+    }
+    i++;
+  }
+  return i;
+}
+
+/*
+  Parallel loops for builtins that can split their work.  Workers (the calling
+  thread is one of them) claim task indices from a shared counter until none
+  are left, so uneven tasks balance out on their own.
+*/
+#define LSH_MAX_THREADS 64
+
+typedef void (*lsh_task_fn)(void *ctx, size_t task);
+
+struct lsh_parallel {
+  lsh_task_fn fn;
+  void *ctx;
+  size_t ntasks;
+  size_t next;
+};
+
+static void *lsh_parallel_worker(void *arg)
+{
+  struct lsh_parallel *par = arg;
+  size_t task;
+
+  while ((task = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED))
+         < par->ntasks) {
+    par->fn(par->ctx, task);
+  }
+  return NULL;
+}
+
+/**
+   @brief Number of threads builtins use by default.
+ */
+int lsh_default_threads(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1) {
+    return 1;
+  }
+  return n > LSH_MAX_THREADS ? LSH_MAX_THREADS : (int)n;
+}
+
+/**
+   @brief Run fn(ctx, i) for every i below ntasks on up to nthreads threads.
+   @param ntasks Number of tasks.
+   @param nthreads Maximum number of threads, including the caller.
+   @param fn Task function.
+   @param ctx Passed through to fn.
+   Returns once every task has finished.
+ */
+void lsh_parallel_for(size_t ntasks, int nthreads, lsh_task_fn fn, void *ctx)
+{
+  struct lsh_parallel par = { fn, ctx, ntasks, 0 };
+  pthread_t threads[LSH_MAX_THREADS];
+  int i, started = 0;
+
+  if (nthreads > LSH_MAX_THREADS) {
+    nthreads = LSH_MAX_THREADS;
+  }
+  if ((size_t)nthreads > ntasks) {
+    nthreads = ntasks;
+  }
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, lsh_parallel_worker,
+                       &par) == 0) {
+      started++;
+    }
+  }
+  lsh_parallel_worker(&par);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/**
+   @brief Parse a size such as "512K", "64M" or "2G".
+   @return The size in bytes, or 0 if it is malformed.
+ */
+size_t lsh_parse_size(const char *str)
+{
+  char *end;
+  double n = strtod(str, &end);
+
+  if (end == str || n < 0) {
+    return 0;
+  }
+  switch (*end) {
+  case 'k': case 'K': n *= 1024; end++; break;
+  case 'm': case 'M': n *= 1024 * 1024; end++; break;
+  case 'g': case 'G': n *= 1024.0 * 1024 * 1024; end++; break;
+  case 't': case 'T': n *= 1024.0 * 1024 * 1024 * 1024; end++; break;
+  }
+  if (*end == 'b' || *end == 'B') {
+    end++;
+  }
+  return *end == '\0' ? (size_t)n : 0;
+}
+
+/*
+  Resource usage of finished commands, collected with wait4().  The limit
+  fields remember which CPU and memory limits applied to the command, so
+  that a termination caused by one of them can be reported as such.
+*/
+struct lsh_usage {
+  int status;          // wait status
+  struct rusage ru;
+  rlim_t cpu_limit;    // seconds, or RLIM_INFINITY
+  int mem_limited;     // an address space, data or stack limit was set
+};
+
+struct lsh_usage lsh_last_usage;
+long lsh_waits = 0;     // foreground commands waited for so far
+
+/**
+   @brief Work out whether a command was terminated by a resource limit.
+   @param u Usage record of the finished command.
+   @return A description of the limit, or NULL.
+ */
+const char *lsh_usage_limit(const struct lsh_usage *u)
+{
+  int sig;
+  double cpu;
+
+  if (!WIFSIGNALED(u->status)) {
+    return NULL;
+  }
+  sig = WTERMSIG(u->status);
+  cpu = u->ru.ru_utime.tv_sec + u->ru.ru_utime.tv_usec / 1e6
+      + u->ru.ru_stime.tv_sec + u->ru.ru_stime.tv_usec / 1e6;
+  if (sig == SIGXCPU
+      || (sig == SIGKILL && u->cpu_limit != RLIM_INFINITY
+          && cpu >= (double)u->cpu_limit)) {
+    return "CPU time limit";
+  } else if (sig == SIGXFSZ) {
+    return "file size limit";
+  } else if (u->mem_limited
+             && (sig == SIGSEGV || sig == SIGBUS || sig == SIGABRT)) {
+    return "memory limit";
+  }
+  return NULL;
+}
+
+/*
+  Job table.  Commands ending in '&' run in the background and are recorded
+  here, together with a pidfd where the kernel supports them, so that signals
+  sent by the kill builtin can never hit a recycled pid.  Each job runs in its
+  own process group, led by the job's process, so a pipeline's stages are
+  signalled along with the shell that waits for them; the group id cannot be
+  reused while the unreaped leader is in the table.  Finished jobs are reaped
+  and reported before each prompt.
+*/
+struct lsh_job {
+  int id;
+  pid_t pid;
+  pid_t pgid;      // process group of the whole job
+  int pidfd;
+  char *cmd;
+  struct lsh_usage usage;
+  struct lsh_job *next;
+};
+
+struct lsh_job *lsh_jobs = NULL;
+
+/*
+  Children that belong to a background command but are not its job, such as
+  the inner commands of its process substitutions.  They are reaped quietly.
+*/
+pid_t *lsh_strays = NULL;
+int lsh_stray_count = 0;
+int lsh_stray_cap = 0;
+
+/**
+   @brief Leave a child to be reaped by lsh_jobs_reap().
+   @param pid The child.
+ */
+void lsh_stray_add(pid_t pid)
+{
+  pid_t *newstrays;
+
+  if (lsh_stray_count >= lsh_stray_cap) {
+    lsh_stray_cap = lsh_stray_cap ? lsh_stray_cap * 2 : 16;
+    newstrays = realloc(lsh_strays, lsh_stray_cap * sizeof(pid_t));
+    if (!newstrays) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    lsh_strays = newstrays;
+  }
+  lsh_strays[lsh_stray_count++] = pid;
+}
+
+/**
+   @brief Add a background process to the job table.
+   @param pid The process.
+   @param args Its arguments, used to describe the job.
+   @return The new job.
+ */
+struct lsh_job *lsh_job_add(pid_t pid, char **args)
+{
+  struct lsh_job *job, **tail;
+  size_t len = 0;
+  int i, id = 1;
+
+  for (job = lsh_jobs; job; job = job->next) {
+    if (job->id >= id) {
+      id = job->id + 1;
+    }
+  }
+  for (i = 0; args[i] != NULL; i++) {
+    len += strlen(args[i]) + 1;
+  }
+
+  job = malloc(sizeof(struct lsh_job));
+  if (job) {
+    job->cmd = malloc(len + 1);
+  }
+  if (!job || !job->cmd) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  job->cmd[0] = '\0';
+  for (i = 0; args[i] != NULL; i++) {
+    if (i > 0) {
+      strcat(job->cmd, " ");
+    }
+    strcat(job->cmd, args[i]);
+  }
+  job->id = id;
+  job->pid = pid;
+  job->pgid = getpgid(pid) == pid ? pid : -1;
+  memset(&job->usage, 0, sizeof(job->usage));
+  job->usage.cpu_limit = RLIM_INFINITY;
+#ifdef SYS_pidfd_open
+  job->pidfd = lsh_fd_register(syscall(SYS_pidfd_open, pid, 0));
+#else
+  job->pidfd = -1;
+#endif
+  job->next = NULL;
+  for (tail = &lsh_jobs; *tail; tail = &(*tail)->next);
+  *tail = job;
+  return job;
+}
+
+/**
+   @brief Look up a job from a job spec such as "%2", "%%" or "%+".
+   @param spec The job spec, including the leading '%'.
+   @return The job, or NULL if there is no such job.
+ */
+struct lsh_job *lsh_job_find(const char *spec)
+{
+  struct lsh_job *job, *last = NULL;
+  char *end;
+  long id;
+
+  if (spec[0] != '%') {
+    return NULL;
+  }
+  if (spec[1] == '\0' || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+    for (job = lsh_jobs; job; job = job->next) {
+      last = job;
+    }
+    return last;
+  }
+  id = strtol(spec + 1, &end, 10);
+  if (*end != '\0') {
+    return NULL;
+  }
+  for (job = lsh_jobs; job; job = job->next) {
+    if (job->id == id) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/**
+   @brief Reap finished background jobs and report them.
+ */
+void lsh_jobs_reap(void)
+{
+  struct lsh_job **link = &lsh_jobs, *job;
+  const char *limit;
+  int status, i;
+
+  for (i = 0; i < lsh_stray_count; ) {
+    if (waitpid(lsh_strays[i], &status, WNOHANG) != 0) {
+      lsh_strays[i] = lsh_strays[--lsh_stray_count];
+    } else {
+      i++;
+    }
+  }
+  while ((job = *link) != NULL) {
+    if (wait4(job->pid, &status, WNOHANG, &job->usage.ru) == job->pid
+        && (WIFEXITED(status) || WIFSIGNALED(status))) {
+      job->usage.status = status;
+      limit = lsh_usage_limit(&job->usage);
+      if (limit) {
+        fprintf(stderr, "[%d]  Killed (%s)  %s\n", job->id, limit,
+                job->cmd);
+      } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "[%d]  Killed (%s)  %s\n", job->id,
+                strsignal(WTERMSIG(status)), job->cmd);
+      } else if (WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "[%d]  Exit %d  %s\n", job->id, WEXITSTATUS(status),
+                job->cmd);
+      } else {
+        fprintf(stderr, "[%d]  Done  %s\n", job->id, job->cmd);
+      }
+      *link = job->next;
+      if (job->pidfd >= 0) {
+        lsh_fd_close(job->pidfd);
+      }
+      free(job->cmd);
+      free(job);
+    } else {
+      link = &job->next;
+    }
+  }
+}
+
+/*
+  Builtin function implementations.
+*/
+
+/**
+   @brief Builtin command: change directory.
+   @param args List of args.  args[0] is "cd".  args[1] is the directory.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_cd(char **args)
+{
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected argument to \"cd\"\n");
+  } else {
+    if (chdir(args[1]) != 0) {
+      perror("lsh");
+    }
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: print help.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_help(char **args)
+{
+  int i;
+  printf("Stephen Brennan's LSH\n");
+  printf("Type program names and arguments, and hit enter.\n");
+  printf("The following are built in:\n");
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    printf("  %s\n", builtin_str[i]);
+  }
+
+  printf("Prefix a command with @cpu=LIST, @nice=N or @ioprio=CLASS to adjust it,\n");
+  printf("or with @as=SIZE, @nofile=N, @cputime=SECS etc. to limit it.\n");
+  printf("Join commands with | to make a pipeline; @pipestat reports on it.\n");
+  printf("Use the man command for information on other programs.\n");
+  return 1;
+}
+
+/**
+   @brief Builtin command: exit.
+   @param args List of args.  Not examined.
+   @return Always returns 0, to terminate execution.
+ */
+int lsh_exit(char **args)
+{
+  return 0;
+}
+
+/**
+   @brief Builtin command: set environment variables.
+   @param args List of args.  args[0] is "export".  Remaining arguments are
+   NAME=value pairs.  With no arguments, the environment is printed.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_export(char **args)
+{
+  extern char **environ;
+  char **env, *eq;
+  int i;
+
+  if (args[1] == NULL) {
+    for (env = environ; *env; env++) {
+      printf("%s\n", *env);
+    }
+    return 1;
+  }
+
+  for (i = 1; args[i] != NULL; i++) {
+    eq = strchr(args[i], '=');
+    if (!eq || eq == args[i]) {
+      fprintf(stderr, "lsh: export: expected NAME=value, got \"%s\"\n",
+              args[i]);
+      continue;
+    }
+    *eq = '\0';
+    if (setenv(args[i], eq + 1, 1) != 0) {
+      perror("lsh: export");
+    }
+    *eq = '=';
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: list background jobs.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_jobs_builtin(char **args)
+{
+  struct lsh_job *job;
+
+  lsh_jobs_reap();
+  for (job = lsh_jobs; job; job = job->next) {
+    printf("[%d]  %d  Running  %s\n", job->id, (int)job->pid, job->cmd);
+  }
+  return 1;
+}
+
+/*
+  Signal names understood by kill.
+*/
+struct lsh_signame {
+  const char *name;
+  int sig;
+};
+
+struct lsh_signame lsh_signames[] = {
+  { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+  { "ILL", SIGILL }, { "ABRT", SIGABRT }, { "FPE", SIGFPE },
+  { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV },
+  { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+  { "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "CONT", SIGCONT },
+  { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+  { "TTOU", SIGTTOU }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+  { "WINCH", SIGWINCH },
+};
+
+/**
+   @brief Parse a signal name ("TERM", "SIGTERM") or number ("15").
+   @param name The name.
+   @return The signal number, or -1 if it is not recognized.
+ */
+int lsh_signal_parse(const char *name)
+{
+  size_t i;
+  char *end;
+  long sig;
+
+  if (strncmp(name, "SIG", 3) == 0) {
+    name += 3;
+  }
+  for (i = 0; i < sizeof(lsh_signames) / sizeof(lsh_signames[0]); i++) {
+    if (strcasecmp(name, lsh_signames[i].name) == 0) {
+      return lsh_signames[i].sig;
+    }
+  }
+  sig = strtol(name, &end, 10);
+  if (*name == '\0' || *end != '\0' || sig < 0 || sig >= NSIG) {
+    return -1;
+  }
+  return sig;
+}
+
+/**
+   @brief Builtin command: send a signal to jobs or processes.
+   @param args List of args.  args[0] is "kill".  An optional "-SIG",
+   "-s SIG" or "-l" is followed by pids or job specs ("%1").
+   @return Always returns 1, to continue executing.
+ */
+int lsh_kill(char **args)
+{
+  struct lsh_job *job;
+  int i = 1, sig = SIGTERM, r;
+  size_t j;
+  char *end;
+  long pid;
+
+  if (args[1] && strcmp(args[1], "-l") == 0) {
+    for (j = 0; j < sizeof(lsh_signames) / sizeof(lsh_signames[0]); j++) {
+      printf("%2d) SIG%s\n", lsh_signames[j].sig, lsh_signames[j].name);
+    }
+    return 1;
+  }
+  if (args[1] && strcmp(args[1], "-s") == 0) {
+    if (!args[2]) {
+      fprintf(stderr, "lsh: kill: -s requires a signal\n");
+      return 1;
+    }
+    sig = lsh_signal_parse(args[2]);
+    i = 3;
+  } else if (args[1] && args[1][0] == '-') {
+    sig = lsh_signal_parse(args[1] + 1);
+    i = 2;
+  }
+  if (sig < 0) {
+    fprintf(stderr, "lsh: kill: unknown signal \"%s\"\n", args[i - 1]);
+    return 1;
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, "lsh: kill: expected pid or job spec\n");
+    return 1;
+  }
+
+  for (; args[i] != NULL; i++) {
+    if (args[i][0] == '%') {
+      job = lsh_job_find(args[i]);
+      if (!job) {
+        fprintf(stderr, "lsh: kill: %s: no such job\n", args[i]);
+        continue;
+      }
+      if (job->pgid > 0) {
+        r = kill(-job->pgid, sig);
+      } else
+#ifdef SYS_pidfd_send_signal
+      if (job->pidfd >= 0) {
+        r = syscall(SYS_pidfd_send_signal, job->pidfd, sig, NULL, 0);
+      } else
+#endif
+      r = kill(job->pid, sig);
+    } else {
+      pid = strtol(args[i], &end, 10);
+      if (*args[i] == '\0' || *end != '\0') {
+        fprintf(stderr, "lsh: kill: %s: not a pid or job spec\n", args[i]);
+        continue;
+      }
+      r = kill(pid, sig);
+    }
+    if (r != 0) {
+      fprintf(stderr, "lsh: kill: %s: %s\n", args[i], strerror(errno));
+    }
+  }
+  return 1;
+}
+
+#define LSH_SLEEP_MAX ((double)INT_MAX)
+
+static void lsh_sleep_wakeup(int sig)
+{
+  (void)sig;
+}
+
+/**
+   @brief Builtin command: sleep for a (possibly fractional) duration.
+   @param args List of args.  args[0] is "sleep".  Each remaining argument is
+   a number with an optional s, m, h or d suffix; they are added together.
+   @return Always returns 1, to continue executing.
+   Background jobs that finish during the sleep interrupt it long enough to be
+   reaped and reported, then the sleep resumes until its original deadline.
+ */
+int lsh_sleep(char **args)
+{
+  struct sigaction sa, oldsa;
+  struct timespec deadline;
+  double seconds = 0, n;
+  char *end;
+  int i, r;
+
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected argument to \"sleep\"\n");
+    return 1;
+  }
+  for (i = 1; args[i] != NULL; i++) {
+    n = strtod(args[i], &end);
+    if (end == args[i] || n < 0
+        || (*end != '\0' && end[1] != '\0')) {
+      fprintf(stderr, "lsh: sleep: invalid time interval \"%s\"\n", args[i]);
+      return 1;
+    }
+    switch (*end) {
+    case '\0': case 's': break;
+    case 'm': n *= 60; break;
+    case 'h': n *= 60 * 60; break;
+    case 'd': n *= 24 * 60 * 60; break;
+    default:
+      fprintf(stderr, "lsh: sleep: invalid time interval \"%s\"\n", args[i]);
+      return 1;
+    }
+    seconds += n;
+    if (!isfinite(seconds)) {
+      fprintf(stderr, "lsh: sleep: invalid time interval \"%s\"\n", args[i]);
+      return 1;
+    }
+  }
+  // Anything longer than this is forever, and still fits in a time_t.
+  if (seconds > LSH_SLEEP_MAX) {
+    seconds = LSH_SLEEP_MAX;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  // No SA_RESTART: a SIGCHLD wakes us up so finished jobs get reported.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lsh_sleep_wakeup;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, &oldsa);
+  while ((r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                              NULL)) == EINTR) {
+    lsh_jobs_reap();
+  }
+  sigaction(SIGCHLD, &oldsa, NULL);
+  if (r != 0) {
+    fprintf(stderr, "lsh: sleep: %s\n", strerror(r));
+  }
+  return 1;
+}
+
+struct lsh_head_ctx {
+  struct lsh_out *out;
+  long remaining;
+};
+
+static int lsh_head_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_head_ctx *head = ctx;
+  const char *p = data, *end = data + len;
+  size_t nl;
+
+  if (head->remaining == 0) {
+    return 1;
+  }
+  nl = lsh_count_byte(data, len, '\n');
+  if (nl < (size_t)head->remaining) {
+    lsh_out_write(head->out, data, len);
+    head->remaining -= nl;
+    return 0;
+  }
+  while (head->remaining > 0) {
+    p = (const char *)memchr(p, '\n', end - p) + 1;
+    head->remaining--;
+  }
+  lsh_out_write(head->out, data, p - data);
+  return 1;
+}
+
+/**
+   @brief Builtin command: print the first lines of files.
+   @param args List of args.  args[0] is "head".  Accepts "-n N" (or "-N"),
+   followed by files ("-" or none for standard input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_head(char **args)
+{
+  struct lsh_head_ctx head;
+  struct lsh_out out;
+  long lines = 10;
+  int i, fd, nfiles;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+
+  i = lsh_parse_lines_opt(args, &lines);
+  if (i < 0) {
+    return 1;
+  }
+  files = args[i] ? args + i : stdin_args;
+  for (nfiles = 0; files[nfiles]; nfiles++);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("head", files[i])) < 0) {
+      continue;
+    }
+    if (nfiles > 1) {
+      lsh_out_printf(&out, "%s==> %s <==\n", i ? "\n" : "", files[i]);
+    }
+    head.out = &out;
+    head.remaining = lines;
+    if (lsh_scan_fd(fd, lsh_head_block, &head) < 0) {
+      fprintf(stderr, "lsh: head: %s: %s\n", files[i], strerror(errno));
+    }
+    lsh_close_input(fd);
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: head: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+/**
+   @brief Find where the last lines of a buffer start.
+   @param data The buffer.
+   @param len Its length.
+   @param lines How many lines to keep.
+   @return Offset of the first byte of the last `lines` lines.
+   An unterminated final line counts as a line, as in tail(1).
+ */
+size_t lsh_tail_start(const char *data, size_t len, long lines)
+{
+  const char *p;
+  size_t end = len;
+
+  if (lines == 0) {
+    return len;
+  }
+  if (end > 0 && data[end - 1] == '\n') {
+    end--;
+  }
+  while (end > 0 && (p = memrchr(data, '\n', end)) != NULL) {
+    if (--lines == 0) {
+      return p - data + 1;
+    }
+    end = p - data;
+  }
+  return 0;
+}
+
+/**
+   @brief Output the last lines of a descriptor.
+   @param out Output stream.
+   @param fd Input.
+   @param lines Number of lines.
+   @return 0 on success, -1 on a read error.
+   Regular files are mapped and searched backwards from the end, so only the
+   pages holding the requested lines are ever touched.  Other input has to be
+   read completely; the buffer is trimmed to the last lines whenever it grows.
+ */
+int lsh_tail_fd(struct lsh_out *out, int fd, long lines)
+{
+  char *map, *buf, *newbuf;
+  size_t len, cap, keep_from, trim_at;
+  ssize_t n;
+
+  map = lsh_map_input(fd, &len);
+  if (map) {
+    madvise(map, len, MADV_RANDOM);
+    keep_from = lsh_tail_start(map, len, lines);
+    lsh_out_write(out, map + keep_from, len - keep_from);
+    munmap(map, len);
+    return 0;
+  }
+
+  cap = LSH_IO_BLOCKSIZE;
+  trim_at = cap / 2;
+  buf = malloc(cap);
+  len = 0;
+  if (!buf) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  while (1) {
+    if (len == cap) {
+      cap *= 2;
+      newbuf = realloc(buf, cap);
+      if (!newbuf) {
+        free(buf);
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      buf = newbuf;
+    }
+    n = read(fd, buf + len, cap - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      free(buf);
+      return -1;
+    } else if (n == 0) {
+      break;
+    }
+    len += n;
+    if (len >= trim_at) {
+      keep_from = lsh_tail_start(buf, len, lines + 1);
+      memmove(buf, buf + keep_from, len - keep_from);
+      len -= keep_from;
+      trim_at = len * 2 > cap / 2 ? len * 2 : cap / 2;
+    }
+  }
+  keep_from = lsh_tail_start(buf, len, lines);
+  lsh_out_write(out, buf + keep_from, len - keep_from);
+  free(buf);
+  return 0;
+}
+
+/**
+   @brief Builtin command: print the last lines of files.
+   @param args List of args.  args[0] is "tail".  Accepts "-n N" (or "-N"),
+   followed by files ("-" or none for standard input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_tail(char **args)
+{
+  struct lsh_out out;
+  long lines = 10;
+  int i, fd, nfiles;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+
+  i = lsh_parse_lines_opt(args, &lines);
+  if (i < 0) {
+    return 1;
+  }
+  files = args[i] ? args + i : stdin_args;
+  for (nfiles = 0; files[nfiles]; nfiles++);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("tail", files[i])) < 0) {
+      continue;
+    }
+    if (nfiles > 1) {
+      lsh_out_printf(&out, "%s==> %s <==\n", i ? "\n" : "", files[i]);
+    }
+    if (lsh_tail_fd(&out, fd, lines) != 0) {
+      fprintf(stderr, "lsh: tail: %s: %s\n", files[i], strerror(errno));
+    }
+    lsh_close_input(fd);
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: tail: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+struct lsh_wc_ctx {
+  int count_words;
+  int in_word;
+  size_t lines;
+  size_t words;
+  size_t bytes;
+};
+
+static int lsh_wc_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_wc_ctx *wc = ctx;
+  size_t i;
+  int space;
+
+  wc->bytes += len;
+  wc->lines += lsh_count_byte(data, len, '\n');
+  if (wc->count_words) {
+    for (i = 0; i < len; i++) {
+      space = (data[i] == ' ' || (data[i] >= '\t' && data[i] <= '\r'));
+      wc->words += (!space && !wc->in_word);
+      wc->in_word = !space;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Work out the column width for wc's counts, as coreutils does.
+   @param files The inputs.
+   @param ncounts How many counts are printed per line.
+   @return Enough digits for the total size of the regular files, and at
+   least 7 if any input is not a regular file; 1 for a single count of a
+   single input.
+ */
+int lsh_wc_width(char **files, int ncounts)
+{
+  unsigned long long size = 0;
+  struct stat st;
+  int i, digits = 1, width = 1;
+
+  if (ncounts == 1 && files[0] != NULL && files[1] == NULL) {
+    return 1;
+  }
+  for (i = 0; files[i] != NULL; i++) {
+    if (strcmp(files[i], "-") == 0 ? fstat(STDIN_FILENO, &st) != 0
+        : stat(files[i], &st) != 0) {
+      continue;
+    }
+    if (S_ISREG(st.st_mode)) {
+      size += st.st_size;
+    } else {
+      width = 7;
+    }
+  }
+  for (; size >= 10; size /= 10) {
+    digits++;
+  }
+  return digits > width ? digits : width;
+}
+
+/**
+   @brief Print one line of wc output.
+   @param name The input's name, or NULL for an unnamed standard input.
+ */
+void lsh_wc_print(struct lsh_out *out, const struct lsh_wc_ctx *wc,
+                  const int show[3], int width, const char *name)
+{
+  const size_t counts[3] = { wc->lines, wc->words, wc->bytes };
+  const char *sep = "";
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (show[i]) {
+      lsh_out_printf(out, "%s%*zu", sep, width, counts[i]);
+      sep = " ";
+    }
+  }
+  if (name) {
+    lsh_out_printf(out, " %s", name);
+  }
+  lsh_out_write(out, "\n", 1);
+}
+
+/**
+   @brief Builtin command: count lines, words and bytes.
+   @param args List of args.  args[0] is "wc".  Accepts any of -l, -w and -c
+   (all three by default), followed by files ("-" or none for standard
+   input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_wc(char **args)
+{
+  struct lsh_wc_ctx wc, total = { 0 };
+  struct lsh_out out;
+  struct stat st;
+  int i, j, fd, nfiles, lines = 0, words = 0, bytes = 0, r, width;
+  int show[3];
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1]; i++) {
+    for (j = 1; args[i][j]; j++) {
+      switch (args[i][j]) {
+      case 'l': lines = 1; break;
+      case 'w': words = 1; break;
+      case 'c': bytes = 1; break;
+      default:
+        fprintf(stderr, "lsh: wc: unknown option \"-%c\"\n", args[i][j]);
+        return 1;
+      }
+    }
+  }
+  if (!lines && !words && !bytes) {
+    lines = words = bytes = 1;
+  }
+  files = args[i] ? args + i : stdin_args;
+  for (nfiles = 0; files[nfiles]; nfiles++);
+  show[0] = lines;
+  show[1] = words;
+  show[2] = bytes;
+  width = lsh_wc_width(files, lines + words + bytes);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("wc", files[i])) < 0) {
+      continue;
+    }
+    memset(&wc, 0, sizeof(wc));
+    wc.count_words = words;
+    if (bytes && !lines && !words && fstat(fd, &st) == 0
+        && S_ISREG(st.st_mode)) {
+      // Byte counts of regular files don't need reading at all.
+      wc.bytes = st.st_size;
+      r = 0;
+    } else {
+      r = lsh_scan_fd(fd, lsh_wc_block, &wc);
+    }
+    lsh_close_input(fd);
+    if (r < 0) {
+      fprintf(stderr, "lsh: wc: %s: %s\n", files[i], strerror(errno));
+      continue;
+    }
+    total.lines += wc.lines;
+    total.words += wc.words;
+    total.bytes += wc.bytes;
+    lsh_wc_print(&out, &wc, show, width,
+                 files == stdin_args ? NULL : files[i]);
+  }
+  if (nfiles > 1) {
+    lsh_wc_print(&out, &total, show, width, "total");
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: wc: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+/**
+   @brief Compare bytes ignoring ASCII case.
+   @return 0 if equal.
+ */
+int lsh_memcasecmp(const char *a, const char *b, size_t len)
+{
+  size_t i;
+  unsigned char ca, cb;
+
+  for (i = 0; i < len; i++) {
+    ca = a[i];
+    cb = b[i];
+    if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+    if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+    if (ca != cb) {
+      return ca - cb;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Find a literal string, optionally ignoring ASCII case.
+   @param hay Bytes to search.
+   @param len Number of bytes.
+   @param needle String to find (lowercased already when icase is set).
+   @param nlen Length of the needle, at least 1.
+   @param icase Nonzero to ignore ASCII case.
+   @return Pointer to the first match, or NULL.
+   Candidate positions are found 16 at a time by comparing the first and last
+   bytes of the needle against two shifted loads; only positions where both
+   agree are verified with memcmp().
+ */
+const char *lsh_find_literal(const char *hay, size_t len, const char *needle,
+                             size_t nlen, int icase)
+{
+  size_t i = 0, j;
+  char f = needle[0], l = needle[nlen - 1];
+  char fu = (f >= 'a' && f <= 'z') ? f - ('a' - 'A') : f;
+  char lu = (l >= 'a' && l <= 'z') ? l - ('a' - 'A') : l;
+
+  if (!icase && nlen == 1) {
+    return memchr(hay, f, len);
+  }
+  if (!icase) {
+    fu = f;
+    lu = l;
+  }
+#if defined(__SSE2__)
+  {
+    const __m128i first = _mm_set1_epi8(f), firstu = _mm_set1_epi8(fu);
+    const __m128i last = _mm_set1_epi8(l), lastu = _mm_set1_epi8(lu);
+    unsigned int mask, bit;
+
+    for (; i + nlen - 1 + 16 <= len; i += 16) {
+      __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+      __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+      __m128i ef = _mm_or_si128(_mm_cmpeq_epi8(bf, first),
+                                _mm_cmpeq_epi8(bf, firstu));
+      __m128i el = _mm_or_si128(_mm_cmpeq_epi8(bl, last),
+                                _mm_cmpeq_epi8(bl, lastu));
+      mask = _mm_movemask_epi8(_mm_and_si128(ef, el));
+      while (mask) {
+        bit = __builtin_ctz(mask);
+        if (nlen <= 2
+            || (icase ? lsh_memcasecmp(hay + i + bit + 1, needle + 1, nlen - 2)
+                : memcmp(hay + i + bit + 1, needle + 1, nlen - 2)) == 0) {
+          return hay + i + bit;
+        }
+        mask &= mask - 1;
+      }
+    }
+  }
+#else
+  if (!icase) {
+    return memmem(hay, len, needle, nlen);
+  }
+#endif
+  for (; i + nlen <= len; i++) {
+    if ((hay[i] == f || hay[i] == fu) && (hay[i + nlen - 1] == l
+                                          || hay[i + nlen - 1] == lu)) {
+      j = icase ? lsh_memcasecmp(hay + i, needle, nlen)
+          : memcmp(hay + i, needle, nlen);
+      if (j == 0) {
+        return hay + i;
+      }
+    }
+  }
+  return NULL;
+}
+
+struct lsh_fgrep_ctx {
+  struct lsh_out *out;
+  const char *needle;
+  size_t nlen;
+  int invert;
+  int icase;
+  int count_only;
+  const char *prefix;  // "file:" when searching several files
+  size_t count;
+};
+
+/**
+   @brief Output (or count) a run of whole lines for fgrep.
+ */
+static void lsh_fgrep_emit(struct lsh_fgrep_ctx *g, const char *start,
+                           const char *end)
+{
+  const char *nl;
+
+  if (start == end) {
+    return;
+  }
+  if (g->count_only) {
+    g->count += lsh_count_byte(start, end - start, '\n')
+        + (end[-1] != '\n');
+    return;
+  }
+  if (g->prefix) {
+    // Every line needs the prefix, so go one line at a time.
+    while (start < end) {
+      nl = memchr(start, '\n', end - start);
+      nl = nl ? nl + 1 : end;
+      lsh_out_write(g->out, g->prefix, strlen(g->prefix));
+      lsh_out_write(g->out, start, nl - start);
+      start = nl;
+    }
+  } else {
+    lsh_out_write(g->out, start, end - start);
+  }
+  if (end[-1] != '\n') {
+    lsh_out_write(g->out, "\n", 1);
+  }
+}
+
+static int lsh_fgrep_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_fgrep_ctx *g = ctx;
+  const char *pos = data, *end = data + len, *m, *ls, *le;
+
+  if (g->nlen == 0) {
+    // Every line contains the empty string.
+    if (!g->invert) {
+      lsh_fgrep_emit(g, data, end);
+    }
+    return 0;
+  }
+  while (pos < end) {
+    m = lsh_find_literal(pos, end - pos, g->needle, g->nlen, g->icase);
+    if (!m) {
+      if (g->invert) {
+        lsh_fgrep_emit(g, pos, end);
+      }
+      break;
+    }
+    ls = memrchr(pos, '\n', m - pos);
+    ls = ls ? ls + 1 : pos;
+    le = memchr(m, '\n', end - m);
+    le = le ? le + 1 : end;
+    if (g->invert) {
+      lsh_fgrep_emit(g, pos, ls);
+    } else {
+      lsh_fgrep_emit(g, ls, le);
+    }
+    pos = le;
+  }
+  return 0;
+}
+
+/**
+   @brief Builtin command: print lines containing a fixed string.
+   @param args List of args.  args[0] is "fgrep".  Accepts -v (invert), -c
+   (count) and -i (ignore ASCII case), then the string and files ("-" or
+   none for standard input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_fgrep(char **args)
+{
+  struct lsh_fgrep_ctx g;
+  struct lsh_out out;
+  char *stdin_args[] = { "-", NULL };
+  char **files, *needle, prefix[4096];
+  int i, j, fd, nfiles;
+  size_t k;
+
+  memset(&g, 0, sizeof(g));
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    for (j = 1; args[i][j]; j++) {
+      switch (args[i][j]) {
+      case 'v': g.invert = 1; break;
+      case 'c': g.count_only = 1; break;
+      case 'i': g.icase = 1; break;
+      case 'F': break;
+      default:
+        fprintf(stderr, "lsh: fgrep: unknown option \"-%c\"\n", args[i][j]);
+        return 1;
+      }
+    }
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, "lsh: fgrep: expected a search string\n");
+    return 1;
+  }
+  needle = args[i++];
+  g.nlen = strlen(needle);
+  if (g.icase) {
+    for (k = 0; k < g.nlen; k++) {
+      if (needle[k] >= 'A' && needle[k] <= 'Z') {
+        needle[k] += 'a' - 'A';
+      }
+    }
+  }
+  g.needle = needle;
+  files = args[i] ? args + i : stdin_args;
+  for (nfiles = 0; files[nfiles]; nfiles++);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  g.out = &out;
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("fgrep", files[i])) < 0) {
+      continue;
+    }
+    g.count = 0;
+    g.prefix = NULL;
+    if (nfiles > 1) {
+      snprintf(prefix, sizeof(prefix), "%s:", files[i]);
+      g.prefix = prefix;
+    }
+    if (lsh_scan_lines(fd, lsh_fgrep_block, &g) < 0) {
+      fprintf(stderr, "lsh: fgrep: %s: %s\n", files[i], strerror(errno));
+    }
+    if (g.count_only) {
+      lsh_out_printf(&out, "%s%zu\n", g.prefix ? g.prefix : "", g.count);
+    }
+    lsh_close_input(fd);
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: fgrep: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+/*
+  Selection list for cut: "1,3-5,8-".  Kept as sorted, merged ranges, so its
+  size depends on how the list is written rather than on the numbers in it.
+*/
+struct lsh_cut_range {
+  size_t lo, hi;  // 1-based and inclusive; hi is SIZE_MAX if open ended
+};
+
+struct lsh_cut_list {
+  struct lsh_cut_range *range;
+  size_t n;
+};
+
+static int lsh_cut_range_compare(const void *a, const void *b)
+{
+  const struct lsh_cut_range *x = a, *y = b;
+
+  return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/**
+   @brief Parse one position in a cut selection list.
+   @param p Where the number starts.
+   @param end Set to just after it.
+   @param n Set to the number.
+   @return 0 on success, -1 on a syntax error, -2 if it is too large.
+ */
+static int lsh_cut_number(const char *p, char **end, size_t *n)
+{
+  unsigned long long v;
+
+  if (*p < '0' || *p > '9') {
+    return -1;
+  }
+  errno = 0;
+  v = strtoull(p, end, 10);
+  if (errno == ERANGE || v >= SIZE_MAX) {
+    return -2;
+  }
+  *n = v;
+  return v == 0 ? -1 : 0;
+}
+
+/**
+   @brief Parse a cut selection list.
+   @param spec The list, e.g. "1,3-5,8-".
+   @param list Filled in; storage comes from the command arena.
+   @return 0 on success, -1 on a syntax error, -2 if a position is too large.
+ */
+int lsh_cut_parse(const char *spec, struct lsh_cut_list *list)
+{
+  struct lsh_cut_range *r;
+  const char *p;
+  char *end;
+  size_t lo, hi, n = 1, i;
+  int err;
+
+  for (p = spec; *p; p++) {
+    n += (*p == ',');
+  }
+  list->range = lsh_arena_alloc(&lsh_cmd_arena,
+                                n * sizeof(struct lsh_cut_range));
+  list->n = 0;
+
+  p = spec;
+  while (*p) {
+    lo = 1;
+    if (*p != '-') {
+      if ((err = lsh_cut_number(p, &end, &lo)) != 0) {
+        return err;
+      }
+      p = end;
+    }
+    hi = lo;
+    if (*p == '-') {
+      p++;
+      if (*p == ',' || *p == '\0') {
+        hi = SIZE_MAX;
+      } else {
+        if ((err = lsh_cut_number(p, &end, &hi)) != 0) {
+          return err;
+        }
+        if (hi < lo) {
+          return -1;
+        }
+        p = end;
+      }
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+    list->range[list->n].lo = lo;
+    list->range[list->n].hi = hi;
+    list->n++;
+  }
+
+  // Sort, then merge ranges that overlap or touch.
+  qsort(list->range, list->n, sizeof(struct lsh_cut_range),
+        lsh_cut_range_compare);
+  for (i = 1, n = 0; i < list->n; i++) {
+    r = &list->range[n];
+    if (r->hi == SIZE_MAX || list->range[i].lo <= r->hi + 1) {
+      if (list->range[i].hi > r->hi) {
+        r->hi = list->range[i].hi;
+      }
+    } else {
+      list->range[++n] = list->range[i];
+    }
+  }
+  if (list->n > 0) {
+    list->n = n + 1;
+  }
+  return 0;
+}
+
+/**
+   @brief Check whether a field is selected.
+   @param list The selection list.
+   @param cur Index of the first range that may still matter; reset to 0 at
+   the start of each line, since fields are checked in increasing order.
+   @param n The field number.
+ */
+static int lsh_cut_selected(const struct lsh_cut_list *list, size_t *cur,
+                            size_t n)
+{
+  while (*cur < list->n && list->range[*cur].hi < n) {
+    (*cur)++;
+  }
+  return *cur < list->n && list->range[*cur].lo <= n;
+}
+
+/*
+  Output built from pieces of the input, written with writev() in batches so
+  that selected fields are never copied.
+*/
+#define LSH_IOV_MAX 1024
+
+struct lsh_iov_out {
+  int fd;
+  int error;
+  int n;
+  struct iovec iov[LSH_IOV_MAX];
+};
+
+/**
+   @brief Write all queued pieces.
+   @return 0 on success, -1 if this or an earlier write failed.
+ */
+int lsh_iov_flush(struct lsh_iov_out *out)
+{
+  struct iovec *iov = out->iov;
+  int n = out->n;
+  ssize_t w;
+
+  while (n > 0 && !out->error) {
+    w = writev(out->fd, iov, n > IOV_MAX ? IOV_MAX : n);
+    if (w < 0) {
+      if (errno != EINTR) {
+        out->error = errno;
+      }
+      continue;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  out->n = 0;
+  return out->error ? -1 : 0;
+}
+
+/**
+   @brief Queue a piece of output.  The memory must stay valid until the next
+   lsh_iov_flush().
+ */
+void lsh_iov_add(struct lsh_iov_out *out, const char *data, size_t len)
+{
+  if (len == 0) {
+    return;
+  }
+  if (out->n > 0) {
+    struct iovec *last = &out->iov[out->n - 1];
+    if ((const char *)last->iov_base + last->iov_len == data) {
+      // Adjacent in the input (e.g. a run of selected fields): merge.
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (out->n == LSH_IOV_MAX) {
+    lsh_iov_flush(out);
+  }
+  out->iov[out->n].iov_base = (void *)data;
+  out->iov[out->n].iov_len = len;
+  out->n++;
+}
+
+/**
+   @brief Find every occurrence of two bytes in a 64-byte window.
+   @param p Start of the window (64 readable bytes).
+   @return Bitmask with bit i set if p[i] is a or b.
+ */
+static inline uint64_t lsh_byte_mask2(const char *p, char a, char b)
+{
+#if defined(__SSE2__)
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  uint64_t mask = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+    uint64_t m = (uint16_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    mask |= m << (16 * i);
+  }
+  return mask;
+#else
+  uint64_t mask = 0;
+  int i;
+
+  for (i = 0; i < 64; i++) {
+    mask |= (uint64_t)(p[i] == a || p[i] == b) << i;
+  }
+  return mask;
+#endif
+}
+
+struct lsh_cut_ctx {
+  struct lsh_iov_out *out;
+  struct lsh_cut_list list;
+  char delim;
+  int bytes;            // -b: select bytes rather than fields
+  int only_delimited;   // -s
+};
+
+static int lsh_cut_fields(const char *data, size_t len, void *ctx)
+{
+  struct lsh_cut_ctx *c = ctx;
+  const char *line = data, *field = data, *p;
+  size_t fieldno = 1, base, end, cur = 0;
+  int emitted = 0;
+  uint64_t mask;
+
+  for (base = 0; base < len; base += 64) {
+    if (base + 64 <= len) {
+      mask = lsh_byte_mask2(data + base, c->delim, '\n');
+    } else {
+      mask = 0;
+      for (end = base; end < len; end++) {
+        mask |= (uint64_t)(data[end] == c->delim || data[end] == '\n')
+            << (end - base);
+      }
+    }
+    while (mask) {
+      p = data + base + __builtin_ctzll(mask);
+      mask &= mask - 1;
+      if (*p == c->delim) {
+        if (lsh_cut_selected(&c->list, &cur, fieldno)) {
+          if (emitted) {
+            lsh_iov_add(c->out, &c->delim, 1);
+          }
+          lsh_iov_add(c->out, field, p - field);
+          emitted = 1;
+        }
+        fieldno++;
+        field = p + 1;
+        continue;
+      }
+      // End of line.
+      if (fieldno == 1) {
+        if (!c->only_delimited) {
+          lsh_iov_add(c->out, line, p - line + 1);
+        }
+      } else {
+        if (lsh_cut_selected(&c->list, &cur, fieldno)) {
+          if (emitted) {
+            lsh_iov_add(c->out, &c->delim, 1);
+          }
+          lsh_iov_add(c->out, field, p - field);
+        }
+        lsh_iov_add(c->out, "\n", 1);
+      }
+      line = field = p + 1;
+      fieldno = 1;
+      cur = 0;
+      emitted = 0;
+    }
+  }
+  if (line < data + len) {
+    // Final line without a newline.
+    p = data + len;
+    if (fieldno == 1) {
+      if (!c->only_delimited) {
+        lsh_iov_add(c->out, line, p - line);
+        lsh_iov_add(c->out, "\n", 1);
+      }
+    } else {
+      if (lsh_cut_selected(&c->list, &cur, fieldno)) {
+        if (emitted) {
+          lsh_iov_add(c->out, &c->delim, 1);
+        }
+        lsh_iov_add(c->out, field, p - field);
+      }
+      lsh_iov_add(c->out, "\n", 1);
+    }
+  }
+  lsh_iov_flush(c->out);
+  return c->out->error != 0;
+}
+
+static int lsh_cut_bytes(const char *data, size_t len, void *ctx)
+{
+  struct lsh_cut_ctx *c = ctx;
+  const struct lsh_cut_range *r, *rend = c->list.range + c->list.n;
+  const char *line = data, *end = data + len, *nl;
+  size_t linelen, hi;
+
+  while (line < end) {
+    nl = memchr(line, '\n', end - line);
+    linelen = (nl ? nl : end) - line;
+    for (r = c->list.range; r < rend && r->lo <= linelen; r++) {
+      hi = r->hi < linelen ? r->hi : linelen;
+      lsh_iov_add(c->out, line + r->lo - 1, hi - r->lo + 1);
+    }
+    lsh_iov_add(c->out, "\n", 1);
+    line += linelen + 1;
+  }
+  lsh_iov_flush(c->out);
+  return c->out->error != 0;
+}
+
+/**
+   @brief Builtin command: select fields or bytes from each line.
+   @param args List of args.  args[0] is "cut".  Accepts -f LIST or -b LIST,
+   -d DELIM (default tab) and -s, then files ("-" or none for standard
+   input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_cut(char **args)
+{
+  struct lsh_iov_out *out;
+  struct lsh_cut_ctx c;
+  char *stdin_args[] = { "-", NULL };
+  char **files, *spec = NULL, *opt;
+  int i, fd;
+
+  memset(&c, 0, sizeof(c));
+  c.delim = '\t';
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1]; i++) {
+    opt = args[i];
+    if (strcmp(opt, "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(opt, "-s") == 0) {
+      c.only_delimited = 1;
+      continue;
+    } else if (opt[1] != 'f' && opt[1] != 'b' && opt[1] != 'd') {
+      fprintf(stderr, "lsh: cut: unknown option \"%s\"\n", opt);
+      return 1;
+    }
+    if (opt[2] == '\0' && args[i + 1] == NULL) {
+      fprintf(stderr, "lsh: cut: %s requires an argument\n", opt);
+      return 1;
+    }
+    if (opt[1] == 'd') {
+      c.delim = opt[2] ? opt[2] : args[++i][0];
+    } else {
+      c.bytes = (opt[1] == 'b');
+      spec = opt[2] ? opt + 2 : args[++i];
+    }
+  }
+  if (!spec) {
+    fprintf(stderr, "lsh: cut: expected -f LIST or -b LIST\n");
+    return 1;
+  }
+  switch (lsh_cut_parse(spec, &c.list)) {
+  case 0:
+    break;
+  case -2:
+    fprintf(stderr, "lsh: cut: position too large in list \"%s\"\n", spec);
+    return 1;
+  default:
+    fprintf(stderr, "lsh: cut: invalid list \"%s\"\n", spec);
+    return 1;
+  }
+  files = args[i] ? args + i : stdin_args;
+
+  fflush(stdout);
+  out = lsh_arena_alloc(&lsh_cmd_arena, sizeof(struct lsh_iov_out));
+  out->fd = STDOUT_FILENO;
+  out->error = 0;
+  out->n = 0;
+  c.out = out;
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("cut", files[i])) < 0) {
+      continue;
+    }
+    if (lsh_scan_lines(fd, c.bytes ? lsh_cut_bytes : lsh_cut_fields, &c) < 0) {
+      fprintf(stderr, "lsh: cut: %s: %s\n", files[i], strerror(errno));
+    }
+    lsh_close_input(fd);
+    if (out->error) {
+      fprintf(stderr, "lsh: cut: %s\n", strerror(out->error));
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+  External parallel sort.  Input is gathered into chunks bounded by a memory
+  budget.  Each chunk is cut into one slice per thread, the slices are sorted
+  in parallel (MSD radix sort for plain byte order, comparison sort for -n),
+  and then merged with a heap, either straight to the output or into a run
+  when more input follows.  Runs are appended to a single temporary file and
+  merged the same way at the end, at most LSH_SORT_FANIN at a time: if there
+  are more, groups of them are first merged into a second file, as often as
+  it takes.  So a sort holds two descriptors and a bounded number of buffers
+  however large its input.
+*/
+#define LSH_SORT_DEFAULT_BUDGET (256 * 1024 * 1024)
+#define LSH_SORT_SMALL 32
+#define LSH_SORT_FANIN 64
+
+struct lsh_line {
+  const char *s;
+  size_t len;
+  double num;
+};
+
+struct lsh_sort_opts {
+  int reverse;
+  int numeric;
+  int unique;
+  int threads;
+  size_t budget;
+  const char *tmpdir;
+};
+
+/**
+   @brief Parse the leading number of a line, as sort -n does.
+   Leading blanks are skipped; a line without a number sorts as zero.
+ */
+double lsh_parse_num(const char *s, size_t len)
+{
+  const char *end = s + len;
+  double n = 0, scale = 1;
+  int neg = 0;
+
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  if (s < end && *s == '-') {
+    neg = 1;
+    s++;
+  }
+  while (s < end && *s >= '0' && *s <= '9') {
+    n = n * 10 + (*s++ - '0');
+  }
+  if (s < end && *s == '.') {
+    for (s++; s < end && *s >= '0' && *s <= '9'; s++) {
+      scale /= 10;
+      n += (*s - '0') * scale;
+    }
+  }
+  return neg ? -n : n;
+}
+
+static int lsh_line_bytecmp(const struct lsh_line *a, const struct lsh_line *b)
+{
+  size_t n = a->len < b->len ? a->len : b->len;
+  int r = memcmp(a->s, b->s, n);
+
+  if (r != 0) {
+    return r;
+  }
+  return (a->len > b->len) - (a->len < b->len);
+}
+
+/**
+   @brief Compare two lines according to the sort options.
+ */
+int lsh_line_compare(const struct lsh_line *a, const struct lsh_line *b,
+                     const struct lsh_sort_opts *opts)
+{
+  int r;
+
+  if (opts->numeric) {
+    r = (a->num > b->num) - (a->num < b->num);
+    if (r == 0 && !opts->unique) {
+      // Equal numbers fall back to byte order, like sort(1).
+      r = lsh_line_bytecmp(a, b);
+    }
+  } else {
+    r = lsh_line_bytecmp(a, b);
+  }
+  return opts->reverse ? -r : r;
+}
+
+static inline int lsh_radix_key(const struct lsh_line *line, size_t depth)
+{
+  return depth < line->len ? (unsigned char)line->s[depth] + 1 : 0;
+}
+
+/**
+   @brief Sort lines into byte order with an MSD radix sort.
+   @param a Lines to sort.
+   @param tmp Scratch space for n lines.
+   @param n Number of lines.
+   @param depth Number of leading bytes all lines are known to share.
+ */
+void lsh_radix_sort(struct lsh_line *a, struct lsh_line *tmp, size_t n,
+                    size_t depth)
+{
+  size_t count[257], pos[257], i, j;
+  struct lsh_line t;
+  int b;
+
+  while (n >= LSH_SORT_SMALL) {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+      count[lsh_radix_key(&a[i], depth)]++;
+    }
+    if (count[lsh_radix_key(&a[0], depth)] == n) {
+      // Every line has the same byte here; no need to move anything.
+      if (count[0] == n) {
+        return;
+      }
+      depth++;
+      continue;
+    }
+    pos[0] = 0;
+    for (b = 1; b < 257; b++) {
+      pos[b] = pos[b - 1] + count[b - 1];
+    }
+    for (i = 0; i < n; i++) {
+      tmp[pos[lsh_radix_key(&a[i], depth)]++] = a[i];
+    }
+    memcpy(a, tmp, n * sizeof(struct lsh_line));
+    // Bucket 0 holds lines that ended here, and they are all equal.
+    for (i = count[0], b = 1; b < 257; i += count[b], b++) {
+      if (count[b] > 1) {
+        lsh_radix_sort(a + i, tmp + i, count[b], depth + 1);
+      }
+    }
+    return;
+  }
+
+  // Insertion sort for small buckets.
+  for (i = 1; i < n; i++) {
+    t = a[i];
+    for (j = i; j > 0; j--) {
+      size_t la = a[j - 1].len - depth, lt = t.len - depth;
+      int r = memcmp(a[j - 1].s + depth, t.s + depth, la < lt ? la : lt);
+      if (r < 0 || (r == 0 && la <= lt)) {
+        break;
+      }
+      a[j] = a[j - 1];
+    }
+    a[j] = t;
+  }
+}
+
+static const struct lsh_sort_opts *lsh_qsort_opts;
+
+static int lsh_line_qsort_cmp(const void *a, const void *b)
+{
+  const struct lsh_line *x = a, *y = b;
+  int r = lsh_line_compare(x, y, lsh_qsort_opts);
+
+  // Lines in a chunk are stored in input order; keep equal ones that way.
+  return r ? r : (x->s > y->s) - (x->s < y->s);
+}
+
+/*
+  One source of sorted lines for the heap merge: either a sorted slice in
+  memory or a run in a file.
+*/
+struct lsh_sort_src {
+  struct lsh_line cur;
+  // in-memory slice
+  struct lsh_line *lines;
+  size_t n;
+  size_t next;
+  // run
+  int fd;
+  off_t off;    // next byte of the run to read
+  off_t left;   // bytes of the run not yet read
+  char *buf;
+  size_t start;
+  size_t end;
+  size_t cap;
+};
+
+struct lsh_sort_run {
+  off_t off;
+  off_t len;
+};
+
+/**
+   @brief Advance a merge source to its next line.
+   @return 1 if there is a line, 0 at the end.
+ */
+int lsh_sort_src_next(struct lsh_sort_src *src,
+                      const struct lsh_sort_opts *opts)
+{
+  char *nl, *newbuf;
+  ssize_t r;
+
+  if (src->lines) {
+    if (src->next >= src->n) {
+      return 0;
+    }
+    src->cur = src->lines[src->next++];
+    return 1;
+  }
+
+  while (!(nl = memchr(src->buf + src->start, '\n', src->end - src->start))) {
+    memmove(src->buf, src->buf + src->start, src->end - src->start);
+    src->end -= src->start;
+    src->start = 0;
+    if (src->end == src->cap) {
+      src->cap *= 2;
+      newbuf = realloc(src->buf, src->cap);
+      if (!newbuf) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      src->buf = newbuf;
+    }
+    if (src->left == 0) {
+      // Runs are written by us and always end in a newline.
+      return 0;
+    }
+    r = pread(src->fd, src->buf + src->end,
+              (off_t)(src->cap - src->end) < src->left
+              ? src->cap - src->end : (size_t)src->left, src->off);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r <= 0) {
+      return 0;
+    }
+    src->end += r;
+    src->off += r;
+    src->left -= r;
+  }
+  src->cur.s = src->buf + src->start;
+  src->cur.len = nl - (src->buf + src->start);
+  if (opts->numeric) {
+    src->cur.num = lsh_parse_num(src->cur.s, src->cur.len);
+  }
+  src->start = nl - src->buf + 1;
+  return 1;
+}
+
+/**
+   @brief Order merge sources by their current lines, then by position, so
+   that lines that compare equal come out in input order.
+ */
+static int lsh_sort_src_less(const struct lsh_sort_src *a,
+                             const struct lsh_sort_src *b,
+                             const struct lsh_sort_opts *opts)
+{
+  int r = lsh_line_compare(&a->cur, &b->cur, opts);
+
+  return r < 0 || (r == 0 && a < b);
+}
+
+static void lsh_sort_sift(struct lsh_sort_src **heap, size_t n, size_t i,
+                          const struct lsh_sort_opts *opts)
+{
+  struct lsh_sort_src *t;
+  size_t child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && lsh_sort_src_less(heap[child + 1], heap[child],
+                                           opts)) {
+      child++;
+    }
+    if (!lsh_sort_src_less(heap[child], heap[i], opts)) {
+      break;
+    }
+    t = heap[i];
+    heap[i] = heap[child];
+    heap[child] = t;
+    i = child;
+  }
+}
+
+/**
+   @brief Merge sorted sources into an output stream with a binary heap.
+   @param srcs The sources.
+   @param nsrcs Number of sources.
+   @param out Where merged lines go.
+   @param opts Sort options (-u drops lines equal to the previous one).
+ */
+void lsh_sort_merge(struct lsh_sort_src *srcs, size_t nsrcs,
+                    struct lsh_out *out, const struct lsh_sort_opts *opts)
+{
+  struct lsh_sort_src **heap;
+  struct lsh_line last;
+  char *lastbuf = NULL;
+  size_t lastcap = 0, n = 0, i;
+  int have_last = 0;
+
+  heap = malloc(nsrcs * sizeof(struct lsh_sort_src *));
+  if (!heap) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < nsrcs; i++) {
+    if (lsh_sort_src_next(&srcs[i], opts)) {
+      heap[n++] = &srcs[i];
+    }
+  }
+  for (i = n / 2; i-- > 0;) {
+    lsh_sort_sift(heap, n, i, opts);
+  }
+
+  while (n > 0) {
+    struct lsh_line *cur = &heap[0]->cur;
+    if (!opts->unique || !have_last
+        || lsh_line_compare(&last, cur, opts) != 0) {
+      lsh_out_write(out, cur->s, cur->len);
+      lsh_out_write(out, "\n", 1);
+      if (opts->unique) {
+        // Run file buffers move, so keep our own copy of the last line.
+        if (cur->len > lastcap) {
+          lastcap = cur->len * 2;
+          free(lastbuf);
+          lastbuf = malloc(lastcap);
+          if (!lastbuf) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+          }
+        }
+        memcpy(lastbuf, cur->s, cur->len);
+        last = *cur;
+        last.s = lastbuf;
+        have_last = 1;
+      }
+    }
+    if (!lsh_sort_src_next(heap[0], opts)) {
+      heap[0] = heap[--n];
+    }
+    lsh_sort_sift(heap, n, 0, opts);
+  }
+  free(lastbuf);
+  free(heap);
+}
+
+struct lsh_sort_state {
+  struct lsh_sort_opts opts;
+  // current chunk
+  char *data;
+  size_t used;
+  size_t cap;
+  struct lsh_line *lines;
+  struct lsh_line *tmp;
+  size_t nlines;
+  size_t maxlines;
+  // spilled runs
+  int runfd;                  // file holding the runs, or -1
+  int passfd;                 // file for merge passes, or -1
+  struct lsh_sort_run *runs;
+  size_t nruns;
+  struct lsh_out spill;       // shared by everything written to the files
+  int have_spill;
+  struct lsh_sort_src *srcs;  // LSH_SORT_FANIN, buffers kept between merges
+  int failed;
+};
+
+struct lsh_sort_slice_ctx {
+  struct lsh_sort_state *st;
+  size_t per;
+};
+
+static void lsh_sort_slice(void *ctx, size_t task)
+{
+  struct lsh_sort_slice_ctx *c = ctx;
+  struct lsh_sort_state *st = c->st;
+  size_t lo = task * c->per, n = c->per, i;
+  struct lsh_line t;
+
+  if (lo + n > st->nlines) {
+    n = st->nlines - lo;
+  }
+  if (st->opts.numeric) {
+    qsort(st->lines + lo, n, sizeof(struct lsh_line), lsh_line_qsort_cmp);
+    return;
+  }
+  lsh_radix_sort(st->lines + lo, st->tmp + lo, n, 0);
+  if (st->opts.reverse) {
+    for (i = 0; i < n / 2; i++) {
+      t = st->lines[lo + i];
+      st->lines[lo + i] = st->lines[lo + n - 1 - i];
+      st->lines[lo + n - 1 - i] = t;
+    }
+  }
+}
+
+/**
+   @brief Sort the current chunk and merge it into an output stream.
+ */
+void lsh_sort_chunk(struct lsh_sort_state *st, struct lsh_out *out)
+{
+  struct lsh_sort_slice_ctx ctx;
+  struct lsh_sort_src *srcs;
+  size_t nslices, i;
+
+  if (st->nlines == 0) {
+    return;
+  }
+  nslices = st->opts.threads;
+  if (st->nlines < nslices * 1024) {
+    nslices = 1;
+  }
+  ctx.st = st;
+  ctx.per = (st->nlines + nslices - 1) / nslices;
+  nslices = (st->nlines + ctx.per - 1) / ctx.per;
+  lsh_qsort_opts = &st->opts;
+  lsh_parallel_for(nslices, st->opts.threads, lsh_sort_slice, &ctx);
+
+  srcs = calloc(nslices, sizeof(struct lsh_sort_src));
+  if (!srcs) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < nslices; i++) {
+    srcs[i].lines = st->lines + i * ctx.per;
+    srcs[i].n = i + 1 < nslices ? ctx.per : st->nlines - i * ctx.per;
+  }
+  lsh_sort_merge(srcs, nslices, out, &st->opts);
+  free(srcs);
+}
+
+/**
+   @brief Create an unlinked temporary file for runs.
+   @return A registered descriptor, or -1 (after printing an error).
+ */
+int lsh_sort_tmpfile(struct lsh_sort_state *st)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/lsh-sort-XXXXXX", st->opts.tmpdir);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "lsh: sort: %s: %s\n", path, strerror(errno));
+    st->failed = 1;
+    return -1;
+  }
+  // The file only needs to live as long as the descriptor.
+  unlink(path);
+  return lsh_fd_register(fd);
+}
+
+/**
+   @brief Point the shared spill stream at a file.
+ */
+static void lsh_sort_spill_to(struct lsh_sort_state *st, int fd)
+{
+  if (!st->have_spill) {
+    lsh_out_init(&st->spill, fd);
+    st->have_spill = 1;
+  }
+  st->spill.fd = fd;
+  st->spill.error = 0;
+  st->spill.len = 0;
+}
+
+/**
+   @brief Flush the spill stream and record what it wrote as a run.
+   @param st Sort state.
+   @param run Where to store the run.
+   @param start Offset in the file where the run began.
+   @return Offset where the next run begins.
+ */
+static off_t lsh_sort_end_run(struct lsh_sort_state *st,
+                              struct lsh_sort_run *run, off_t start)
+{
+  off_t end;
+
+  if (lsh_out_flush(&st->spill) != 0) {
+    fprintf(stderr, "lsh: sort: writing run: %s\n",
+            strerror(st->spill.error));
+    st->failed = 1;
+  }
+  end = lseek(st->spill.fd, 0, SEEK_CUR);
+  run->off = start;
+  run->len = end - start;
+  return end;
+}
+
+/**
+   @brief Sort the current chunk into a new run and empty the chunk.
+ */
+void lsh_sort_spill(struct lsh_sort_state *st)
+{
+  struct lsh_sort_run *runs;
+
+  if (st->runfd < 0 && (st->runfd = lsh_sort_tmpfile(st)) < 0) {
+    return;
+  }
+  runs = realloc(st->runs, (st->nruns + 1) * sizeof(struct lsh_sort_run));
+  if (!runs) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  st->runs = runs;
+
+  lsh_sort_spill_to(st, st->runfd);
+  lsh_sort_chunk(st, &st->spill);
+  lsh_sort_end_run(st, &st->runs[st->nruns],
+                   st->nruns ? st->runs[st->nruns - 1].off
+                   + st->runs[st->nruns - 1].len : 0);
+  st->nruns++;
+  st->used = 0;
+  st->nlines = 0;
+}
+
+/**
+   @brief Merge up to LSH_SORT_FANIN runs from the run file.
+   @param st Sort state.
+   @param runs The runs.
+   @param n Number of runs.
+   @param out Where merged lines go.
+ */
+void lsh_sort_merge_runs(struct lsh_sort_state *st,
+                         const struct lsh_sort_run *runs, size_t n,
+                         struct lsh_out *out)
+{
+  struct lsh_sort_src *src;
+  size_t i, cap;
+
+  if (!st->srcs) {
+    st->srcs = calloc(LSH_SORT_FANIN, sizeof(struct lsh_sort_src));
+    // Each buffer grows if a line doesn't fit, so it can start small.
+    cap = st->opts.budget / LSH_SORT_FANIN;
+    cap = cap < 4096 ? 4096 : cap > LSH_IO_BLOCKSIZE / 4
+        ? LSH_IO_BLOCKSIZE / 4 : cap;
+    for (i = 0; st->srcs && i < LSH_SORT_FANIN; i++) {
+      st->srcs[i].cap = cap;
+      if (!(st->srcs[i].buf = malloc(cap))) {
+        break;
+      }
+    }
+    if (!st->srcs || i < LSH_SORT_FANIN) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    src = &st->srcs[i];
+    src->fd = st->runfd;
+    src->off = runs[i].off;
+    src->left = runs[i].len;
+    src->start = src->end = 0;
+  }
+  lsh_sort_merge(st->srcs, n, out, &st->opts);
+}
+
+/**
+   @brief Merge groups of runs into the pass file until at most
+   LSH_SORT_FANIN remain, which then become the run file.
+ */
+void lsh_sort_passes(struct lsh_sort_state *st)
+{
+  size_t i, k, n;
+  off_t off;
+  int fd;
+
+  while (st->nruns > LSH_SORT_FANIN && !st->failed) {
+    if (st->passfd < 0 && (st->passfd = lsh_sort_tmpfile(st)) < 0) {
+      return;
+    }
+    if (ftruncate(st->passfd, 0) != 0) {
+      fprintf(stderr, "lsh: sort: %s\n", strerror(errno));
+      st->failed = 1;
+      return;
+    }
+    lseek(st->passfd, 0, SEEK_SET);
+    lsh_sort_spill_to(st, st->passfd);
+    // Run n is written only after runs n * LSH_SORT_FANIN onwards are read.
+    for (i = 0, n = 0, off = 0; i < st->nruns; i += k, n++) {
+      k = st->nruns - i < LSH_SORT_FANIN ? st->nruns - i : LSH_SORT_FANIN;
+      lsh_sort_merge_runs(st, st->runs + i, k, &st->spill);
+      off = lsh_sort_end_run(st, &st->runs[n], off);
+    }
+    st->nruns = n;
+    fd = st->runfd;
+    st->runfd = st->passfd;
+    st->passfd = fd;
+  }
+}
+
+static int lsh_sort_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_sort_state *st = ctx;
+  const char *p = data, *end = data + len, *nl;
+  struct lsh_line *line;
+  size_t linelen;
+  char *newdata;
+
+  while (p < end && !st->failed) {
+    nl = memchr(p, '\n', end - p);
+    linelen = (nl ? nl : end) - p;
+    if (st->used + linelen + 1 > st->cap || st->nlines == st->maxlines) {
+      if (st->nlines > 0) {
+        lsh_sort_spill(st);
+        continue;
+      }
+      // One line bigger than the whole budget.
+      st->cap = linelen + 1;
+      newdata = realloc(st->data, st->cap);
+      if (!newdata) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      st->data = newdata;
+    }
+    memcpy(st->data + st->used, p, linelen);
+    st->data[st->used + linelen] = '\n';
+    line = &st->lines[st->nlines++];
+    line->s = st->data + st->used;
+    line->len = linelen;
+    if (st->opts.numeric) {
+      line->num = lsh_parse_num(line->s, linelen);
+    }
+    st->used += linelen + 1;
+    p += linelen + 1;
+  }
+  return st->failed;
+}
+
+/**
+   @brief Builtin command: sort lines.
+   @param args List of args.  args[0] is "sort".  Accepts -r, -n, -u,
+   -S SIZE (memory budget), -T DIR (for run files) and --parallel=N, then
+   files ("-" or none for standard input).
+   @return Always returns 1, to continue executing.
+ */
+int lsh_sort(char **args)
+{
+  struct lsh_sort_state st;
+  struct lsh_out out;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+  size_t i;
+  int a, j, fd;
+
+  memset(&st, 0, sizeof(st));
+  st.runfd = st.passfd = -1;
+  st.opts.budget = LSH_SORT_DEFAULT_BUDGET;
+  st.opts.threads = lsh_default_threads();
+  st.opts.tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  for (a = 1; args[a] != NULL && args[a][0] == '-' && args[a][1]; a++) {
+    if (strcmp(args[a], "--") == 0) {
+      a++;
+      break;
+    } else if (strncmp(args[a], "--parallel=", 11) == 0) {
+      st.opts.threads = atoi(args[a] + 11);
+      if (st.opts.threads < 1) {
+        st.opts.threads = 1;
+      }
+    } else if (args[a][1] == 'S' || args[a][1] == 'T') {
+      char opt = args[a][1];
+      char *val = args[a][2] ? args[a] + 2 : args[++a];
+      if (!val) {
+        fprintf(stderr, "lsh: sort: -%c requires an argument\n", opt);
+        return 1;
+      }
+      if (opt == 'T') {
+        st.opts.tmpdir = val;
+      } else if ((st.opts.budget = lsh_parse_size(val)) < 4096) {
+        fprintf(stderr, "lsh: sort: invalid buffer size \"%s\"\n", val);
+        return 1;
+      }
+    } else {
+      for (j = 1; args[a][j]; j++) {
+        switch (args[a][j]) {
+        case 'r': st.opts.reverse = 1; break;
+        case 'n': st.opts.numeric = 1; break;
+        case 'u': st.opts.unique = 1; break;
+        default:
+          fprintf(stderr, "lsh: sort: unknown option \"-%c\"\n", args[a][j]);
+          return 1;
+        }
+      }
+    }
+  }
+  files = args[a] ? args + a : stdin_args;
+
+  // Split the budget between line text and the two line index arrays.
+  st.cap = st.opts.budget / 2;
+  st.maxlines = st.opts.budget / 2 / (2 * sizeof(struct lsh_line));
+  st.data = malloc(st.cap);
+  st.lines = malloc(st.maxlines * sizeof(struct lsh_line));
+  st.tmp = malloc(st.maxlines * sizeof(struct lsh_line));
+  if (!st.data || !st.lines || !st.tmp) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (j = 0; files[j] != NULL && !st.failed; j++) {
+    if ((fd = lsh_open_input("sort", files[j])) < 0) {
+      continue;
+    }
+    if (lsh_scan_lines(fd, lsh_sort_block, &st) < 0) {
+      fprintf(stderr, "lsh: sort: %s: %s\n", files[j], strerror(errno));
+    }
+    lsh_close_input(fd);
+  }
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  if (!st.failed && st.nruns == 0) {
+    lsh_sort_chunk(&st, &out);
+  } else if (!st.failed) {
+    if (st.nlines > 0) {
+      lsh_sort_spill(&st);
+    }
+    // The chunk memory is no longer needed; the runs are merged from disk.
+    free(st.data);
+    free(st.lines);
+    free(st.tmp);
+    st.data = NULL;
+    st.lines = st.tmp = NULL;
+    lsh_sort_passes(&st);
+    if (!st.failed) {
+      lsh_sort_merge_runs(&st, st.runs, st.nruns, &out);
+    }
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: sort: %s\n", strerror(out.error));
+  }
+
+  if (st.runfd >= 0) {
+    lsh_fd_close(st.runfd);
+  }
+  if (st.passfd >= 0) {
+    lsh_fd_close(st.passfd);
+  }
+  for (i = 0; st.srcs && i < LSH_SORT_FANIN; i++) {
+    free(st.srcs[i].buf);
+  }
+  free(st.srcs);
+  free(st.runs);
+  free(st.data);
+  free(st.lines);
+  free(st.tmp);
+  return 1;
+}
+
+/*
+  Counting distinct lines.  Each table is open-addressed with linear probing
+  and keeps its keys in its own arena.  Large mapped inputs are split at line
+  boundaries into one slice per thread, each counted into a private table,
+  and the tables are merged at the end.
+*/
+#define LSH_COUNT_PARALLEL_MIN (16 * 1024 * 1024)
+
+struct lsh_count_entry {
+  uint64_t hash;
+  const char *key;  // NULL for an empty slot
+  size_t len;
+  size_t count;
+};
+
+struct lsh_count_table {
+  struct lsh_count_entry *slots;
+  size_t cap;  // power of two
+  size_t n;
+  struct lsh_arena arena;
+};
+
+/**
+   @brief Hash a byte string (multiply-xorshift over 8-byte words).
+ */
+uint64_t lsh_hash_bytes(const char *data, size_t len)
+{
+  const uint64_t m = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = len * m, w;
+
+  while (len >= 8) {
+    memcpy(&w, data, 8);
+    h = (h ^ (w * m)) * m;
+    h ^= h >> 29;
+    data += 8;
+    len -= 8;
+  }
+  w = 0;
+  memcpy(&w, data, len);
+  h = (h ^ (w * m)) * m;
+  h ^= h >> 32;
+  h *= m;
+  h ^= h >> 29;
+  return h;
+}
+
+void lsh_count_init(struct lsh_count_table *t)
+{
+  t->cap = 1024;
+  t->n = 0;
+  t->arena.head = NULL;
+  t->slots = calloc(t->cap, sizeof(struct lsh_count_entry));
+  if (!t->slots) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void lsh_count_grow(struct lsh_count_table *t)
+{
+  struct lsh_count_entry *old = t->slots, *e;
+  size_t oldcap = t->cap, i, j;
+
+  t->cap *= 2;
+  t->slots = calloc(t->cap, sizeof(struct lsh_count_entry));
+  if (!t->slots) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < oldcap; i++) {
+    if (old[i].key) {
+      for (j = old[i].hash & (t->cap - 1); t->slots[j].key;
+           j = (j + 1) & (t->cap - 1));
+      e = &t->slots[j];
+      *e = old[i];
+    }
+  }
+  free(old);
+}
+
+/**
+   @brief Find the slot for a key: its entry, or the empty slot it belongs in.
+ */
+static struct lsh_count_entry *lsh_count_slot(struct lsh_count_table *t,
+                                              const char *key, size_t len,
+                                              uint64_t hash)
+{
+  struct lsh_count_entry *e;
+  size_t i;
+
+  for (i = hash & (t->cap - 1);; i = (i + 1) & (t->cap - 1)) {
+    e = &t->slots[i];
+    if (!e->key || (e->hash == hash && e->len == len
+                    && memcmp(e->key, key, len) == 0)) {
+      return e;
+    }
+  }
+}
+
+/**
+   @brief Add to the count of a key.
+   @param t The table.
+   @param key Key bytes (copied into the table's arena if new).
+   @param len Key length.
+   @param hash lsh_hash_bytes(key, len).
+   @param n Amount to add.
+ */
+void lsh_count_add(struct lsh_count_table *t, const char *key, size_t len,
+                   uint64_t hash, size_t n)
+{
+  struct lsh_count_entry *e = lsh_count_slot(t, key, len, hash);
+  char *copy;
+
+  if (e->key) {
+    e->count += n;
+    return;
+  }
+  copy = lsh_arena_alloc(&t->arena, len + 1);
+  memcpy(copy, key, len);
+  e->hash = hash;
+  e->key = copy;
+  e->len = len;
+  e->count = n;
+  if (++t->n * 10 > t->cap * 7) {
+    lsh_count_grow(t);
+  }
+}
+
+/**
+   @brief Fold one table's counts into another.
+   @param dst Table to add to.
+   @param src Table to add.  New keys in dst point into src's arena, so src
+   must not be freed before dst.
+ */
+void lsh_count_merge(struct lsh_count_table *dst,
+                     const struct lsh_count_table *src)
+{
+  const struct lsh_count_entry *s;
+  struct lsh_count_entry *e;
+  size_t i;
+
+  for (i = 0; i < src->cap; i++) {
+    s = &src->slots[i];
+    if (!s->key) {
+      continue;
+    }
+    e = lsh_count_slot(dst, s->key, s->len, s->hash);
+    if (e->key) {
+      e->count += s->count;
+    } else {
+      *e = *s;
+      if (++dst->n * 10 > dst->cap * 7) {
+        lsh_count_grow(dst);
+      }
+    }
+  }
+}
+
+void lsh_count_free(struct lsh_count_table *t)
+{
+  free(t->slots);
+  lsh_arena_free(&t->arena);
+}
+
+/**
+   @brief Count every line of a buffer into a table.
+ */
+void lsh_count_lines(struct lsh_count_table *t, const char *data, size_t len)
+{
+  const char *p = data, *end = data + len, *nl;
+  size_t linelen;
+
+  while (p < end) {
+    nl = memchr(p, '\n', end - p);
+    linelen = (nl ? nl : end) - p;
+    lsh_count_add(t, p, linelen, lsh_hash_bytes(p, linelen), 1);
+    p += linelen + 1;
+  }
+}
+
+struct lsh_count_ctx {
+  struct lsh_count_table *tables;
+  int threads;
+  // slices of the current buffer, for the parallel case
+  const char **starts;
+  const char **ends;
+};
+
+static void lsh_count_slice(void *ctx, size_t task)
+{
+  struct lsh_count_ctx *c = ctx;
+
+  lsh_count_lines(&c->tables[task], c->starts[task],
+                  c->ends[task] - c->starts[task]);
+}
+
+static int lsh_count_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_count_ctx *c = ctx;
+  const char *starts[LSH_MAX_THREADS], *ends[LSH_MAX_THREADS], *p, *nl;
+  int i;
+
+  if (c->threads == 1 || len < LSH_COUNT_PARALLEL_MIN) {
+    lsh_count_lines(&c->tables[0], data, len);
+    return 0;
+  }
+  p = data;
+  for (i = 0; i < c->threads; i++) {
+    starts[i] = p;
+    if (i == c->threads - 1) {
+      p = data + len;
+    } else {
+      p = data + len / c->threads * (i + 1);
+      if (p < starts[i]) {
+        p = starts[i];
+      }
+      nl = memchr(p, '\n', data + len - p);
+      p = nl ? nl + 1 : data + len;
+    }
+    ends[i] = p;
+  }
+  c->starts = starts;
+  c->ends = ends;
+  lsh_parallel_for(c->threads, c->threads, lsh_count_slice, c);
+  return 0;
+}
+
+static int lsh_count_entry_cmp(const void *a, const void *b)
+{
+  const struct lsh_count_entry *x = a, *y = b;
+  size_t n;
+  int r;
+
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  n = x->len < y->len ? x->len : y->len;
+  r = memcmp(x->key, y->key, n);
+  return r ? r : (x->len > y->len) - (x->len < y->len);
+}
+
+/**
+   @brief Builtin command: count distinct lines, most frequent first.
+   @param args List of args.  args[0] is "count".  Accepts -t THREADS, then
+   files ("-" or none for standard input).  Output matches "uniq -c".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_count(char **args)
+{
+  struct lsh_count_ctx c;
+  struct lsh_count_entry *all;
+  struct lsh_out out;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+  size_t i, n;
+  int a, t, fd;
+
+  c.threads = lsh_default_threads();
+  for (a = 1; args[a] != NULL && args[a][0] == '-' && args[a][1]; a++) {
+    if (strcmp(args[a], "--") == 0) {
+      a++;
+      break;
+    } else if (strncmp(args[a], "-t", 2) == 0) {
+      char *val = args[a][2] ? args[a] + 2 : args[++a];
+      if (!val || atoi(val) < 1) {
+        fprintf(stderr, "lsh: count: -t requires a thread count\n");
+        return 1;
+      }
+      c.threads = atoi(val) > LSH_MAX_THREADS ? LSH_MAX_THREADS : atoi(val);
+    } else {
+      fprintf(stderr, "lsh: count: unknown option \"%s\"\n", args[a]);
+      return 1;
+    }
+  }
+  files = args[a] ? args + a : stdin_args;
+
+  c.tables = malloc(c.threads * sizeof(struct lsh_count_table));
+  if (!c.tables) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (t = 0; t < c.threads; t++) {
+    lsh_count_init(&c.tables[t]);
+  }
+  for (a = 0; files[a] != NULL; a++) {
+    if ((fd = lsh_open_input("count", files[a])) < 0) {
+      continue;
+    }
+    if (lsh_scan_lines(fd, lsh_count_block, &c) < 0) {
+      fprintf(stderr, "lsh: count: %s: %s\n", files[a], strerror(errno));
+    }
+    lsh_close_input(fd);
+  }
+
+  // Fold the per-thread tables into the first one.  Keys stay in the arenas
+  // they were first stored in, so every table is kept until the end.
+  for (t = 1; t < c.threads; t++) {
+    lsh_count_merge(&c.tables[0], &c.tables[t]);
+  }
+
+  all = malloc((c.tables[0].n + 1) * sizeof(struct lsh_count_entry));
+  if (!all) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0, n = 0; i < c.tables[0].cap; i++) {
+    if (c.tables[0].slots[i].key) {
+      all[n++] = c.tables[0].slots[i];
+    }
+  }
+  qsort(all, n, sizeof(struct lsh_count_entry), lsh_count_entry_cmp);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  for (i = 0; i < n; i++) {
+    lsh_out_printf(&out, "%7zu ", all[i].count);
+    lsh_out_write(&out, all[i].key, all[i].len);
+    lsh_out_write(&out, "\n", 1);
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: count: %s\n", strerror(out.error));
+  }
+
+  free(all);
+  for (t = 0; t < c.threads; t++) {
+    lsh_count_free(&c.tables[t]);
+  }
+  free(c.tables);
+  return 1;
+}
+
+/*
+  JSON field extraction, one document per line, without building a tree.
+  Stage one finds the structural characters ({}[]:,) and string openings of a
+  line 64 bytes at a time: bitmasks of quotes, backslashes and structurals
+  are combined to drop escaped quotes, a prefix XOR of the quote mask gives
+  the bytes inside strings, and whatever survives is written to an index.
+  Stage two walks only that index to follow the path, skipping over nested
+  values by counting brackets.
+*/
+struct lsh_json {
+  const char *s;
+  size_t len;
+  uint32_t *idx;
+  size_t n;
+};
+
+static inline uint64_t lsh_byte_mask1(const char *p, char c)
+{
+  return lsh_byte_mask2(p, c, c);
+}
+
+static inline uint64_t lsh_prefix_xor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+/**
+   @brief Find the characters escaped by backslashes in a 64-byte block.
+   @param backslash Mask of backslashes in the block.
+   @param prev_escaped In: whether the first byte is escaped by the previous
+   block.  Out: the same for the next block.
+   @return Mask of escaped characters.
+ */
+static inline uint64_t lsh_json_escaped(uint64_t backslash,
+                                        uint64_t *prev_escaped)
+{
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t follows, odd_starts, seq_even;
+
+  backslash &= ~*prev_escaped;
+  follows = (backslash << 1) | *prev_escaped;
+  odd_starts = backslash & ~even & ~follows;
+  seq_even = odd_starts + backslash;
+  *prev_escaped = seq_even < backslash;
+  return (even ^ (seq_even << 1)) & follows;
+}
+
+/**
+   @brief Build the structural index of one JSON document.
+   @param js Document (s, len) in; idx must have room for len entries.
+   Fills in js->n.
+ */
+void lsh_json_index(struct lsh_json *js)
+{
+  char block[64];
+  const char *p;
+  uint64_t quote, backslash, structural, escaped, instring, mask;
+  uint64_t prev_escaped = 0, prev_instring = 0;
+  size_t base;
+
+  js->n = 0;
+  for (base = 0; base < js->len; base += 64) {
+    p = js->s + base;
+    if (base + 64 > js->len) {
+      memset(block, ' ', 64);
+      memcpy(block, p, js->len - base);
+      p = block;
+    }
+    quote = lsh_byte_mask1(p, '"');
+    backslash = lsh_byte_mask1(p, '\\');
+    structural = lsh_byte_mask2(p, '{', '}') | lsh_byte_mask2(p, '[', ']')
+        | lsh_byte_mask2(p, ':', ',');
+
+    escaped = lsh_json_escaped(backslash, &prev_escaped);
+    quote &= ~escaped;
+    instring = lsh_prefix_xor(quote) ^ prev_instring;
+    prev_instring = (uint64_t)((int64_t)instring >> 63);
+
+    // Opening quotes are inside the string mask, closing ones are not.
+    mask = (structural & ~instring) | (quote & instring);
+    while (mask) {
+      js->idx[js->n++] = base + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+}
+
+static size_t lsh_json_ws(const struct lsh_json *js, size_t pos)
+{
+  while (pos < js->len && (js->s[pos] == ' ' || js->s[pos] == '\t'
+                           || js->s[pos] == '\r' || js->s[pos] == '\n')) {
+    pos++;
+  }
+  return pos;
+}
+
+/**
+   @brief Skip over a value.
+   @param js Indexed document.
+   @param pos Position of the value's first character.
+   @param i First index entry at or after pos.
+   @return First index entry after the value.
+ */
+static size_t lsh_json_skip(const struct lsh_json *js, size_t pos, size_t i)
+{
+  size_t depth = 0;
+  char c;
+
+  if (pos >= js->len) {
+    return js->n;
+  }
+  if (js->s[pos] == '"') {
+    return i + 1;
+  }
+  if (js->s[pos] != '{' && js->s[pos] != '[') {
+    return i;
+  }
+  for (; i < js->n; i++) {
+    c = js->s[js->idx[i]];
+    if (c == '{' || c == '[') {
+      depth++;
+    } else if ((c == '}' || c == ']') && --depth == 0) {
+      return i + 1;
+    }
+  }
+  return js->n;
+}
+
+/**
+   @brief Find where a value ends.
+   @param js Indexed document.
+   @param pos Position of the value's first character.
+   @param after Result of lsh_json_skip() for the value.
+   @return Position just after the value.
+ */
+static size_t lsh_json_value_end(const struct lsh_json *js, size_t pos,
+                                 size_t after)
+{
+  size_t limit = after < js->n ? js->idx[after] : js->len;
+  const char *q;
+
+  if (pos >= js->len) {
+    return pos;
+  }
+  if (js->s[pos] == '{' || js->s[pos] == '[') {
+    return after > 0 ? js->idx[after - 1] + 1 : js->len;
+  }
+  if (js->s[pos] == '"') {
+    q = memrchr(js->s + pos + 1, '"', limit - pos - 1);
+    return q ? (size_t)(q - js->s) + 1 : limit;
+  }
+  while (limit > pos && (js->s[limit - 1] == ' ' || js->s[limit - 1] == '\t'
+                         || js->s[limit - 1] == '\r')) {
+    limit--;
+  }
+  return limit;
+}
+
+/**
+   @brief Check that an indexed document looks like one JSON value.
+   @param js Indexed document, not blank.
+   @return 1 if its brackets match, its strings are closed and nothing
+   follows the value; scalars must be a number, true, false or null.  This
+   is not full validation: the tokens between structurals are not checked.
+ */
+int lsh_json_valid(const struct lsh_json *js)
+{
+  size_t pos = lsh_json_ws(js, 0), last = js->len, depth = 0, i;
+  uint64_t stack = 0;   // 1 for '{', for the innermost 64 levels
+  char c, *numend;
+
+  while (last > pos && (js->s[last - 1] == ' ' || js->s[last - 1] == '\t'
+                        || js->s[last - 1] == '\r')) {
+    last--;
+  }
+  c = js->s[pos];
+  if (c == '"') {
+    // A closed string has a closing quote at the end, and nothing else.
+    return js->n == 1 && last - pos >= 2 && js->s[last - 1] == '"'
+        && lsh_json_value_end(js, pos, 1) == last;
+  }
+  if (c != '{' && c != '[') {
+    if (js->n != 0) {
+      return 0;
+    }
+    if ((last - pos == 4 && (memcmp(js->s + pos, "true", 4) == 0
+                             || memcmp(js->s + pos, "null", 4) == 0))
+        || (last - pos == 5 && memcmp(js->s + pos, "false", 5) == 0)) {
+      return 1;
+    }
+    if (c != '-' && (c < '0' || c > '9')) {
+      return 0;
+    }
+    strtod(js->s + pos, &numend);
+    return numend == js->s + last;
+  }
+  for (i = 0; i < js->n; i++) {
+    c = js->s[js->idx[i]];
+    if (c == '{' || c == '[') {
+      stack = (stack << 1) | (c == '{');
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0 || (depth <= 64 && (int)(stack & 1) != (c == '}'))) {
+        return 0;
+      }
+      stack >>= 1;
+      if (--depth == 0) {
+        return i + 1 == js->n && js->idx[i] + 1 == last;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Follow a path such as ".a.b[0]" through an indexed document.
+   @param js Indexed document.
+   @param path The path.
+   @param start Set to the position of the value found.
+   @param end Set to the position just after it.
+   @return 1 if the value exists, 0 otherwise.
+ */
+int lsh_json_lookup(const struct lsh_json *js, const char *path,
+                    size_t *start, size_t *end)
+{
+  size_t pos = lsh_json_ws(js, 0), i = 0, j, next, keypos, keylen, seglen;
+  const char *seg, *q;
+  long want, k;
+  char *numend;
+
+  while (*path) {
+    if (pos >= js->len || i >= js->n || js->idx[i] != pos) {
+      return 0;  // scalars have no members
+    }
+    if (path[0] == '.' && (path[1] == '\0' || path[1] == '.')) {
+      path++;
+      continue;
+    }
+    if (path[0] == '.' && path[1] != '[') {
+      // Object member.
+      seg = path + 1;
+      seglen = strcspn(seg, ".[");
+      path = seg + seglen;
+      if (js->s[pos] != '{') {
+        return 0;
+      }
+      for (j = i + 1; j < js->n && js->s[js->idx[j]] == '"';) {
+        keypos = js->idx[j] + 1;
+        if (j + 1 >= js->n || js->s[js->idx[j + 1]] != ':') {
+          return 0;
+        }
+        q = memrchr(js->s + keypos, '"', js->idx[j + 1] - keypos);
+        keylen = q ? (size_t)(q - js->s) - keypos : 0;
+        pos = lsh_json_ws(js, js->idx[j + 1] + 1);
+        i = j + 2;
+        next = lsh_json_skip(js, pos, i);
+        if (keylen == seglen && memcmp(js->s + keypos, seg, seglen) == 0) {
+          break;
+        }
+        if (next >= js->n || js->s[js->idx[next]] != ',') {
+          return 0;
+        }
+        j = next + 1;
+      }
+      if (j >= js->n || js->s[js->idx[j]] != '"') {
+        return 0;
+      }
+    } else if (path[0] == '[' || (path[0] == '.' && path[1] == '[')) {
+      // Array element.
+      path += (path[0] == '.');
+      want = strtol(path + 1, &numend, 10);
+      if (numend == path + 1 || *numend != ']' || want < 0) {
+        return 0;
+      }
+      path = numend + 1;
+      if (js->s[pos] != '[') {
+        return 0;
+      }
+      pos = lsh_json_ws(js, pos + 1);
+      i++;
+      if (pos >= js->len || js->s[pos] == ']') {
+        return 0;
+      }
+      for (k = 0; k < want; k++) {
+        next = lsh_json_skip(js, pos, i);
+        if (next >= js->n || js->s[js->idx[next]] != ',') {
+          return 0;
+        }
+        pos = lsh_json_ws(js, js->idx[next] + 1);
+        i = next + 1;
+      }
+    } else {
+      return 0;
+    }
+  }
+  *start = pos;
+  *end = lsh_json_value_end(js, pos, lsh_json_skip(js, pos, i));
+  return *end > *start;
+}
+
+/**
+   @brief Write a JSON string's contents with escapes decoded.
+   @param out Output stream.
+   @param s String contents, without the quotes.
+   @param len Length of the contents.
+ */
+void lsh_json_unescape(struct lsh_out *out, const char *s, size_t len)
+{
+  const char *end = s + len, *bs;
+  char utf8[4];
+  unsigned long cp;
+  char hex[5];
+
+  while (s < end) {
+    bs = memchr(s, '\\', end - s);
+    if (!bs) {
+      lsh_out_write(out, s, end - s);
+      return;
+    }
+    lsh_out_write(out, s, bs - s);
+    if (bs + 1 >= end) {
+      return;
+    }
+    switch (bs[1]) {
+    case 'n': lsh_out_write(out, "\n", 1); break;
+    case 't': lsh_out_write(out, "\t", 1); break;
+    case 'r': lsh_out_write(out, "\r", 1); break;
+    case 'b': lsh_out_write(out, "\b", 1); break;
+    case 'f': lsh_out_write(out, "\f", 1); break;
+    case 'u':
+      if (bs + 6 > end) {
+        return;
+      }
+      memcpy(hex, bs + 2, 4);
+      hex[4] = '\0';
+      cp = strtoul(hex, NULL, 16);
+      if (cp < 0x80) {
+        utf8[0] = cp;
+        lsh_out_write(out, utf8, 1);
+      } else if (cp < 0x800) {
+        utf8[0] = 0xc0 | (cp >> 6);
+        utf8[1] = 0x80 | (cp & 0x3f);
+        lsh_out_write(out, utf8, 2);
+      } else {
+        utf8[0] = 0xe0 | (cp >> 12);
+        utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+        utf8[2] = 0x80 | (cp & 0x3f);
+        lsh_out_write(out, utf8, 3);
+      }
+      s = bs + 6;
+      continue;
+    default: lsh_out_write(out, bs + 1, 1); break;
+    }
+    s = bs + 2;
+  }
+}
+
+struct lsh_jget_ctx {
+  struct lsh_out *out;
+  const char *path;
+  const char *name;   // of the input, for errors
+  long lineno;
+  int raw;
+  uint32_t *idx;
+  size_t idxcap;
+};
+
+static int lsh_jget_block(const char *data, size_t len, void *ctx)
+{
+  struct lsh_jget_ctx *g = ctx;
+  const char *p = data, *end = data + len, *nl;
+  struct lsh_json js;
+  size_t start, vend;
+
+  while (p < end) {
+    nl = memchr(p, '\n', end - p);
+    js.s = p;
+    js.len = (nl ? nl : end) - p;
+    p += js.len + 1;
+    g->lineno++;
+    if (lsh_json_ws(&js, 0) == js.len) {
+      continue;
+    }
+    if (js.len > g->idxcap) {
+      free(g->idx);
+      g->idxcap = js.len * 2;
+      g->idx = malloc(g->idxcap * sizeof(uint32_t));
+      if (!g->idx) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    js.idx = g->idx;
+    lsh_json_index(&js);
+    if (!lsh_json_valid(&js)) {
+      // Skipped, as "null" would look like a missing value.
+      fprintf(stderr, "lsh: jget: %s:%ld: not JSON\n", g->name, g->lineno);
+    } else if (!lsh_json_lookup(&js, g->path, &start, &vend)) {
+      lsh_out_write(g->out, "null\n", 5);
+    } else if (g->raw && js.s[start] == '"' && vend - start >= 2) {
+      lsh_json_unescape(g->out, js.s + start + 1, vend - start - 2);
+      lsh_out_write(g->out, "\n", 1);
+    } else {
+      lsh_out_write(g->out, js.s + start, vend - start);
+      lsh_out_write(g->out, "\n", 1);
+    }
+  }
+  return g->out->error != 0;
+}
+
+/**
+   @brief Builtin command: extract a value from each line of JSON.
+   @param args List of args.  args[0] is "jget".  Accepts -r (print strings
+   without quotes or escapes), then a path such as ".a.b[0]" and files ("-" or
+   none for standard input).  Missing values print as null; lines that are
+   not JSON are reported on stderr and skipped.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_jget(char **args)
+{
+  struct lsh_jget_ctx g;
+  struct lsh_out out;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+  int i = 1, fd;
+
+  memset(&g, 0, sizeof(g));
+  if (args[i] && strcmp(args[i], "-r") == 0) {
+    g.raw = 1;
+    i++;
+  }
+  if (!args[i] || (args[i][0] != '.' && args[i][0] != '[')) {
+    fprintf(stderr, "lsh: jget: expected a path like .a.b[0]\n");
+    return 1;
+  }
+  g.path = args[i++];
+  files = args[i] ? args + i : stdin_args;
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  g.out = &out;
+  for (i = 0; files[i] != NULL; i++) {
+    if ((fd = lsh_open_input("jget", files[i])) < 0) {
+      continue;
+    }
+    g.name = files == stdin_args ? "(standard input)" : files[i];
+    g.lineno = 0;
+    if (lsh_scan_lines(fd, lsh_jget_block, &g) < 0) {
+      fprintf(stderr, "lsh: jget: %s: %s\n", files[i], strerror(errno));
+    }
+    lsh_close_input(fd);
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: jget: %s\n", strerror(out.error));
+  }
+  free(g.idx);
+  return 1;
+}
+
+/*
+  Integer sequences.  lsh_seq_next() yields plain integers; only the seq
+  builtin turns them into text, two digits at a time from a lookup table,
+  straight into the output buffer.
+*/
+struct lsh_seq {
+  long long next;
+  long long incr;
+  long long last;
+  int done;
+};
+
+void lsh_seq_init(struct lsh_seq *seq, long long first, long long incr,
+                  long long last)
+{
+  seq->next = first;
+  seq->incr = incr;
+  seq->last = last;
+  seq->done = incr > 0 ? first > last : first < last;
+}
+
+/**
+   @brief Get the next value of a sequence.
+   @return 1 and sets *value, or 0 when the sequence is exhausted.
+ */
+int lsh_seq_next(struct lsh_seq *seq, long long *value)
+{
+  if (seq->done) {
+    return 0;
+  }
+  *value = seq->next;
+  // In unsigned arithmetic, so that neither the distance left nor the size
+  // of the step can overflow; next only moves when it stays within last.
+  if (seq->incr > 0
+      ? (unsigned long long)seq->last - (unsigned long long)seq->next
+        < (unsigned long long)seq->incr
+      : (unsigned long long)seq->next - (unsigned long long)seq->last
+        < -(unsigned long long)seq->incr) {
+    seq->done = 1;
+  } else {
+    seq->next += seq->incr;
+  }
+  return 1;
+}
+
+static const char lsh_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "7475767778798081828384858687888990919293949596979899";
+
+/**
+   @brief Format an integer in decimal.
+   @param end One past the last byte of a buffer of at least 20 bytes.
+   @param value The value.
+   @return Pointer to the first digit; the digits run up to end.
+ */
+char *lsh_format_u64(char *end, uint64_t value)
+{
+  char *p = end;
+
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, lsh_digit_pairs + (value % 100) * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, lsh_digit_pairs + value * 2, 2);
+  } else {
+    *--p = '0' + value;
+  }
+  return p;
+}
+
+static int lsh_seq_parse_int(const char *str, long long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtoll(str, &end, 10);
+  return *str != '\0' && *end == '\0' && errno == 0;
+}
+
+/**
+   @brief Builtin command: print a sequence of numbers.
+   @param args List of args.  args[0] is "seq".  Accepts -s SEP and -w (pad
+   with zeros to equal width), then [FIRST [INCREMENT]] LAST.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_seq(char **args)
+{
+  struct lsh_seq seq;
+  struct lsh_out out;
+  const char *sep = "\n";
+  char digits[24], *p;
+  long long nums[3], value, k;
+  double fnums[3], f;
+  size_t seplen, width = 0, len;
+  int i = 1, n, j, is_int = 1, equal_width = 0, prec = 0;
+
+  while (args[i] && args[i][0] == '-' && (args[i][1] == 's'
+                                          || args[i][1] == 'w')) {
+    if (args[i][1] == 'w' && args[i][2] == '\0') {
+      equal_width = 1;
+    } else if (args[i][1] == 's') {
+      sep = args[i][2] ? args[i] + 2 : args[++i];
+      if (!sep) {
+        fprintf(stderr, "lsh: seq: -s requires a separator\n");
+        return 1;
+      }
+    } else {
+      break;
+    }
+    i++;
+  }
+  for (n = 0; args[i + n] != NULL; n++);
+  if (n < 1 || n > 3) {
+    fprintf(stderr, "lsh: seq: expected [FIRST [INCREMENT]] LAST\n");
+    return 1;
+  }
+  for (j = 0; j < n; j++) {
+    char *end;
+    is_int = is_int && lsh_seq_parse_int(args[i + j], &nums[j]);
+    fnums[j] = strtod(args[i + j], &end);
+    if (*end != '\0' || end == args[i + j]) {
+      fprintf(stderr, "lsh: seq: invalid number \"%s\"\n", args[i + j]);
+      return 1;
+    }
+    // Print as many decimals as the most precise argument, like seq(1).
+    if ((p = strchr(args[i + j], '.')) != NULL
+        && (int)strspn(p + 1, "0123456789") > prec) {
+      prec = strspn(p + 1, "0123456789");
+    }
+  }
+  if (n == 1) {
+    nums[2] = nums[0], nums[0] = 1, nums[1] = 1;
+    fnums[2] = fnums[0], fnums[0] = 1, fnums[1] = 1;
+  } else if (n == 2) {
+    nums[2] = nums[1], nums[1] = 1;
+    fnums[2] = fnums[1], fnums[1] = 1;
+  }
+  if (fnums[1] == 0) {
+    fprintf(stderr, "lsh: seq: increment must not be zero\n");
+    return 1;
+  }
+
+  seplen = strlen(sep);
+  lsh_out_init(&out, STDOUT_FILENO);
+  if (!is_int) {
+    // Rare enough that plain printf formatting is fine.
+    for (k = 0, f = fnums[0]; fnums[1] > 0 ? f <= fnums[2] : f >= fnums[2];
+         f = fnums[0] + ++k * fnums[1]) {
+      lsh_out_printf(&out, "%s%.*f", k ? sep : "", prec, f);
+      if (out.error) {
+        break;
+      }
+    }
+    if (k > 0) {
+      lsh_out_write(&out, "\n", 1);
+    }
+  } else {
+    if (equal_width) {
+      len = snprintf(digits, sizeof(digits), "%lld", nums[0]);
+      width = snprintf(digits, sizeof(digits), "%lld", nums[2]);
+      width = len > width ? len : width;
+    }
+    lsh_seq_init(&seq, nums[0], nums[1], nums[2]);
+    for (k = 0; lsh_seq_next(&seq, &value); k++) {
+      if (k > 0) {
+        if (out.len + seplen <= LSH_OUT_BUFSIZE) {
+          memcpy(out.buf + out.len, sep, seplen);
+          out.len += seplen;
+        } else {
+          // Too long to buffer (or to fit after what is buffered).
+          lsh_out_write(&out, sep, seplen);
+        }
+      }
+      if (out.len + sizeof(digits) + width > LSH_OUT_BUFSIZE) {
+        lsh_out_flush(&out);
+      }
+      if (out.error) {
+        break;
+      }
+      p = lsh_format_u64(digits + sizeof(digits),
+                         value < 0 ? -(uint64_t)value : (uint64_t)value);
+      len = digits + sizeof(digits) - p;
+      if (value < 0) {
+        out.buf[out.len++] = '-';
+        len++;
+      }
+      for (; len < width; len++) {
+        out.buf[out.len++] = '0';
+      }
+      memcpy(out.buf + out.len, p, digits + sizeof(digits) - p);
+      out.len += digits + sizeof(digits) - p;
+    }
+    if (k > 0) {
+      lsh_out_write(&out, "\n", 1);
+    }
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: seq: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+/*
+  File copying for cp and mv.  A copy first tries to share the source's
+  extents with FICLONE (btrfs, XFS, ...), then copy_file_range() so the data
+  never passes through user space, and only then falls back to read/write.
+  Several files are copied at once on a small thread pool.
+*/
+#define LSH_COPY_MAX_THREADS 8
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+struct lsh_copy_task {
+  const char *src;
+  char *dst;
+  int move;     // remove src afterwards (mv across file systems)
+  int skip;     // destination already taken by an earlier source
+  int failed;
+};
+
+/**
+   @brief Copy one regular file.
+   @param src Source path.
+   @param dst Destination path (created or truncated, unless it is the
+   source itself).
+   @param keep_times Nonzero to copy access and modification times too.
+   @return 0 on success, -1 after printing an error.
+   Runs on worker threads, so descriptors are opened close-on-exec but kept
+   out of the (single-threaded) fd registry; the builtin waits for all
+   workers before the shell can fork again.
+ */
+int lsh_copy_file(const char *cmd, const char *src, const char *dst,
+                  int keep_times)
+{
+  struct stat st, dst_st;
+  struct timespec times[2];
+  int in, out = -1, r = -1;
+  ssize_t n;
+  off_t done = 0;
+  char *buf = NULL;
+
+  in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0 || fstat(in, &st) != 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, src, strerror(errno));
+    goto out;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "lsh: %s: %s: is a directory\n", cmd, src);
+    goto out;
+  }
+  // Truncate only once we know the destination isn't the source.
+  out = open(dst, O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+  if (out < 0 || fstat(out, &dst_st) != 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, dst, strerror(errno));
+    goto out;
+  }
+  if (dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+    fprintf(stderr, "lsh: %s: %s and %s are the same file\n", cmd, src, dst);
+    close(out);
+    out = -1;
+    goto out;
+  }
+  if (ftruncate(out, 0) != 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, dst, strerror(errno));
+    goto out;
+  }
+
+  if (ioctl(out, FICLONE, in) == 0) {
+    r = 0;
+    goto out;
+  }
+  while (done < st.st_size) {
+    n = copy_file_range(in, NULL, out, NULL, st.st_size - done, 0);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  if (done >= st.st_size && st.st_size > 0) {
+    r = 0;
+    goto out;
+  }
+
+  // Fall back to copying through a buffer from wherever we got to.
+  buf = malloc(LSH_IO_BLOCKSIZE);
+  if (!buf || lseek(in, done, SEEK_SET) < 0 || lseek(out, done, SEEK_SET) < 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, src, strerror(errno));
+    goto out;
+  }
+  while ((n = read(in, buf, LSH_IO_BLOCKSIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "lsh: %s: %s: %s\n", cmd, src, strerror(errno));
+      goto out;
+    }
+    if (lsh_write_all(out, buf, n) != 0) {
+      fprintf(stderr, "lsh: %s: %s: %s\n", cmd, dst, strerror(errno));
+      goto out;
+    }
+  }
+  r = 0;
+
+out:
+  if (r == 0 && keep_times) {
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    futimens(out, times);
+  }
+  if (out >= 0 && close(out) != 0 && r == 0) {
+    fprintf(stderr, "lsh: %s: %s: %s\n", cmd, dst, strerror(errno));
+    r = -1;
+  }
+  if (in >= 0) {
+    close(in);
+  }
+  free(buf);
+  return r;
+}
+
+static void lsh_copy_worker(void *ctx, size_t i)
+{
+  struct lsh_copy_task *task = (struct lsh_copy_task *)ctx + i;
+  const char *cmd = task->move ? "mv" : "cp";
+
+  task->failed = lsh_copy_file(cmd, task->src, task->dst, task->move) != 0;
+  if (!task->failed && task->move && unlink(task->src) != 0) {
+    fprintf(stderr, "lsh: mv: %s: %s\n", task->src, strerror(errno));
+    task->failed = 1;
+  }
+}
+
+static int lsh_copy_task_cmp(const void *a, const void *b)
+{
+  const struct lsh_copy_task *x = *(const struct lsh_copy_task **)a;
+  const struct lsh_copy_task *y = *(const struct lsh_copy_task **)b;
+  int r = strcmp(x->dst, y->dst);
+
+  return r ? r : (x > y) - (x < y);
+}
+
+/**
+   @brief Skip every task whose destination an earlier task also writes, as
+   when copying a/x and b/x into one directory.  Parallel copies to the same
+   file would interleave.
+ */
+static void lsh_copy_dedup(const char *cmd, struct lsh_copy_task *tasks,
+                           int n)
+{
+  struct lsh_copy_task **order;
+  int i, j;
+
+  order = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(*order));
+  for (i = 0; i < n; i++) {
+    order[i] = &tasks[i];
+  }
+  qsort(order, n, sizeof(*order), lsh_copy_task_cmp);
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && strcmp(order[i]->dst, order[j]->dst) == 0; j++) {
+      fprintf(stderr, "lsh: %s: will not overwrite just-created %s with %s\n",
+              cmd, order[j]->dst, order[j]->src);
+      order[j]->skip = 1;
+    }
+  }
+}
+
+/**
+   @brief Shared implementation of the cp and mv builtins.
+   @param args Argument list: SRC... DEST.
+   @param move Nonzero for mv.
+ */
+static int lsh_copy_or_move(char **args, int move)
+{
+  const char *cmd = move ? "mv" : "cp";
+  struct lsh_copy_task *tasks, *task;
+  struct stat st;
+  const char *base;
+  char *dest;
+  int i, n, ntasks = 0, dest_is_dir, threads;
+  size_t len;
+
+  for (n = 0; args[n + 1] != NULL; n++);
+  if (n < 2) {
+    fprintf(stderr, "lsh: %s: expected SOURCE... DEST\n", cmd);
+    return 1;
+  }
+  dest = args[n];
+  dest_is_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+  if (n > 2 && !dest_is_dir) {
+    fprintf(stderr, "lsh: %s: %s: not a directory\n", cmd, dest);
+    return 1;
+  }
+
+  tasks = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_copy_task));
+  for (i = 1; i < n; i++) {
+    task = &tasks[i - 1];
+    task->src = args[i];
+    task->move = move;
+    task->skip = 0;
+    task->failed = 0;
+    if (dest_is_dir) {
+      base = strrchr(args[i], '/');
+      base = base ? base + 1 : args[i];
+      len = strlen(dest) + strlen(base) + 2;
+      task->dst = lsh_arena_alloc(&lsh_cmd_arena, len);
+      snprintf(task->dst, len, "%s%s%s", dest,
+               dest[strlen(dest) - 1] == '/' ? "" : "/", base);
+    } else {
+      task->dst = dest;
+    }
+  }
+  if (dest_is_dir) {
+    lsh_copy_dedup(cmd, tasks, n - 1);
+  }
+
+  for (i = 0; i < n - 1; i++) {
+    if (tasks[i].skip) {
+      continue;
+    }
+    tasks[ntasks] = tasks[i];
+    task = &tasks[ntasks];
+    // A rename is all mv needs unless the file changes file system.
+    if (move) {
+      if (rename(task->src, task->dst) == 0) {
+        continue;
+      } else if (errno != EXDEV) {
+        fprintf(stderr, "lsh: mv: %s: %s\n", task->src, strerror(errno));
+        continue;
+      }
+    }
+    ntasks++;
+  }
+
+  threads = lsh_default_threads();
+  if (threads > LSH_COPY_MAX_THREADS) {
+    threads = LSH_COPY_MAX_THREADS;
+  }
+  lsh_parallel_for(ntasks, threads, lsh_copy_worker, tasks);
+  return 1;
+}
+
+/**
+   @brief Builtin command: copy files.
+   @param args List of args.  args[0] is "cp".  Then SOURCE DEST, or
+   SOURCE... DIRECTORY.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_cp(char **args)
+{
+  return lsh_copy_or_move(args, 0);
+}
+
+/**
+   @brief Builtin command: move files.
+   @param args List of args.  args[0] is "mv".  Then SOURCE DEST, or
+   SOURCE... DIRECTORY.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_mv(char **args)
+{
+  return lsh_copy_or_move(args, 1);
+}
+
+/*
+  Content hashing.  XXH64 is the fast default; BLAKE3 is available when a
+  cryptographic hash is wanted.  BLAKE3 hashes 1 KiB chunks independently
+  and combines them in a binary tree, so one large file can have its chunks
+  hashed on several threads; with several files, the files themselves are
+  spread across threads instead.
+*/
+#define LSH_XXH_P1 0x9E3779B185EBCA87ULL
+#define LSH_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define LSH_XXH_P3 0x165667B19E3779F9ULL
+#define LSH_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define LSH_XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t lsh_rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t lsh_read64le(const unsigned char *p)
+{
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+      | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+      | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t lsh_read32le(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+      | (uint32_t)p[3] << 24;
+}
+
+struct lsh_xxh64 {
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char buf[32];
+  size_t buflen;
+};
+
+static inline uint64_t lsh_xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * LSH_XXH_P2;
+  acc = lsh_rotl64(acc, 31);
+  return acc * LSH_XXH_P1;
+}
+
+void lsh_xxh64_init(struct lsh_xxh64 *h)
+{
+  h->v[0] = LSH_XXH_P1 + LSH_XXH_P2;
+  h->v[1] = LSH_XXH_P2;
+  h->v[2] = 0;
+  h->v[3] = -LSH_XXH_P1;
+  h->total = 0;
+  h->buflen = 0;
+}
+
+static void lsh_xxh64_stripes(struct lsh_xxh64 *h, const unsigned char *p,
+                              size_t nstripes)
+{
+  uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+
+  while (nstripes--) {
+    v0 = lsh_xxh64_round(v0, lsh_read64le(p));
+    v1 = lsh_xxh64_round(v1, lsh_read64le(p + 8));
+    v2 = lsh_xxh64_round(v2, lsh_read64le(p + 16));
+    v3 = lsh_xxh64_round(v3, lsh_read64le(p + 24));
+    p += 32;
+  }
+  h->v[0] = v0;
+  h->v[1] = v1;
+  h->v[2] = v2;
+  h->v[3] = v3;
+}
+
+void lsh_xxh64_update(struct lsh_xxh64 *h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  size_t take;
+
+  h->total += len;
+  if (h->buflen > 0) {
+    take = 32 - h->buflen < len ? 32 - h->buflen : len;
+    memcpy(h->buf + h->buflen, p, take);
+    h->buflen += take;
+    p += take;
+    len -= take;
+    if (h->buflen < 32) {
+      return;
+    }
+    lsh_xxh64_stripes(h, h->buf, 1);
+    h->buflen = 0;
+  }
+  lsh_xxh64_stripes(h, p, len / 32);
+  p += len / 32 * 32;
+  len %= 32;
+  memcpy(h->buf, p, len);
+  h->buflen = len;
+}
+
+uint64_t lsh_xxh64_digest(const struct lsh_xxh64 *h)
+{
+  const unsigned char *p = h->buf, *end = h->buf + h->buflen;
+  uint64_t acc;
+  int i;
+
+  if (h->total >= 32) {
+    acc = lsh_rotl64(h->v[0], 1) + lsh_rotl64(h->v[1], 7)
+        + lsh_rotl64(h->v[2], 12) + lsh_rotl64(h->v[3], 18);
+    for (i = 0; i < 4; i++) {
+      acc ^= lsh_xxh64_round(0, h->v[i]);
+      acc = acc * LSH_XXH_P1 + LSH_XXH_P4;
+    }
+  } else {
+    acc = h->v[2] + LSH_XXH_P5;
+  }
+  acc += h->total;
+
+  for (; p + 8 <= end; p += 8) {
+    acc ^= lsh_xxh64_round(0, lsh_read64le(p));
+    acc = lsh_rotl64(acc, 27) * LSH_XXH_P1 + LSH_XXH_P4;
+  }
+  if (p + 4 <= end) {
+    acc ^= (uint64_t)lsh_read32le(p) * LSH_XXH_P1;
+    acc = lsh_rotl64(acc, 23) * LSH_XXH_P2 + LSH_XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    acc ^= *p * LSH_XXH_P5;
+    acc = lsh_rotl64(acc, 11) * LSH_XXH_P1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= LSH_XXH_P2;
+  acc ^= acc >> 29;
+  acc *= LSH_XXH_P3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+#define LSH_B3_CHUNK_LEN 1024
+#define LSH_B3_BLOCK_LEN 64
+#define LSH_B3_CHUNK_START 1
+#define LSH_B3_CHUNK_END 2
+#define LSH_B3_PARENT 4
+#define LSH_B3_ROOT 8
+
+static const uint32_t lsh_b3_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const unsigned char lsh_b3_perm[16] = {
+  2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+static inline uint32_t lsh_rotr32(uint32_t x, int r)
+{
+  return (x >> r) | (x << (32 - r));
+}
+
+#define LSH_B3_G(a, b, c, d, mx, my)                     \
+  do {                                                   \
+    s[a] = s[a] + s[b] + (mx);                           \
+    s[d] = lsh_rotr32(s[d] ^ s[a], 16);                  \
+    s[c] = s[c] + s[d];                                  \
+    s[b] = lsh_rotr32(s[b] ^ s[c], 12);                  \
+    s[a] = s[a] + s[b] + (my);                           \
+    s[d] = lsh_rotr32(s[d] ^ s[a], 8);                   \
+    s[c] = s[c] + s[d];                                  \
+    s[b] = lsh_rotr32(s[b] ^ s[c], 7);                   \
+  } while (0)
+
+/**
+   @brief The BLAKE3 compression function.
+   @param cv Input chaining value.
+   @param block 64-byte block (zero padded).
+   @param counter Chunk counter.
+   @param block_len Bytes of the block actually used.
+   @param flags Domain flags.
+   @param out Set to the first 8 output words.
+ */
+static void lsh_b3_compress(const uint32_t cv[8], const unsigned char *block,
+                            uint64_t counter, uint32_t block_len,
+                            uint32_t flags, uint32_t out[8])
+{
+  uint32_t s[16], m[16], t[16];
+  int i, r;
+
+  for (i = 0; i < 16; i++) {
+    m[i] = lsh_read32le(block + 4 * i);
+  }
+  memcpy(s, cv, 8 * sizeof(uint32_t));
+  memcpy(s + 8, lsh_b3_iv, 4 * sizeof(uint32_t));
+  s[12] = (uint32_t)counter;
+  s[13] = (uint32_t)(counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+  for (r = 0; r < 7; r++) {
+    LSH_B3_G(0, 4, 8, 12, m[0], m[1]);
+    LSH_B3_G(1, 5, 9, 13, m[2], m[3]);
+    LSH_B3_G(2, 6, 10, 14, m[4], m[5]);
+    LSH_B3_G(3, 7, 11, 15, m[6], m[7]);
+    LSH_B3_G(0, 5, 10, 15, m[8], m[9]);
+    LSH_B3_G(1, 6, 11, 12, m[10], m[11]);
+    LSH_B3_G(2, 7, 8, 13, m[12], m[13]);
+    LSH_B3_G(3, 4, 9, 14, m[14], m[15]);
+    for (i = 0; i < 16; i++) {
+      t[i] = m[lsh_b3_perm[i]];
+    }
+    memcpy(m, t, sizeof(m));
+  }
+  for (i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+  }
+}
+
+/*
+  A chunk in progress.  The last block of a chunk is held back until we know
+  whether more input follows, since it is compressed with different flags.
+*/
+struct lsh_b3_chunk {
+  uint32_t cv[8];
+  uint64_t counter;
+  unsigned char block[LSH_B3_BLOCK_LEN];
+  size_t block_len;
+  size_t blocks_done;
+};
+
+/*
+  A node that has not been compressed yet: whatever compresses it decides
+  whether it is the root.
+*/
+struct lsh_b3_node {
+  uint32_t cv[8];
+  unsigned char block[LSH_B3_BLOCK_LEN];
+  uint64_t counter;
+  uint32_t block_len;
+  uint32_t flags;
+};
+
+struct lsh_blake3 {
+  struct lsh_b3_chunk chunk;
+  uint32_t stack[54][8];
+  int stack_len;
+};
+
+static void lsh_b3_chunk_init(struct lsh_b3_chunk *c, uint64_t counter)
+{
+  memcpy(c->cv, lsh_b3_iv, sizeof(c->cv));
+  c->counter = counter;
+  c->block_len = 0;
+  c->blocks_done = 0;
+}
+
+static size_t lsh_b3_chunk_len(const struct lsh_b3_chunk *c)
+{
+  return c->blocks_done * LSH_B3_BLOCK_LEN + c->block_len;
+}
+
+static void lsh_b3_chunk_update(struct lsh_b3_chunk *c,
+                                const unsigned char *p, size_t len)
+{
+  size_t take;
+
+  while (len > 0) {
+    if (c->block_len == LSH_B3_BLOCK_LEN) {
+      lsh_b3_compress(c->cv, c->block, c->counter, LSH_B3_BLOCK_LEN,
+                      c->blocks_done == 0 ? LSH_B3_CHUNK_START : 0, c->cv);
+      c->blocks_done++;
+      c->block_len = 0;
+    }
+    take = LSH_B3_BLOCK_LEN - c->block_len;
+    take = take < len ? take : len;
+    memcpy(c->block + c->block_len, p, take);
+    c->block_len += take;
+    p += take;
+    len -= take;
+  }
+}
+
+static void lsh_b3_chunk_node(const struct lsh_b3_chunk *c,
+                              struct lsh_b3_node *node)
+{
+  memcpy(node->cv, c->cv, sizeof(node->cv));
+  memset(node->block, 0, sizeof(node->block));
+  memcpy(node->block, c->block, c->block_len);
+  node->counter = c->counter;
+  node->block_len = c->block_len;
+  node->flags = LSH_B3_CHUNK_END
+      | (c->blocks_done == 0 ? LSH_B3_CHUNK_START : 0);
+}
+
+static void lsh_b3_parent_node(const uint32_t left[8], const uint32_t right[8],
+                               struct lsh_b3_node *node)
+{
+  int i;
+
+  memcpy(node->cv, lsh_b3_iv, sizeof(node->cv));
+  for (i = 0; i < 8; i++) {
+    node->block[4 * i] = left[i];
+    node->block[4 * i + 1] = left[i] >> 8;
+    node->block[4 * i + 2] = left[i] >> 16;
+    node->block[4 * i + 3] = left[i] >> 24;
+    node->block[32 + 4 * i] = right[i];
+    node->block[32 + 4 * i + 1] = right[i] >> 8;
+    node->block[32 + 4 * i + 2] = right[i] >> 16;
+    node->block[32 + 4 * i + 3] = right[i] >> 24;
+  }
+  node->counter = 0;
+  node->block_len = LSH_B3_BLOCK_LEN;
+  node->flags = LSH_B3_PARENT;
+}
+
+static void lsh_b3_node_cv(const struct lsh_b3_node *node, uint32_t cv[8])
+{
+  lsh_b3_compress(node->cv, node->block, node->counter, node->block_len,
+                  node->flags, cv);
+}
+
+/**
+   @brief Push the chaining value of a finished chunk, merging completed
+   subtrees.
+   @param h Hasher.
+   @param cv Chaining value of the chunk.
+   @param total_chunks Number of chunks finished so far, including this one.
+ */
+static void lsh_b3_push_chunk(struct lsh_blake3 *h, const uint32_t cv[8],
+                              uint64_t total_chunks)
+{
+  struct lsh_b3_node parent;
+  uint32_t merged[8];
+
+  memcpy(merged, cv, sizeof(merged));
+  while ((total_chunks & 1) == 0) {
+    lsh_b3_parent_node(h->stack[--h->stack_len], merged, &parent);
+    lsh_b3_node_cv(&parent, merged);
+    total_chunks >>= 1;
+  }
+  memcpy(h->stack[h->stack_len++], merged, sizeof(merged));
+}
+
+void lsh_blake3_init(struct lsh_blake3 *h)
+{
+  lsh_b3_chunk_init(&h->chunk, 0);
+  h->stack_len = 0;
+}
+
+void lsh_blake3_update(struct lsh_blake3 *h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  struct lsh_b3_node node;
+  uint32_t cv[8];
+  size_t take;
+
+  while (len > 0) {
+    if (lsh_b3_chunk_len(&h->chunk) == LSH_B3_CHUNK_LEN) {
+      lsh_b3_chunk_node(&h->chunk, &node);
+      lsh_b3_node_cv(&node, cv);
+      lsh_b3_push_chunk(h, cv, h->chunk.counter + 1);
+      lsh_b3_chunk_init(&h->chunk, h->chunk.counter + 1);
+    }
+    take = LSH_B3_CHUNK_LEN - lsh_b3_chunk_len(&h->chunk);
+    take = take < len ? take : len;
+    lsh_b3_chunk_update(&h->chunk, p, take);
+    p += take;
+    len -= take;
+  }
+}
+
+/**
+   @brief Finish a BLAKE3 hash.
+   @param h Hasher.
+   @param out 32-byte digest.
+ */
+void lsh_blake3_final(const struct lsh_blake3 *h, unsigned char out[32])
+{
+  struct lsh_b3_node node;
+  uint32_t cv[8];
+  int i;
+
+  lsh_b3_chunk_node(&h->chunk, &node);
+  for (i = h->stack_len; i-- > 0;) {
+    lsh_b3_node_cv(&node, cv);
+    lsh_b3_parent_node(h->stack[i], cv, &node);
+  }
+  lsh_b3_compress(node.cv, node.block, node.counter, node.block_len,
+                  node.flags | LSH_B3_ROOT, cv);
+  for (i = 0; i < 8; i++) {
+    out[4 * i] = cv[i];
+    out[4 * i + 1] = cv[i] >> 8;
+    out[4 * i + 2] = cv[i] >> 16;
+    out[4 * i + 3] = cv[i] >> 24;
+  }
+}
+
+/*
+  Tree-parallel BLAKE3 over a buffer: every chunk but the last is hashed to
+  its chaining value on the thread pool, in groups; the tree above them is
+  then built exactly as lsh_blake3_update() would have.
+*/
+#define LSH_B3_GROUP_CHUNKS 256
+
+struct lsh_b3_parallel {
+  const unsigned char *data;
+  uint32_t (*cvs)[8];
+  uint64_t nchunks;  // chunks hashed in parallel (all but the last)
+};
+
+static void lsh_b3_group(void *ctx, size_t group)
+{
+  struct lsh_b3_parallel *par = ctx;
+  struct lsh_b3_chunk chunk;
+  struct lsh_b3_node node;
+  uint64_t i = group * (uint64_t)LSH_B3_GROUP_CHUNKS;
+  uint64_t end = i + LSH_B3_GROUP_CHUNKS;
+
+  for (end = end < par->nchunks ? end : par->nchunks; i < end; i++) {
+    lsh_b3_chunk_init(&chunk, i);
+    lsh_b3_chunk_update(&chunk, par->data + i * LSH_B3_CHUNK_LEN,
+                        LSH_B3_CHUNK_LEN);
+    lsh_b3_chunk_node(&chunk, &node);
+    lsh_b3_node_cv(&node, par->cvs[i]);
+  }
+}
+
+void lsh_blake3_parallel(const void *data, size_t len, int threads,
+                         unsigned char out[32])
+{
+  struct lsh_b3_parallel par;
+  struct lsh_blake3 h;
+  uint64_t i;
+
+  lsh_blake3_init(&h);
+  par.data = data;
+  par.nchunks = len > 0 ? (len - 1) / LSH_B3_CHUNK_LEN : 0;
+  par.cvs = malloc((par.nchunks + 1) * sizeof(*par.cvs));
+  if (!par.cvs) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  lsh_parallel_for((par.nchunks + LSH_B3_GROUP_CHUNKS - 1)
+                   / LSH_B3_GROUP_CHUNKS, threads, lsh_b3_group, &par);
+  for (i = 0; i < par.nchunks; i++) {
+    lsh_b3_push_chunk(&h, par.cvs[i], i + 1);
+  }
+  lsh_b3_chunk_init(&h.chunk, par.nchunks);
+  lsh_b3_chunk_update(&h.chunk, par.data + par.nchunks * LSH_B3_CHUNK_LEN,
+                      len - par.nchunks * LSH_B3_CHUNK_LEN);
+  lsh_blake3_final(&h, out);
+  free(par.cvs);
+}
+
+struct lsh_hash_task {
+  const char *name;
+  int blake3;
+  int threads;  // for tree-parallel BLAKE3 of a single file
+  int failed;
+  char hex[65];
+};
+
+static void lsh_hash_hex(char *hex, const unsigned char *digest, size_t len)
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hex[2 * i] = digits[digest[i] >> 4];
+    hex[2 * i + 1] = digits[digest[i] & 15];
+  }
+  hex[2 * len] = '\0';
+}
+
+static void lsh_hash_worker(void *ctx, size_t i)
+{
+  struct lsh_hash_task *task = (struct lsh_hash_task *)ctx + i;
+  struct lsh_xxh64 xxh;
+  struct lsh_blake3 b3;
+  unsigned char digest[32];
+  uint64_t x;
+  char *map, *buf;
+  size_t len;
+  ssize_t n;
+  int fd, j;
+
+  // Worker threads keep their descriptors out of the fd registry; see
+  // lsh_copy_file().
+  fd = strcmp(task->name, "-") == 0 ? STDIN_FILENO
+      : open(task->name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "lsh: hashsum: %s: %s\n", task->name, strerror(errno));
+    task->failed = 1;
+    return;
+  }
+  lsh_xxh64_init(&xxh);
+  lsh_blake3_init(&b3);
+  map = lsh_map_input(fd, &len);
+  if (map) {
+    madvise(map, len, MADV_SEQUENTIAL);
+    if (task->blake3) {
+      lsh_blake3_parallel(map, len, task->threads, digest);
+    } else {
+      lsh_xxh64_update(&xxh, map, len);
+    }
+    munmap(map, len);
+  } else if ((buf = malloc(LSH_IO_BLOCKSIZE)) != NULL) {
+    while ((n = read(fd, buf, LSH_IO_BLOCKSIZE)) != 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0) {
+        fprintf(stderr, "lsh: hashsum: %s: %s\n", task->name,
+                strerror(errno));
+        task->failed = 1;
+        break;
+      }
+      if (task->blake3) {
+        lsh_blake3_update(&b3, buf, n);
+      } else {
+        lsh_xxh64_update(&xxh, buf, n);
+      }
+    }
+    free(buf);
+    if (task->blake3) {
+      lsh_blake3_final(&b3, digest);
+    }
+  } else {
+    task->failed = 1;
+  }
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  if (task->blake3) {
+    lsh_hash_hex(task->hex, digest, 32);
+  } else {
+    x = lsh_xxh64_digest(&xxh);
+    for (j = 0; j < 8; j++) {
+      digest[j] = x >> (56 - 8 * j);
+    }
+    lsh_hash_hex(task->hex, digest, 8);
+  }
+}
+
+/**
+   @brief Builtin command: hash files.
+   @param args List of args.  args[0] is "hashsum".  Accepts -a ALGORITHM
+   (xxh64, the default, or blake3), then files ("-" or none for standard
+   input).  Output is "HASH  FILE" as printed by xxhsum and b3sum.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_hashsum(char **args)
+{
+  struct lsh_hash_task *tasks;
+  struct lsh_out out;
+  char *stdin_args[] = { "-", NULL };
+  char **files;
+  int i = 1, n, blake3 = 0, threads = lsh_default_threads();
+
+  if (args[i] && strncmp(args[i], "-a", 2) == 0) {
+    const char *algo = args[i][2] ? args[i] + 2 : args[++i];
+    if (algo && strcmp(algo, "blake3") == 0) {
+      blake3 = 1;
+    } else if (!algo || strcmp(algo, "xxh64") != 0) {
+      fprintf(stderr, "lsh: hashsum: expected -a xxh64 or -a blake3\n");
+      return 1;
+    }
+    i++;
+  }
+  files = args[i] ? args + i : stdin_args;
+  for (n = 0; files[n]; n++);
+
+  tasks = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_hash_task));
+  for (i = 0; i < n; i++) {
+    tasks[i].name = files[i];
+    tasks[i].blake3 = blake3;
+    tasks[i].threads = n == 1 ? threads : 1;
+    tasks[i].failed = 0;
+  }
+  lsh_parallel_for(n, threads, lsh_hash_worker, tasks);
+
+  lsh_out_init(&out, STDOUT_FILENO);
+  for (i = 0; i < n; i++) {
+    if (!tasks[i].failed) {
+      lsh_out_printf(&out, "%s  %s\n", tasks[i].hex, tasks[i].name);
+    }
+  }
+  if (lsh_out_flush(&out) != 0) {
+    fprintf(stderr, "lsh: hashsum: %s\n", strerror(out.error));
+  }
+  return 1;
+}
+
+/*
+  Ctrl-C handling for long-running builtins: while one runs, SIGINT only sets
+  a flag (and interrupts blocking calls, since SA_RESTART is not used) so the
+  builtin can stop cleanly instead of taking the whole shell down.
+*/
+volatile sig_atomic_t lsh_interrupted = 0;
+
+static void lsh_interrupt_handler(int sig)
+{
+  (void)sig;
+  lsh_interrupted = 1;
+}
+
+void lsh_interrupt_begin(struct sigaction *old)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lsh_interrupt_handler;
+  sigemptyset(&sa.sa_mask);
+  lsh_interrupted = 0;
+  sigaction(SIGINT, &sa, old);
+}
+
+void lsh_interrupt_end(const struct sigaction *old)
+{
+  sigaction(SIGINT, old, NULL);
+}
+
+int lsh_execute(char **args);
+
+/*
+  Watching files with inotify.  Directories are watched recursively, up to a
+  limit on the number of watches; directories created later are added as
+  their creation events arrive.
+*/
+#define LSH_ONCHANGE_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE \
+                             | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define LSH_ONCHANGE_MAX_WATCHES 8192
+#define LSH_ONCHANGE_DEBOUNCE_MS 100
+
+struct lsh_watch {
+  int ifd;
+  int count;
+  int max;
+  int recursive;
+  // watch descriptor -> directory path, for adding new subdirectories
+  char **paths;
+  int npaths;
+};
+
+/**
+   @brief Watch a path, and everything below it if it is a directory.
+   @param w Watch set.
+   @param path The path.
+   @return 0 on success, -1 if it could not be watched at all.
+ */
+int lsh_watch_add(struct lsh_watch *w, const char *path)
+{
+  struct dirent *ent;
+  struct stat st;
+  char *sub, **paths;
+  size_t len;
+  DIR *dir;
+  int wd;
+
+  if (w->count >= w->max) {
+    fprintf(stderr, "lsh: onchange: watch limit (%d) reached at %s\n", w->max,
+            path);
+    return -1;
+  }
+  wd = inotify_add_watch(w->ifd, path, LSH_ONCHANGE_EVENTS);
+  if (wd < 0) {
+    fprintf(stderr, "lsh: onchange: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  w->count++;
+  if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return 0;
+  }
+
+  if (wd >= w->npaths) {
+    paths = realloc(w->paths, (wd + 64) * sizeof(char *));
+    if (!paths) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    memset(paths + w->npaths, 0, (wd + 64 - w->npaths) * sizeof(char *));
+    w->paths = paths;
+    w->npaths = wd + 64;
+  }
+  free(w->paths[wd]);
+  w->paths[wd] = strdup(path);
+
+  if (!w->recursive || (dir = opendir(path)) == NULL) {
+    return 0;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_type != DT_DIR || strcmp(ent->d_name, ".") == 0
+        || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    len = strlen(path) + strlen(ent->d_name) + 2;
+    sub = malloc(len);
+    if (!sub) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(sub, len, "%s/%s", path, ent->d_name);
+    if (lsh_watch_add(w, sub) != 0 && w->count >= w->max) {
+      free(sub);
+      break;
+    }
+    free(sub);
+  }
+  closedir(dir);
+  return 0;
+}
+
+/**
+   @brief Read and handle all pending inotify events.
+   @return Number of events read, or -1 on error.
+ */
+int lsh_watch_drain(struct lsh_watch *w)
+{
+  char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  char *sub;
+  size_t len;
+  ssize_t n;
+  char *p;
+  int events = 0;
+
+  while ((n = read(w->ifd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      events++;
+      if (w->recursive && (ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR)
+          && ev->wd < w->npaths && w->paths[ev->wd] && ev->len > 0) {
+        len = strlen(w->paths[ev->wd]) + strlen(ev->name) + 2;
+        sub = malloc(len);
+        if (sub) {
+          snprintf(sub, len, "%s/%s", w->paths[ev->wd], ev->name);
+          lsh_watch_add(w, sub);
+          free(sub);
+        }
+      }
+    }
+  }
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    return -1;
+  }
+  return events;
+}
+
+/**
+   @brief Builtin command: re-run a command whenever files change.
+   @param args List of args.  args[0] is "onchange".  Accepts -d MS (quiet
+   period before running, default 100), -m N (watch limit) and -n (don't
+   descend into directories), then PATHS... -- COMMAND ARGS...
+   @return 1 to continue executing, or 0 if the command asked to exit.
+   Runs until interrupted with Ctrl-C, using no CPU while nothing changes.
+ */
+int lsh_onchange(char **args)
+{
+  struct lsh_watch w;
+  struct lsh_arena_mark mark;
+  struct sigaction oldint;
+  struct pollfd pfd;
+  char **cmd, **copy;
+  int i, j, ncmd, debounce = LSH_ONCHANGE_DEBOUNCE_MS, status = 1, r;
+
+  memset(&w, 0, sizeof(w));
+  w.max = LSH_ONCHANGE_MAX_WATCHES;
+  w.recursive = 1;
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1]
+         && strcmp(args[i], "--") != 0; i++) {
+    if (strcmp(args[i], "-n") == 0) {
+      w.recursive = 0;
+    } else if ((strcmp(args[i], "-d") == 0 || strcmp(args[i], "-m") == 0)
+               && args[i + 1]) {
+      if (args[i][1] == 'd') {
+        debounce = atoi(args[++i]);
+      } else {
+        w.max = atoi(args[++i]);
+      }
+    } else {
+      fprintf(stderr, "lsh: onchange: unknown option \"%s\"\n", args[i]);
+      return 1;
+    }
+  }
+  for (j = i; args[j] != NULL && strcmp(args[j], "--") != 0; j++);
+  if (j == i || args[j] == NULL || args[j + 1] == NULL) {
+    fprintf(stderr, "lsh: onchange: expected PATHS... -- COMMAND\n");
+    return 1;
+  }
+  cmd = args + j + 1;
+  for (ncmd = 0; cmd[ncmd]; ncmd++);
+
+  w.ifd = lsh_fd_register(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+  if (w.ifd < 0) {
+    perror("lsh: onchange");
+    return 1;
+  }
+  for (; i < j; i++) {
+    lsh_watch_add(&w, args[i]);
+  }
+  if (w.count == 0) {
+    // poll() would wait forever.
+    fprintf(stderr, "lsh: onchange: nothing to watch\n");
+    status = 1;
+    goto out;
+  }
+
+  lsh_interrupt_begin(&oldint);
+  pfd.fd = w.ifd;
+  pfd.events = POLLIN;
+  while (status && !lsh_interrupted) {
+    // Sleep until something happens, then until things settle down.
+    r = poll(&pfd, 1, -1);
+    if (r < 0) {
+      continue;
+    }
+    while (!lsh_interrupted && lsh_watch_drain(&w) > 0
+           && poll(&pfd, 1, debounce) > 0);
+    if (lsh_interrupted) {
+      break;
+    }
+
+    // lsh_execute() may rewrite its arguments, so give it a fresh copy.
+    // That, and whatever the run allocates, is released after it.
+    lsh_arena_mark(&lsh_cmd_arena, &mark);
+    copy = lsh_arena_alloc(&lsh_cmd_arena, (ncmd + 1) * sizeof(char *));
+    for (j = 0; j < ncmd; j++) {
+      copy[j] = lsh_arena_alloc(&lsh_cmd_arena, strlen(cmd[j]) + 1);
+      strcpy(copy[j], cmd[j]);
+    }
+    copy[ncmd] = NULL;
+    status = lsh_execute(copy);
+    fflush(stdout);
+    lsh_arena_release(&lsh_cmd_arena, &mark);
+    // Drop events caused by the command itself.
+    lsh_watch_drain(&w);
+  }
+  lsh_interrupt_end(&oldint);
+
+out:
+  for (i = 0; i < w.npaths; i++) {
+    free(w.paths[i]);
+  }
+  free(w.paths);
+  lsh_fd_close(w.ifd);
+  return status;
+}
+
+/*
+  Resource limits.  The same table backs the ulimit builtin, which changes
+  the shell's own limits (and so those of everything it starts later), and
+  the per-command "@name=value" modifiers, which are applied with setrlimit()
+  in the child before exec.
+*/
+struct lsh_rlimit_info {
+  const char *name;   // modifier name
+  char opt;           // ulimit option
+  int resource;
+  rlim_t unit;        // ulimit unit in bytes, 1 for counts and seconds
+  const char *desc;
+};
+
+struct lsh_rlimit_info lsh_rlimits[] = {
+  { "core", 'c', RLIMIT_CORE, 1024, "core file size (kbytes)" },
+  { "data", 'd', RLIMIT_DATA, 1024, "data seg size (kbytes)" },
+  { "fsize", 'f', RLIMIT_FSIZE, 1024, "file size (kbytes)" },
+  { "memlock", 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+  { "nofile", 'n', RLIMIT_NOFILE, 1, "open files" },
+  { "stack", 's', RLIMIT_STACK, 1024, "stack size (kbytes)" },
+  { "cputime", 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+  { "nproc", 'u', RLIMIT_NPROC, 1, "max user processes" },
+  { "as", 'v', RLIMIT_AS, 1024, "virtual memory (kbytes)" },
+};
+
+int lsh_num_rlimits() {
+  return sizeof(lsh_rlimits) / sizeof(struct lsh_rlimit_info);
+}
+
+/**
+   @brief Parse a limit value: "unlimited" or a number of units.
+   @param str The value.
+   @param unit Size of one unit in bytes.
+   @param suffixes Whether K/M/G/T suffixes are accepted.
+   @param out Receives the limit.
+   @return 0 on success, -1 if the value is invalid.
+ */
+int lsh_parse_rlim(const char *str, rlim_t unit, int suffixes, rlim_t *out)
+{
+  unsigned long long n;
+  char *end;
+
+  if (strcmp(str, "unlimited") == 0) {
+    *out = RLIM_INFINITY;
+    return 0;
+  }
+  if (*str < '0' || *str > '9') {
+    return -1;
+  }
+  errno = 0;
+  n = strtoull(str, &end, 10);
+  if (errno != 0) {
+    return -1;
+  }
+  if (suffixes) {
+    switch (*end) {
+    case 'k': case 'K': unit *= 1024; end++; break;
+    case 'm': case 'M': unit *= 1024 * 1024; end++; break;
+    case 'g': case 'G': unit *= 1024ULL * 1024 * 1024; end++; break;
+    case 't': case 'T': unit *= 1024ULL * 1024 * 1024 * 1024; end++; break;
+    }
+  }
+  if (*end != '\0' || (unit > 1 && n > RLIM_INFINITY / unit)) {
+    return -1;
+  }
+  *out = n * unit;
+  return 0;
+}
+
+/**
+   @brief Print one limit in ulimit's units.
+ */
+void lsh_ulimit_print(const struct lsh_rlimit_info *info, int hard, int label)
+{
+  struct rlimit rl;
+  rlim_t v;
+
+  if (getrlimit(info->resource, &rl) != 0) {
+    perror("lsh: ulimit");
+    return;
+  }
+  v = hard ? rl.rlim_max : rl.rlim_cur;
+  if (label) {
+    printf("%-28s(-%c) ", info->desc, info->opt);
+  }
+  if (v == RLIM_INFINITY) {
+    printf("unlimited\n");
+  } else {
+    printf("%llu\n", (unsigned long long)(v / info->unit));
+  }
+}
+
+/**
+   @brief Builtin command: show or set the shell's resource limits.
+   @param args List of args.  "ulimit [-H|-S] [-a | -OPT [value]]"
+   @return Always returns 1, to continue executing.
+ */
+int lsh_ulimit(char **args)
+{
+  const struct lsh_rlimit_info *info = NULL;
+  struct rlimit rl;
+  rlim_t v;
+  int i, j, hard = 0, soft = 0, all = 0;
+  const char *p;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (p = args[i] + 1; *p; p++) {
+      if (*p == 'H') {
+        hard = 1;
+      } else if (*p == 'S') {
+        soft = 1;
+      } else if (*p == 'a') {
+        all = 1;
+      } else {
+        for (j = 0; j < lsh_num_rlimits() && lsh_rlimits[j].opt != *p; j++);
+        if (j == lsh_num_rlimits()) {
+          fprintf(stderr, "lsh: ulimit: -%c: invalid option\n", *p);
+          return 1;
+        }
+        info = &lsh_rlimits[j];
+      }
+    }
+  }
+
+  if (all) {
+    for (j = 0; j < lsh_num_rlimits(); j++) {
+      lsh_ulimit_print(&lsh_rlimits[j], hard && !soft, 1);
+    }
+    return 1;
+  }
+  if (!info) {
+    info = &lsh_rlimits[2];  // -f, as in other shells
+  }
+  if (args[i] == NULL) {
+    lsh_ulimit_print(info, hard && !soft, 0);
+    return 1;
+  }
+
+  if (lsh_parse_rlim(args[i], info->unit, 0, &v) != 0) {
+    fprintf(stderr, "lsh: ulimit: %s: invalid limit\n", args[i]);
+    return 1;
+  }
+  if (getrlimit(info->resource, &rl) != 0) {
+    perror("lsh: ulimit");
+    return 1;
+  }
+  // Without -H or -S both limits are set.
+  if (hard || !soft) {
+    rl.rlim_max = v;
+  }
+  if (soft || !hard) {
+    rl.rlim_cur = v;
+  }
+  if (setrlimit(info->resource, &rl) != 0) {
+    fprintf(stderr, "lsh: ulimit: %s: %s\n", info->desc, strerror(errno));
+  }
+  return 1;
+}
+
+/*
+  Job dashboard.  A job is its process and every descendant still running,
+  such as the stages under a background pipeline's shell; they are found
+  through /proc/<pid>/task/<pid>/children (where the kernel provides it) and
+  their usage is added up.  Each process's stat, io and children files are
+  opened once and re-read with pread() on every sample.  A reaped child's CPU
+  time and I/O move into its parent's counters, so the totals stay continuous
+  as stages come and go.  Lines that did not change since the last frame are
+  not redrawn, so a quiet table costs almost nothing to refresh.
+*/
+#define LSH_JTOP_LINE 160
+
+struct lsh_jtop_proc {
+  pid_t pid;
+  int statfd;
+  int iofd;
+  int childfd;
+  int seen;
+};
+
+struct lsh_jtop_row {
+  struct lsh_job *job;
+  struct lsh_jtop_proc *procs;  // procs[0] is the job's own process
+  int nprocs;
+  int capprocs;
+  unsigned long long ticks;   // utime + stime, children included
+  unsigned long long rchar;
+  unsigned long long wchar;
+  char line[LSH_JTOP_LINE];   // as last drawn
+};
+
+/**
+   @brief Read a whole (small) /proc file from offset 0.
+   @return Bytes read, or -1.
+ */
+ssize_t lsh_proc_pread(int fd, char *buf, size_t size)
+{
+  ssize_t n;
+
+  if (fd < 0) {
+    return -1;
+  }
+  n = pread(fd, buf, size - 1, 0);
+  if (n >= 0) {
+    buf[n] = '\0';
+  }
+  return n;
+}
+
+/**
+   @brief Format a byte rate compactly, e.g. "12.3M".
+ */
+void lsh_format_rate(char *buf, size_t size, double rate)
+{
+  const char *units = "BKMGT";
+
+  while (rate >= 1000 && units[1]) {
+    rate /= 1024;
+    units++;
+  }
+  snprintf(buf, size, rate < 10 && *units != 'B' ? "%.1f%c" : "%.0f%c", rate,
+           *units);
+}
+
+/**
+   @brief Start following a process of a job.
+   @param row The job's row.
+   @param pid The process.
+ */
+void lsh_jtop_proc_add(struct lsh_jtop_row *row, pid_t pid)
+{
+  struct lsh_jtop_proc *newprocs, *proc;
+  char path[64];
+
+  if (row->nprocs >= row->capprocs) {
+    row->capprocs = row->capprocs ? row->capprocs * 2 : 4;
+    newprocs = realloc(row->procs,
+                       row->capprocs * sizeof(struct lsh_jtop_proc));
+    if (!newprocs) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    row->procs = newprocs;
+  }
+  proc = &row->procs[row->nprocs++];
+  proc->pid = pid;
+  proc->seen = 1;
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  proc->statfd = lsh_fd_register(open(path, O_RDONLY));
+  // io is only readable for our own processes, and may be absent.
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  proc->iofd = lsh_fd_register(open(path, O_RDONLY));
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid,
+           (int)pid);
+  proc->childfd = lsh_fd_register(open(path, O_RDONLY));
+}
+
+/**
+   @brief Stop following a process of a job.
+ */
+void lsh_jtop_proc_close(struct lsh_jtop_proc *proc)
+{
+  if (proc->statfd >= 0) {
+    lsh_fd_close(proc->statfd);
+  }
+  if (proc->iofd >= 0) {
+    lsh_fd_close(proc->iofd);
+  }
+  if (proc->childfd >= 0) {
+    lsh_fd_close(proc->childfd);
+  }
+}
+
+/**
+   @brief Bring a job's process list up to date with its live descendants.
+   @param row The job's row.  Processes that are gone are dropped.
+ */
+void lsh_jtop_scan(struct lsh_jtop_row *row)
+{
+  char buf[1024], *p, *end;
+  long pid;
+  int i, j;
+
+  for (i = 1; i < row->nprocs; i++) {
+    row->procs[i].seen = 0;
+  }
+  // Children are always added after their parent, so one pass finds the
+  // whole tree.
+  for (i = 0; i < row->nprocs; i++) {
+    if (!row->procs[i].seen
+        || lsh_proc_pread(row->procs[i].childfd, buf, sizeof(buf)) <= 0) {
+      continue;
+    }
+    for (p = buf; (pid = strtol(p, &end, 10)) > 0; p = end) {
+      for (j = 1; j < row->nprocs && row->procs[j].pid != pid; j++);
+      if (j < row->nprocs) {
+        row->procs[j].seen = 1;
+      } else {
+        lsh_jtop_proc_add(row, pid);
+      }
+    }
+  }
+  for (i = j = 1; i < row->nprocs; i++) {
+    if (row->procs[i].seen) {
+      row->procs[j++] = row->procs[i];
+    } else {
+      lsh_jtop_proc_close(&row->procs[i]);
+    }
+  }
+  row->nprocs = j;
+}
+
+/**
+   @brief Sample one job and format its table line.
+   @param row The job's row; counters are updated for the next sample.
+   @param elapsed Seconds since the last sample, or 0 for the first.
+   @param line Receives the new line.
+ */
+void lsh_jtop_sample(struct lsh_jtop_row *row, double elapsed, char *line)
+{
+  char buf[1024], rd[16] = "-", wr[16] = "-", state = '?', c;
+  unsigned long long utime, stime, cutime, cstime, ticks = 0, rchar = 0;
+  unsigned long long wchar = 0;
+  long rss = 0, pages;
+  double cpu = 0;
+  char *p, *q;
+  int i, io = 0;
+
+  lsh_jtop_scan(row);
+  for (i = 0; i < row->nprocs; i++) {
+    if (lsh_proc_pread(row->procs[i].statfd, buf, sizeof(buf)) <= 0
+        || (p = strrchr(buf, ')')) == NULL
+        || sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
+                  " %llu %llu %*d %*d %*d %*d %*u %*u %ld", &c, &utime, &stime,
+                  &cutime, &cstime, &pages) != 6) {
+      if (i == 0) {
+        snprintf(line, LSH_JTOP_LINE, "%5d %7d  %-5s %6s %8s %8s %8s  %s",
+                 row->job->id, (int)row->job->pid, "gone", "-", "-", "-", "-",
+                 row->job->cmd);
+        return;
+      }
+      // Gone; its pid may be reused, so it is dropped at the next scan.
+      row->procs[i].pid = 0;
+      continue;
+    }
+    if (i == 0) {
+      state = c;
+    }
+    ticks += utime + stime + cutime + cstime;
+    rss += pages;
+
+    if (lsh_proc_pread(row->procs[i].iofd, buf, sizeof(buf)) > 0) {
+      io = 1;
+      if ((q = strstr(buf, "rchar:")) != NULL) {
+        rchar += strtoull(q + 6, NULL, 10);
+      }
+      if ((q = strstr(buf, "wchar:")) != NULL) {
+        wchar += strtoull(q + 6, NULL, 10);
+      }
+    }
+  }
+
+  // A child that exited but is not yet reaped can briefly drop out of the
+  // totals, so they may go backwards.
+  if (elapsed > 0 && ticks > row->ticks) {
+    cpu = 100.0 * (ticks - row->ticks) / sysconf(_SC_CLK_TCK) / elapsed;
+  }
+  row->ticks = ticks;
+  if (io) {
+    if (elapsed > 0) {
+      lsh_format_rate(rd, sizeof(rd), rchar > row->rchar
+                      ? (rchar - row->rchar) / elapsed : 0);
+      lsh_format_rate(wr, sizeof(wr), wchar > row->wchar
+                      ? (wchar - row->wchar) / elapsed : 0);
+    }
+    row->rchar = rchar;
+    row->wchar = wchar;
+  }
+
+  snprintf(line, LSH_JTOP_LINE, "%5d %7d  %-5c %5.1f%% %7ldK %8s %8s  %s",
+           row->job->id, (int)row->job->pid, state, cpu,
+           rss * (sysconf(_SC_PAGESIZE) / 1024), rd, wr, row->job->cmd);
+}
+
+/**
+   @brief Builtin command: live table of background jobs.
+   @param args List of args.  "jtop [-d secs] [-n count]"
+   @return Always returns 1, to continue executing.
+ */
+int lsh_jtop(char **args)
+{
+  struct lsh_jtop_row *rows;
+  struct sigaction oldint;
+  struct timespec next, prev, now;
+  struct winsize ws;
+  struct lsh_out out;
+  struct lsh_job *job;
+  char line[LSH_JTOP_LINE];
+  double delay = 1, elapsed = 0;
+  long count = -1, frame;
+  int i, j, n = 0, tty, width = LSH_JTOP_LINE - 1, drawn = 0;
+  char *end;
+
+  for (i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+      delay = strtod(args[++i], &end);
+      if (*end != '\0' || delay <= 0) {
+        fprintf(stderr, "lsh: jtop: %s: invalid delay\n", args[i]);
+        return 1;
+      }
+    } else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+      count = strtol(args[++i], &end, 10);
+      if (*end != '\0' || count <= 0) {
+        fprintf(stderr, "lsh: jtop: %s: invalid count\n", args[i]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "usage: jtop [-d secs] [-n count]\n");
+      return 1;
+    }
+  }
+
+  for (job = lsh_jobs; job; job = job->next) {
+    n++;
+  }
+  if (n == 0) {
+    fprintf(stderr, "lsh: jtop: no jobs\n");
+    return 1;
+  }
+  rows = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_jtop_row));
+  for (i = 0, job = lsh_jobs; job; job = job->next, i++) {
+    memset(&rows[i], 0, sizeof(rows[i]));
+    rows[i].job = job;
+    lsh_jtop_proc_add(&rows[i], job->pid);
+  }
+
+  tty = isatty(STDOUT_FILENO);
+  if (tty && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0
+      && ws.ws_col < width) {
+    width = ws.ws_col;
+  }
+  lsh_out_init(&out, STDOUT_FILENO);
+  lsh_interrupt_begin(&oldint);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  prev = next;
+
+  for (frame = 0; !lsh_interrupted && frame != count; frame++) {
+    if (frame == 0 || !tty) {
+      if (tty) {
+        lsh_out_printf(&out, "\033[H\033[2J");
+      }
+      snprintf(line, sizeof(line), "%5s %7s  %-5s %6s %8s %8s %8s  %s", "JOB",
+               "PID", "STATE", "CPU", "RSS", "READ/s", "WRITE/s", "COMMAND");
+      lsh_out_printf(&out, "%.*s\n", width, line);
+    }
+    for (i = 0; i < n; i++) {
+      lsh_jtop_sample(&rows[i], elapsed, line);
+      if (!tty) {
+        lsh_out_printf(&out, "%.*s\n", width, line);
+      } else if (!drawn || strcmp(line, rows[i].line) != 0) {
+        // Row 1 is the header.
+        lsh_out_printf(&out, "\033[%d;1H%.*s\033[K", i + 2, width, line);
+      }
+      strcpy(rows[i].line, line);
+    }
+    if (tty) {
+      lsh_out_printf(&out, "\033[%d;1H", n + 2);
+    } else {
+      lsh_out_write(&out, "\n", 1);
+    }
+    drawn = 1;
+    if (lsh_out_flush(&out) != 0 || frame + 1 == count) {
+      break;
+    }
+
+    next.tv_sec += (time_t)delay;
+    next.tv_nsec += (long)((delay - (time_t)delay) * 1e9);
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    while (!lsh_interrupted
+           && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+              == EINTR);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+    prev = now;
+  }
+  lsh_interrupt_end(&oldint);
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < rows[i].nprocs; j++) {
+      lsh_jtop_proc_close(&rows[i].procs[j]);
+    }
+    free(rows[i].procs);
+  }
+  return 1;
+}
+
+/*
+  Phase counters.  When enabled (with the profile builtin, or LSH_PROFILE in
+  the environment), the shell opens a perf_event group on itself and charges
+  the counts to whichever phase of the read/execute loop is running: reading
+  input, tokenizing, expanding, dispatching, or spawning and waiting for
+  children.  Children are not counted.  Where perf events are restricted the
+  shell retries without kernel-mode counting, then with whichever counters
+  it may open, and finally keeps just wall-clock time per phase.
+*/
+enum lsh_phase {
+  LSH_PHASE_READ,
+  LSH_PHASE_TOKENIZE,
+  LSH_PHASE_EXPAND,
+  LSH_PHASE_DISPATCH,
+  LSH_PHASE_SPAWN,
+  LSH_NPHASES
+};
+
+const char *lsh_phase_names[] = {
+  "read", "tokenize", "expand", "dispatch", "spawn"
+};
+
+#define LSH_PERF_NCOUNTERS 4
+
+struct lsh_perf_counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+struct lsh_perf_counter lsh_perf_counters[LSH_PERF_NCOUNTERS] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+struct lsh_perf {
+  int enabled;
+  int leader;                          // group leader fd, or -1
+  int fds[LSH_PERF_NCOUNTERS];         // -1 where unavailable
+  int slot[LSH_PERF_NCOUNTERS];        // position in a group read
+  int nopen;
+  const char *mode;
+  enum lsh_phase current;
+  uint64_t last[LSH_PERF_NCOUNTERS];
+  struct timespec last_wall;
+  uint64_t counts[LSH_NPHASES][LSH_PERF_NCOUNTERS];
+  double wall[LSH_NPHASES];
+  long calls[LSH_NPHASES];
+};
+
+struct lsh_perf lsh_perf = { .leader = -1 };
+
+/**
+   @brief Open one counter on the shell, joining the group if there is one.
+ */
+int lsh_perf_open(const struct lsh_perf_counter *c, int group, int user_only)
+{
+#ifdef SYS_perf_event_open
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = c->type;
+  attr.config = c->config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                   | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                 PERF_FLAG_FD_CLOEXEC);
+#else
+  (void)c; (void)group; (void)user_only;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+   @brief Read the group into perf->last, scaled for multiplexing.
+ */
+void lsh_perf_read(struct lsh_perf *perf)
+{
+  uint64_t buf[3 + LSH_PERF_NCOUNTERS];
+  int i;
+
+  if (perf->leader < 0
+      || read(perf->leader, buf, sizeof(buf)) < 3 * (ssize_t)sizeof(uint64_t)) {
+    return;
+  }
+  for (i = 0; i < LSH_PERF_NCOUNTERS; i++) {
+    if (perf->fds[i] >= 0 && (uint64_t)perf->slot[i] < buf[0]) {
+      perf->last[i] = buf[2] > 0 && buf[2] < buf[1]
+          ? (uint64_t)((double)buf[3 + perf->slot[i]] * buf[1] / buf[2])
+          : buf[3 + perf->slot[i]];
+    }
+  }
+}
+
+/**
+   @brief Switch to a new phase, charging the counts since the last switch to
+   the phase that was running.
+   @return The phase that was running, to switch back to afterwards.
+ */
+enum lsh_phase lsh_phase_enter(enum lsh_phase phase)
+{
+  struct lsh_perf *perf = &lsh_perf;
+  enum lsh_phase prev = perf->current;
+  uint64_t before[LSH_PERF_NCOUNTERS];
+  struct timespec now;
+  int i;
+
+  if (!perf->enabled) {
+    perf->current = phase;
+    return prev;
+  }
+  memcpy(before, perf->last, sizeof(before));
+  lsh_perf_read(perf);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < LSH_PERF_NCOUNTERS; i++) {
+    perf->counts[prev][i] += perf->last[i] - before[i];
+  }
+  perf->wall[prev] += (now.tv_sec - perf->last_wall.tv_sec)
+                    + (now.tv_nsec - perf->last_wall.tv_nsec) / 1e9;
+  perf->last_wall = now;
+  if (phase != prev) {
+    perf->calls[phase]++;
+  }
+  perf->current = phase;
+  return prev;
+}
+
+/**
+   @brief Start counting.  Tries kernel and user mode, then user mode only,
+   then timing alone.
+ */
+void lsh_perf_start(void)
+{
+  struct lsh_perf *perf = &lsh_perf;
+  int i, user_only, fd;
+
+  if (perf->enabled) {
+    return;
+  }
+  for (user_only = 0; user_only <= 1 && perf->leader < 0; user_only++) {
+    perf->nopen = 0;
+    for (i = 0; i < LSH_PERF_NCOUNTERS; i++) {
+      fd = lsh_perf_open(&lsh_perf_counters[i], perf->leader, user_only);
+      perf->fds[i] = fd;
+      if (fd >= 0) {
+        lsh_fd_register(fd);
+        if (perf->leader < 0) {
+          perf->leader = fd;
+        }
+        perf->slot[i] = perf->nopen++;
+      }
+    }
+    perf->mode = user_only ? "user mode only" : "user and kernel mode";
+  }
+  if (perf->leader < 0) {
+    perf->mode = "timing only, perf events unavailable";
+  }
+  memset(perf->last, 0, sizeof(perf->last));
+  lsh_perf_read(perf);
+  clock_gettime(CLOCK_MONOTONIC, &perf->last_wall);
+  perf->enabled = 1;
+}
+
+/**
+   @brief Stop counting, keeping the totals so far.
+ */
+void lsh_perf_stop(void)
+{
+  struct lsh_perf *perf = &lsh_perf;
+  int i;
+
+  if (!perf->enabled) {
+    return;
+  }
+  lsh_phase_enter(perf->current);
+  for (i = LSH_PERF_NCOUNTERS - 1; i >= 0; i--) {
+    if (perf->fds[i] >= 0) {
+      lsh_fd_close(perf->fds[i]);
+    }
+    perf->fds[i] = -1;
+  }
+  perf->leader = -1;
+  perf->enabled = 0;
+}
+
+/**
+   @brief Print counts per phase to a stream.
+ */
+void lsh_perf_print(FILE *f)
+{
+  struct lsh_perf *perf = &lsh_perf;
+  int p, i;
+
+  lsh_phase_enter(perf->current);
+  fprintf(f, "lsh: phase counters (%s)\n", perf->enabled ? perf->mode : "off");
+  fprintf(f, "%-9s %8s %10s", "phase", "calls", "wall");
+  for (i = 0; i < LSH_PERF_NCOUNTERS; i++) {
+    fprintf(f, " %13s", lsh_perf_counters[i].name);
+  }
+  fprintf(f, " %6s\n", "IPC");
+  for (p = 0; p < LSH_NPHASES; p++) {
+    fprintf(f, "%-9s %8ld %9.4fs", lsh_phase_names[p], perf->calls[p],
+            perf->wall[p]);
+    for (i = 0; i < LSH_PERF_NCOUNTERS; i++) {
+      if ((perf->enabled && perf->fds[i] >= 0) || perf->counts[p][i] > 0) {
+        fprintf(f, " %13llu", (unsigned long long)perf->counts[p][i]);
+      } else {
+        fprintf(f, " %13s", "-");
+      }
+    }
+    if (perf->counts[p][0] > 0 && perf->counts[p][1] > 0) {
+      fprintf(f, " %6.2f\n", (double)perf->counts[p][1] / perf->counts[p][0]);
+    } else {
+      fprintf(f, " %6s\n", "-");
+    }
+  }
+}
+
+/**
+   @brief Print the counters at exit when started from LSH_PROFILE.
+ */
+void lsh_perf_report(void)
+{
+  fflush(stdout);
+  lsh_perf_print(stderr);
+}
+
+/**
+   @brief Builtin command: count cycles and friends per shell phase.
+   @param args List of args.  "profile [on|off|reset|show]"
+   @return Always returns 1, to continue executing.
+ */
+int lsh_profile(char **args)
+{
+  struct lsh_perf *perf = &lsh_perf;
+
+  if (args[1] == NULL || strcmp(args[1], "show") == 0) {
+    fflush(stdout);
+    lsh_perf_print(stdout);
+  } else if (strcmp(args[1], "on") == 0) {
+    lsh_perf_start();
+  } else if (strcmp(args[1], "off") == 0) {
+    lsh_perf_stop();
+  } else if (strcmp(args[1], "reset") == 0) {
+    lsh_phase_enter(perf->current);
+    memset(perf->counts, 0, sizeof(perf->counts));
+    memset(perf->wall, 0, sizeof(perf->wall));
+    memset(perf->calls, 0, sizeof(perf->calls));
+  } else {
+    fprintf(stderr, "usage: profile [on|off|reset|show]\n");
+  }
+  return 1;
+}
+
+/**
+   @brief Find a builtin by name.
+   @param name Command name.
+   @return Index into builtin_str/builtin_func, or -1 if not a builtin.
+ */
+int lsh_builtin_lookup(const char *name)
+{
+  int i;
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    if (strcmp(name, builtin_str[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+  Builtins that change the shell itself.  Run in a child, as modifiers
+  require, they would silently have no effect.
+*/
+const char *lsh_shell_builtins[] = {
+  "cd", "exit", "export", "ulimit", "profile"
+};
+
+/**
+   @brief Check whether a builtin changes the shell's own state.
+   @param builtin Index from lsh_builtin_lookup().
+ */
+int lsh_builtin_in_shell(int builtin)
+{
+  size_t i;
+
+  if (builtin < 0) {
+    return 0;
+  }
+  for (i = 0; i < sizeof(lsh_shell_builtins) / sizeof(char *); i++) {
+    if (strcmp(builtin_str[builtin], lsh_shell_builtins[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Per-command modifiers.  Leading words of the form "@name=value" adjust the
+  process that runs the command; they are applied in the child between fork
+  and exec, so no wrapper programs (taskset, nice, ionice) are needed:
+
+    @cpu=0-3,6     CPU affinity
+    @nice=10       niceness increment
+    @ioprio=CLASS  I/O priority: idle, be[:0-7] or rt[:0-7]
+    @as=1G ...     resource limits, named as in lsh_rlimits[]; sizes are
+                   in bytes and take K/M/G/T suffixes
+    @pipestat      report per-stage throughput of a pipeline
+
+  Builtins given modifiers run in a child, so those in lsh_shell_builtins[]
+  refuse them.
+*/
+#define LSH_IOPRIO_CLASS_SHIFT 13
+#define LSH_IOPRIO_WHO_PROCESS 1
+
+struct lsh_spawn_attr {
+  int set;         // nonzero if any modifier affecting the process was given
+  int pipestat;
+  int pgroup;      // start a new process group (background jobs)
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_nice;
+  int nice;
+  int has_ioprio;
+  int ioprio;
+  int nrlimits;
+  struct {
+    int resource;
+    rlim_t value;
+  } rlimits[sizeof(lsh_rlimits) / sizeof(struct lsh_rlimit_info)];
+};
+
+/**
+   @brief Parse a CPU list such as "0-3,6".
+   @return 0 on success, -1 on a syntax error.
+ */
+int lsh_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+  const char *p = list;
+  char *end;
+  long lo, hi;
+
+  CPU_ZERO(cpus);
+  while (*p) {
+    lo = strtol(p, &end, 10);
+    if (end == p || lo < 0) {
+      return -1;
+    }
+    hi = lo;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+      if (end == p || hi < lo) {
+        return -1;
+      }
+    }
+    if (hi >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (; lo <= hi; lo++) {
+      CPU_SET(lo, cpus);
+    }
+    p = end;
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Parse one "@name=value" modifier.
+   @param word The word, including the '@'.
+   @param attr Attributes to update.
+   @return 0 on success, -1 after printing an error.
+ */
+int lsh_parse_modifier(const char *word, struct lsh_spawn_attr *attr)
+{
+  const char *value = strchr(word, '=');
+  char *end;
+  long n = 0;
+  int cls, i;
+  rlim_t lim;
+
+  if (strcmp(word, "@pipestat") == 0) {
+    attr->pipestat = 1;
+    return 0;
+  }
+  if (!value) {
+    fprintf(stderr, "lsh: %s: expected @name=value\n", word);
+    return -1;
+  }
+  value++;
+  if (strncmp(word, "@cpu=", 5) == 0) {
+    if (lsh_parse_cpus(value, &attr->cpus) != 0) {
+      fprintf(stderr, "lsh: %s: invalid CPU list\n", word);
+      return -1;
+    }
+    attr->has_cpus = 1;
+  } else if (strncmp(word, "@nice=", 6) == 0) {
+    attr->nice = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+      fprintf(stderr, "lsh: %s: invalid niceness\n", word);
+      return -1;
+    }
+    attr->has_nice = 1;
+  } else if (strncmp(word, "@ioprio=", 8) == 0) {
+    if (strcmp(value, "idle") == 0) {
+      cls = 3;
+    } else if (strncmp(value, "be", 2) == 0 || strncmp(value, "rt", 2) == 0) {
+      cls = value[0] == 'r' ? 1 : 2;
+      n = 4;
+      if (value[2] == ':') {
+        n = strtol(value + 3, &end, 10);
+        if (value[3] == '\0' || *end != '\0' || n < 0 || n > 7) {
+          fprintf(stderr, "lsh: %s: level must be 0-7\n", word);
+          return -1;
+        }
+      } else if (value[2] != '\0') {
+        cls = -1;
+      }
+    } else {
+      cls = -1;
+    }
+    if (cls < 0) {
+      fprintf(stderr, "lsh: %s: expected idle, be[:N] or rt[:N]\n", word);
+      return -1;
+    }
+    attr->ioprio = (cls << LSH_IOPRIO_CLASS_SHIFT) | n;
+    attr->has_ioprio = 1;
+  } else {
+    for (i = 0; i < lsh_num_rlimits(); i++) {
+      if (strlen(lsh_rlimits[i].name) == (size_t)(value - word - 2)
+          && strncmp(word + 1, lsh_rlimits[i].name, value - word - 2) == 0) {
+        break;
+      }
+    }
+    if (i == lsh_num_rlimits()) {
+      fprintf(stderr, "lsh: %s: unknown modifier\n", word);
+      return -1;
+    }
+    if (lsh_parse_rlim(value, 1, lsh_rlimits[i].unit > 1, &lim) != 0) {
+      fprintf(stderr, "lsh: %s: invalid limit\n", word);
+      return -1;
+    }
+    // A repeated modifier replaces the earlier one.
+    for (n = 0; n < attr->nrlimits; n++) {
+      if (attr->rlimits[n].resource == lsh_rlimits[i].resource) {
+        break;
+      }
+    }
+    attr->rlimits[n].resource = lsh_rlimits[i].resource;
+    attr->rlimits[n].value = lim;
+    if (n == attr->nrlimits) {
+      attr->nrlimits++;
+    }
+  }
+  attr->set = 1;
+  return 0;
+}
+
+/**
+   @brief Strip leading modifiers from a command.
+   @param args Null terminated list of arguments, modified in place.
+   @param attr Filled in from the modifiers.
+   @return 0 on success, -1 if the command should not be run.
+ */
+int lsh_parse_modifiers(char **args, struct lsh_spawn_attr *attr)
+{
+  int i, j;
+
+  memset(attr, 0, sizeof(*attr));
+  for (i = 0; args[i] != NULL && args[i][0] == '@'; i++) {
+    if (lsh_parse_modifier(args[i], attr) != 0) {
+      return -1;
+    }
+  }
+  for (j = 0; args[i] != NULL; i++, j++) {
+    args[j] = args[i];
+  }
+  args[j] = NULL;
+  return 0;
+}
+
+/**
+   @brief Apply modifiers to the current process.  Called in the child.
+   @return 0 on success, -1 after printing an error.
+ */
+int lsh_apply_attr(const struct lsh_spawn_attr *attr)
+{
+  struct rlimit rl;
+  int i, prio;
+
+  for (i = 0; i < attr->nrlimits; i++) {
+    if (getrlimit(attr->rlimits[i].resource, &rl) != 0) {
+      perror("lsh: getrlimit");
+      return -1;
+    }
+    // Lower the hard limit as well so the command cannot raise it again.
+    // For CPU time leave one second of headroom, so SIGXCPU arrives before
+    // the kernel resorts to SIGKILL.
+    rl.rlim_cur = attr->rlimits[i].value;
+    if (attr->rlimits[i].resource == RLIMIT_CPU
+        && rl.rlim_cur != RLIM_INFINITY) {
+      if (rl.rlim_cur < rl.rlim_max - 1) {
+        rl.rlim_max = rl.rlim_cur + 1;
+      }
+    } else if (rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_max = rl.rlim_cur;
+    }
+    if (setrlimit(attr->rlimits[i].resource, &rl) != 0) {
+      perror("lsh: setrlimit");
+      return -1;
+    }
+  }
+
+  if (attr->has_cpus
+      && sched_setaffinity(0, sizeof(cpu_set_t), &attr->cpus) != 0) {
+    perror("lsh: @cpu");
+    return -1;
+  }
+  if (attr->has_nice) {
+    errno = 0;
+    prio = getpriority(PRIO_PROCESS, 0);
+    if ((prio == -1 && errno != 0)
+        || setpriority(PRIO_PROCESS, 0, prio + attr->nice) != 0) {
+      perror("lsh: @nice");
+      return -1;
+    }
+  }
+#ifdef SYS_ioprio_set
+  if (attr->has_ioprio && syscall(SYS_ioprio_set, LSH_IOPRIO_WHO_PROCESS, 0,
+                                  attr->ioprio) != 0) {
+    perror("lsh: @ioprio");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/**
+   @brief Start a usage record for a command about to be spawned.
+   @param u The record.
+   @param attr The command's modifiers, or NULL.
+ */
+void lsh_usage_init(struct lsh_usage *u, const struct lsh_spawn_attr *attr)
+{
+  struct rlimit rl;
+  int i;
+
+  memset(u, 0, sizeof(*u));
+  u->cpu_limit = RLIM_INFINITY;
+  // Limits set with ulimit are inherited; modifiers override them.
+  if (getrlimit(RLIMIT_CPU, &rl) == 0) {
+    u->cpu_limit = rl.rlim_cur;
+  }
+  u->mem_limited = (getrlimit(RLIMIT_AS, &rl) == 0
+                    && rl.rlim_cur != RLIM_INFINITY);
+  for (i = 0; attr && i < attr->nrlimits; i++) {
+    switch (attr->rlimits[i].resource) {
+    case RLIMIT_CPU:
+      u->cpu_limit = attr->rlimits[i].value;
+      break;
+    case RLIMIT_AS: case RLIMIT_DATA: case RLIMIT_STACK:
+      u->mem_limited = attr->rlimits[i].value != RLIM_INFINITY;
+      break;
+    }
+  }
+}
+
+/**
+   @brief Start a program (or builtin) in a child process without waiting.
+   @param args Null terminated list of arguments (including program).
+   @param in_fd File descriptor to use as stdin, or -1 to inherit.
+   @param out_fd File descriptor to use as stdout, or -1 to inherit.
+   @param attr Modifiers to apply in the child, or NULL.
+   @return The child's pid, or -1 if it could not be forked.
+ */
+pid_t lsh_spawn(char **args, int in_fd, int out_fd,
+                const struct lsh_spawn_attr *attr)
+{
+  enum lsh_phase phase;
+  uint64_t t0;
+  pid_t pid;
+  int builtin;
+
+  phase = lsh_phase_enter(LSH_PHASE_SPAWN);
+  t0 = LSH_PROBE_ENABLED(fork) ? lsh_probe_now() : 0;
+  pid = fork();
+  if (pid == 0) {
+    // Child process
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+      dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+      dup2(out_fd, STDOUT_FILENO);
+    }
+    lsh_fd_sanitize();
+    if (attr && attr->pgroup) {
+      setpgid(0, 0);
+    }
+    if (attr && lsh_apply_attr(attr) != 0) {
+      _exit(EXIT_FAILURE);
+    }
+    builtin = lsh_builtin_lookup(args[0]);
+    if (builtin >= 0) {
+      lsh_fd_drop_private();
+      (*builtin_func[builtin])(args);
+      fflush(stdout);
+      _exit(EXIT_SUCCESS);
+    }
+    LSH_PROBE1(exec, args[0]);
+    if (execvp(args[0], args) == -1) {
+      perror("lsh");
+    }
+    _exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+    // Error forking
+    perror("lsh");
+  } else if (attr && attr->pgroup) {
+    // Also done here, so the group exists whichever of us runs first.
+    setpgid(pid, pid);
+  }
+  if (LSH_PROBE_ENABLED(fork)) {
+    LSH_PROBE3(fork, args[0], pid, lsh_probe_now() - t0);
+  }
+  lsh_phase_enter(phase);
+  return pid;
+}
+
+/*
+  Pipelines.  "a | b | c" runs every stage in its own child, builtins
+  included, connected by pipes.  With the @pipestat modifier the shell puts
+  itself in the middle of each pipe: every edge becomes two pipes joined by
+  splice(), so no data is copied through user space.  A single poll() loop
+  moves the data and records, for each edge, how long it was starved (waiting
+  for its upstream stage to write) or backpressured (waiting for its
+  downstream stage to read).
+*/
+#define LSH_PIPESTAT_CHUNK (1 << 16)
+
+struct lsh_edge {
+  int in;                 // read end, filled by the upstream stage
+  int out;                // write end, drained by the downstream stage
+  int done;
+  int want_out;           // waiting for room in out rather than data in in
+  unsigned long long bytes;
+  double starved;
+  double blocked;
+  double active;          // seconds until the edge finished
+};
+
+/**
+   @brief Create a registered close-on-exec pipe.
+   @return 0 on success, -1 after printing an error.
+ */
+int lsh_pipe(int fds[2])
+{
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    perror("lsh: pipe");
+    return -1;
+  }
+  lsh_fd_register(fds[0]);
+  lsh_fd_register(fds[1]);
+  return 0;
+}
+
+double lsh_elapsed(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+   @brief Move data across every edge until all of them reach end of file.
+   @param e Edges.
+   @param n Number of edges.
+ */
+void lsh_pipestat_relay(struct lsh_edge *e, int n)
+{
+  struct pollfd *pfd;
+  struct timespec start, t0, t1;
+  struct sigaction sa, oldpipe;
+  int *polled, i, np, active = n, avail;
+  ssize_t r;
+  double dt;
+
+  pfd = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct pollfd));
+  polled = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(int));
+  // A stage that exits early must not take the shell down with SIGPIPE.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, &oldpipe);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (active > 0) {
+    np = 0;
+    for (i = 0; i < n; i++) {
+      if (e[i].done) {
+        continue;
+      }
+      while ((r = splice(e[i].in, NULL, e[i].out, NULL, LSH_PIPESTAT_CHUNK,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+        e[i].bytes += r;
+      }
+      if (r < 0 && errno == EAGAIN) {
+        // Either in is empty or out is full; the pipe's fill level says which.
+        e[i].want_out = ioctl(e[i].in, FIONREAD, &avail) == 0 && avail > 0;
+        pfd[np].fd = e[i].want_out ? e[i].out : e[i].in;
+        pfd[np].events = e[i].want_out ? POLLOUT : POLLIN;
+        polled[np++] = i;
+        continue;
+      }
+      // End of file, or the downstream stage went away.
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      e[i].active = lsh_elapsed(&start, &t1);
+      e[i].done = 1;
+      lsh_fd_close(e[i].in);
+      lsh_fd_close(e[i].out);
+      active--;
+    }
+    if (np == 0) {
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (poll(pfd, np, -1) < 0 && errno != EINTR) {
+      perror("lsh: poll");
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    dt = lsh_elapsed(&t0, &t1);
+    for (i = 0; i < np; i++) {
+      if (e[polled[i]].want_out) {
+        e[polled[i]].blocked += dt;
+      } else {
+        e[polled[i]].starved += dt;
+      }
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (!e[i].done) {
+      lsh_fd_close(e[i].in);
+      lsh_fd_close(e[i].out);
+    }
+  }
+  sigaction(SIGPIPE, &oldpipe, NULL);
+}
+
+/**
+   @brief Print the @pipestat report.
+   @param stages Arguments of each stage.
+   @param e Edges between them.
+   @param n Number of stages.
+   @param wall Wall time of the whole pipeline.
+ */
+void lsh_pipestat_report(char ***stages, const struct lsh_edge *e, int n,
+                         double wall)
+{
+  char name[40], bytes[16], rate[16];
+  double score, best = -1, starved, blocked;
+  int i, edges, slowest = 0;
+
+  fprintf(stderr, "lsh: pipestat: %d stages, %.3fs\n", n, wall);
+  fprintf(stderr, "  %-28s %8s %10s %8s %14s\n", "edge", "bytes", "rate",
+          "starved", "backpressured");
+  for (i = 0; i < n - 1; i++) {
+    snprintf(name, sizeof(name), "%d %s -> %d %s", i + 1, stages[i][0], i + 2,
+             stages[i + 1][0]);
+    lsh_format_rate(bytes, sizeof(bytes), e[i].bytes);
+    lsh_format_rate(rate, sizeof(rate),
+                    e[i].active > 0 ? e[i].bytes / e[i].active : 0);
+    starved = e[i].active > 0 ? 100 * e[i].starved / e[i].active : 0;
+    blocked = e[i].active > 0 ? 100 * e[i].blocked / e[i].active : 0;
+    fprintf(stderr, "  %-28s %8s %8s/s %7.1f%% %13.1f%%\n", name, bytes, rate,
+            starved, blocked);
+  }
+
+  // A slow stage backs up the edge feeding it and starves the one it feeds.
+  for (i = 0; i < n; i++) {
+    score = 0;
+    edges = 0;
+    if (i > 0 && e[i - 1].active > 0) {
+      score += e[i - 1].blocked / e[i - 1].active;
+      edges++;
+    }
+    if (i < n - 1 && e[i].active > 0) {
+      score += e[i].starved / e[i].active;
+      edges++;
+    }
+    if (edges > 0 && score / edges > best) {
+      best = score / edges;
+      slowest = i;
+    }
+  }
+  fprintf(stderr, "  slowest stage: %d %s\n", slowest + 1, stages[slowest][0]);
+}
+
+/**
+   @brief Wait for a spawned command and record its resource usage.
+   @param pid The command's process.
+   @param args Its arguments, for messages.
+   @param attr Its modifiers, or NULL.
+ */
+void lsh_wait(pid_t pid, char **args, const struct lsh_spawn_attr *attr)
+{
+  enum lsh_phase phase;
+  const char *limit;
+  uint64_t t0;
+  int status;
+
+  phase = lsh_phase_enter(LSH_PHASE_SPAWN);
+  lsh_usage_init(&lsh_last_usage, attr);
+  t0 = LSH_PROBE_ENABLED(wait) ? lsh_probe_now() : 0;
+  do {
+    wait4(pid, &status, WUNTRACED, &lsh_last_usage.ru);
+  } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+  if (LSH_PROBE_ENABLED(wait)) {
+    LSH_PROBE3(wait, pid, status, lsh_probe_now() - t0);
+  }
+  lsh_phase_enter(phase);
+  lsh_waits++;
+  lsh_last_usage.status = status;
+  limit = lsh_usage_limit(&lsh_last_usage);
+  if (limit) {
+    fprintf(stderr,
+            "lsh: %s: killed by %s (%ld.%02lds user, %ld.%02lds sys)\n",
+            args[0], limit, (long)lsh_last_usage.ru.ru_utime.tv_sec,
+            (long)lsh_last_usage.ru.ru_utime.tv_usec / 10000,
+            (long)lsh_last_usage.ru.ru_stime.tv_sec,
+            (long)lsh_last_usage.ru.ru_stime.tv_usec / 10000);
+  }
+}
+
+/**
+   @brief Run a pipeline in the foreground.
+   @param args Null terminated list of arguments, containing "|" tokens.
+   @return Always returns 1, to continue execution.
+ */
+int lsh_pipeline(char **args)
+{
+  struct lsh_spawn_attr *attr;
+  struct lsh_edge *edges;
+  struct timespec start, end;
+  char ***stages;
+  pid_t *pids;
+  int i, n = 1, in = -1, out, next_in = -1, pipestat = 0;
+  int up[2], down[2];
+
+  for (i = 0; args[i] != NULL; i++) {
+    n += strcmp(args[i], "|") == 0;
+  }
+  stages = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(char **));
+  attr = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_spawn_attr));
+  pids = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(pid_t));
+  edges = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_edge));
+  memset(edges, 0, n * sizeof(struct lsh_edge));
+
+  stages[0] = args;
+  for (i = 0, n = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "|") == 0) {
+      args[i] = NULL;
+      stages[n++] = &args[i + 1];
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (lsh_parse_modifiers(stages[i], &attr[i]) != 0) {
+      return 1;
+    }
+    if (stages[i][0] == NULL) {
+      fprintf(stderr, "lsh: syntax error near \"|\"\n");
+      return 1;
+    }
+    pipestat |= attr[i].pipestat;
+  }
+
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < n; i++) {
+    out = -1;
+    if (i < n - 1) {
+      if (lsh_pipe(up) != 0) {
+        break;
+      }
+      next_in = up[0];
+      if (pipestat) {
+        if (lsh_pipe(down) != 0) {
+          lsh_fd_close(up[0]);
+          lsh_fd_close(up[1]);
+          break;
+        }
+        edges[i].in = up[0];
+        edges[i].out = down[1];
+        next_in = down[0];
+      }
+      out = up[1];
+    }
+    pids[i] = lsh_spawn(stages[i], in, out, &attr[i]);
+    if (in >= 0) {
+      lsh_fd_close(in);
+    }
+    if (out >= 0) {
+      lsh_fd_close(out);
+    }
+    in = next_in;
+  }
+  if (i < n) {
+    // A pipe could not be created: the stages already started get end of
+    // file or SIGPIPE once the shell's ends are closed.
+    if (in >= 0) {
+      lsh_fd_close(in);
+    }
+    n = i;
+  }
+
+  if (pipestat) {
+    lsh_pipestat_relay(edges, n - 1);
+  }
+  for (i = 0; i < n; i++) {
+    if (pids[i] > 0) {
+      lsh_wait(pids[i], stages[i], &attr[i]);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (pipestat && n > 1) {
+    lsh_pipestat_report(stages, edges, n, lsh_elapsed(&start, &end));
+  }
+  return 1;
+}
+
+/**
+  @brief Launch a program and wait for it to terminate.
+  @param args Null terminated list of arguments (including program).
+  @param attr Modifiers to apply to the program, or NULL.
+  @return Always returns 1, to continue execution.
+ */
+int lsh_launch(char **args, const struct lsh_spawn_attr *attr)
+{
+  pid_t pid;
+
+  // Anything buffered now would otherwise be written by the child too.
+  fflush(stdout);
+  pid = lsh_spawn(args, -1, -1, attr);
+  if (pid > 0) {
+    // Parent process
+    lsh_wait(pid, args, attr);
+  }
+
+  return 1;
+}
+
+/*
+  Process substitution.  A token group "<(cmd args)" is replaced with a
+  /dev/fd/N path to the read end of a pipe whose write end is cmd's stdout;
+  ">(cmd args)" is the same with the directions swapped.  The inner commands
+  are started with lsh_spawn() before the outer command runs and reaped once
+  it is done (or, if it runs in the background, whenever they exit).  No
+  temporary files or intermediate shells are involved.
+*/
+struct lsh_procsubst {
+  int fd;       // our end of the pipe, passed to the outer command
+  pid_t pid;    // inner command
+  struct lsh_procsubst *next;
+};
+
+struct lsh_procsubst *lsh_cmd_procsubst = NULL;
+
+/**
+   @brief Start the inner commands of any process substitutions in a command.
+   @param args Null terminated list of arguments, modified in place.
+   @return 0 on success, -1 if the command should not be run.
+   lsh_procsubst_finish() must be called afterwards either way.
+ */
+int lsh_procsubst_start(char **args)
+{
+  struct lsh_procsubst *ps;
+  char **inner, *path;
+  int i, j, k, n, fds[2], reading;
+  size_t len;
+
+  for (i = 0, j = 0; args[i] != NULL; j++) {
+    if ((args[i][0] != '<' && args[i][0] != '>') || args[i][1] != '(') {
+      args[j] = args[i++];
+      continue;
+    }
+    reading = (args[i][0] == '<');
+
+    // Gather the tokens up to the one ending in ')'.
+    for (n = i; args[n] != NULL; n++) {
+      len = strlen(args[n]);
+      if (len > (n == i ? 2 : 0) && args[n][len - 1] == ')') {
+        break;
+      }
+    }
+    if (args[n] == NULL) {
+      fprintf(stderr, "lsh: missing ')' in process substitution\n");
+      return -1;
+    }
+    args[n][strlen(args[n]) - 1] = '\0';
+    inner = lsh_arena_alloc(&lsh_cmd_arena, (n - i + 2) * sizeof(char *));
+    k = 0;
+    if (args[i][2] != '\0') {
+      inner[k++] = args[i] + 2;
+    }
+    for (i++; i <= n; i++) {
+      if (args[i][0] != '\0') {
+        inner[k++] = args[i];
+      }
+    }
+    inner[k] = NULL;
+    if (k == 0) {
+      fprintf(stderr, "lsh: empty process substitution\n");
+      return -1;
+    }
+
+    // Our ends are only marked inheritable once every inner command has
+    // started, so that none of them holds another's pipe open.
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      perror("lsh: pipe");
+      return -1;
+    }
+    lsh_fd_register(fds[0]);
+    lsh_fd_register(fds[1]);
+    ps = lsh_arena_alloc(&lsh_cmd_arena, sizeof(struct lsh_procsubst));
+    ps->fd = reading ? fds[0] : fds[1];
+    ps->pid = lsh_spawn(inner, reading ? -1 : fds[0], reading ? fds[1] : -1,
+                        NULL);
+    ps->next = lsh_cmd_procsubst;
+    lsh_cmd_procsubst = ps;
+    lsh_fd_close(reading ? fds[1] : fds[0]);
+    if (ps->pid < 0) {
+      return -1;
+    }
+
+    path = lsh_arena_alloc(&lsh_cmd_arena, 32);
+    snprintf(path, 32, "/dev/fd/%d", ps->fd);
+    args[j] = path;
+  }
+  args[j] = NULL;
+
+  for (ps = lsh_cmd_procsubst; ps; ps = ps->next) {
+    lsh_fd_set_inherit(ps->fd, 1);
+  }
+  return 0;
+}
+
+/**
+   @brief Close our ends of the process substitution pipes and reap them.
+   @param background Nonzero if the outer command was left running, in which
+   case the inner commands are reaped later, without waiting for them now.
+ */
+void lsh_procsubst_finish(int background)
+{
+  struct lsh_procsubst *ps;
+  int status;
+
+  for (ps = lsh_cmd_procsubst; ps; ps = ps->next) {
+    lsh_fd_close(ps->fd);
+  }
+  for (ps = lsh_cmd_procsubst; ps; ps = ps->next) {
+    if (ps->pid > 0 && background) {
+      lsh_stray_add(ps->pid);
+    } else if (ps->pid > 0) {
+      waitpid(ps->pid, &status, 0);
+    }
+  }
+  lsh_cmd_procsubst = NULL;
+}
+
+/**
+   @brief Check whether a command contains a "|" token.
+ */
+int lsh_is_pipeline(char **args)
+{
+  int i;
+
+  for (i = 0; args[i] != NULL; i++) {
+    if (strcmp(args[i], "|") == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Execute shell built-in or launch program.
+   @param args Null terminated list of arguments.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int lsh_execute(char **args)
+{
+  struct lsh_spawn_attr attr;
+  struct lsh_job *job;
+  uint64_t t0;
+  int builtin, status = 1, background = 0, n;
+  size_t len;
+  pid_t pid;
+
+  if (args[0] == NULL) {
+    // An empty command was entered.
+    return 1;
+  }
+
+  // A trailing "&" (alone or stuck to the last word) runs it in the background.
+  for (n = 0; args[n] != NULL; n++);
+  len = strlen(args[n - 1]);
+  if (args[n - 1][len - 1] == '&') {
+    background = 1;
+    args[n - 1][len - 1] = '\0';
+    if (len == 1) {
+      args[--n] = NULL;
+    }
+    if (n == 0) {
+      fprintf(stderr, "lsh: syntax error near \"&\"\n");
+      return 1;
+    }
+  }
+
+  if (lsh_procsubst_start(args) != 0) {
+    // Nothing to run.
+  } else if (lsh_is_pipeline(args)) {
+    if (background) {
+      // The pipeline is run and waited for by a copy of the shell, which is
+      // what the job table tracks.  It leads a process group that its stages
+      // join, so signalling the job reaches all of them.
+      fflush(stdout);
+      pid = fork();
+      if (pid == 0) {
+        setpgid(0, 0);
+        lsh_pipeline(args);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+      } else if (pid < 0) {
+        perror("lsh");
+      } else {
+        setpgid(pid, pid);
+        job = lsh_job_add(pid, args);
+        fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+      }
+    } else {
+      status = lsh_pipeline(args);
+    }
+  } else if (lsh_parse_modifiers(args, &attr) == 0 && args[0] != NULL) {
+    builtin = lsh_builtin_lookup(args[0]);
+    if (attr.set && lsh_builtin_in_shell(builtin)) {
+      fprintf(stderr, "lsh: %s: modifiers can't be used with a builtin that "
+              "changes the shell\n", args[0]);
+    } else if (background) {
+      fflush(stdout);
+      attr.pgroup = 1;
+      pid = lsh_spawn(args, -1, -1, &attr);
+      if (pid > 0) {
+        job = lsh_job_add(pid, args);
+        lsh_usage_init(&job->usage, &attr);
+        fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+      }
+    } else if (builtin >= 0 && !attr.set) {
+      t0 = LSH_PROBE_ENABLED(builtin) ? lsh_probe_now() : 0;
+      status = (*builtin_func[builtin])(args);
+      fflush(stdout);
+      if (LSH_PROBE_ENABLED(builtin)) {
+        LSH_PROBE2(builtin, builtin_str[builtin], lsh_probe_now() - t0);
+      }
+    } else {
+      // Builtins with modifiers run in a child so the shell is unaffected.
+      status = lsh_launch(args, &attr);
+    }
+  }
+  lsh_procsubst_finish(background);
+  return status;
+}
+
+/*
+  Script profiling ("lsh --profile script").  Every executed line is charged
+  the wall time it took and the user and system time consumed by the shell
+  itself and by the children it waited for (RUSAGE_CHILDREN grows by each
+  wait4()ed child's rusage).  Costs are aggregated per source line and per
+  command name, reported on stderr at exit sorted by wall time, and written
+  to callgrind.out.lsh.<pid> for kcachegrind and friends.
+*/
+struct lsh_prof_entry {
+  char *name;        // command name, or the text of a line
+  char *cmd;         // for lines: the command it ran
+  int line;
+  long count;
+  double wall, user, sys;
+};
+
+struct lsh_prof_mark {
+  struct timespec wall;
+  struct rusage self, children;
+};
+
+FILE *lsh_input;              // where commands are read from
+const char *lsh_script = NULL;
+int lsh_lineno = 0;
+
+int lsh_profiling = 0;
+struct lsh_prof_entry *lsh_prof_lines = NULL;   // indexed by line number
+int lsh_prof_nlines = 0;
+struct lsh_prof_entry *lsh_prof_cmds = NULL;
+int lsh_prof_ncmds = 0;
+int lsh_prof_cmdcap = 0;
+char *lsh_prof_out = NULL;      // absolute path of the callgrind file
+char *lsh_prof_script = NULL;   // absolute path of the script
+
+double lsh_tv_seconds(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void lsh_prof_begin(struct lsh_prof_mark *m)
+{
+  clock_gettime(CLOCK_MONOTONIC, &m->wall);
+  getrusage(RUSAGE_SELF, &m->self);
+  getrusage(RUSAGE_CHILDREN, &m->children);
+}
+
+/**
+   @brief Charge everything since a mark to a line and a command.
+   @param m Mark taken before the line ran.
+   @param text The line as read (before tokenizing).
+   @param cmd The command it ran.
+ */
+void lsh_prof_end(const struct lsh_prof_mark *m, const char *text,
+                  const char *cmd)
+{
+  struct lsh_prof_mark now;
+  struct lsh_prof_entry *e, *grown;
+  double wall, user, sys;
+  int i, n;
+
+  lsh_prof_begin(&now);
+  wall = (now.wall.tv_sec - m->wall.tv_sec)
+       + (now.wall.tv_nsec - m->wall.tv_nsec) / 1e9;
+  user = lsh_tv_seconds(&now.self.ru_utime) - lsh_tv_seconds(&m->self.ru_utime)
+       + lsh_tv_seconds(&now.children.ru_utime)
+       - lsh_tv_seconds(&m->children.ru_utime);
+  sys = lsh_tv_seconds(&now.self.ru_stime) - lsh_tv_seconds(&m->self.ru_stime)
+      + lsh_tv_seconds(&now.children.ru_stime)
+      - lsh_tv_seconds(&m->children.ru_stime);
+
+  if (lsh_lineno >= lsh_prof_nlines) {
+    n = lsh_lineno + 64;
+    grown = realloc(lsh_prof_lines, n * sizeof(struct lsh_prof_entry));
+    if (!grown) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    memset(grown + lsh_prof_nlines, 0,
+           (n - lsh_prof_nlines) * sizeof(struct lsh_prof_entry));
+    lsh_prof_lines = grown;
+    lsh_prof_nlines = n;
+  }
+  e = &lsh_prof_lines[lsh_lineno];
+  if (e->count == 0) {
+    e->name = strdup(text);
+    e->cmd = strdup(cmd);
+    e->line = lsh_lineno;
+  }
+  e->count++;
+  e->wall += wall;
+  e->user += user;
+  e->sys += sys;
+
+  for (i = 0; i < lsh_prof_ncmds && strcmp(lsh_prof_cmds[i].name, cmd); i++);
+  if (i == lsh_prof_ncmds) {
+    if (lsh_prof_ncmds >= lsh_prof_cmdcap) {
+      lsh_prof_cmdcap = lsh_prof_cmdcap ? lsh_prof_cmdcap * 2 : 16;
+      grown = realloc(lsh_prof_cmds,
+                      lsh_prof_cmdcap * sizeof(struct lsh_prof_entry));
+      if (!grown) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      lsh_prof_cmds = grown;
+    }
+    memset(&lsh_prof_cmds[i], 0, sizeof(struct lsh_prof_entry));
+    lsh_prof_cmds[i].name = strdup(cmd);
+    lsh_prof_ncmds++;
+  }
+  e = &lsh_prof_cmds[i];
+  e->count++;
+  e->wall += wall;
+  e->user += user;
+  e->sys += sys;
+}
+
+static int lsh_prof_compare(const void *a, const void *b)
+{
+  const struct lsh_prof_entry *x = *(struct lsh_prof_entry *const *)a;
+  const struct lsh_prof_entry *y = *(struct lsh_prof_entry *const *)b;
+
+  return (x->wall < y->wall) - (x->wall > y->wall);
+}
+
+/**
+   @brief Print entries sorted by wall time, most expensive first.
+ */
+void lsh_prof_print(struct lsh_prof_entry *entries, int n, int lines)
+{
+  struct lsh_prof_entry **sorted;
+  int i, m = 0;
+
+  sorted = malloc((n + 1) * sizeof(struct lsh_prof_entry *));
+  if (!sorted) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (entries[i].count > 0) {
+      sorted[m++] = &entries[i];
+    }
+  }
+  qsort(sorted, m, sizeof(struct lsh_prof_entry *), lsh_prof_compare);
+  fprintf(stderr, "  %10s %10s %10s %7s  %s\n", "wall", "user", "sys", "count",
+          lines ? "line" : "command");
+  for (i = 0; i < m; i++) {
+    fprintf(stderr, "  %9.4fs %9.4fs %9.4fs %7ld  ", sorted[i]->wall,
+            sorted[i]->user, sorted[i]->sys, sorted[i]->count);
+    if (lines) {
+      fprintf(stderr, "%d: %s\n", sorted[i]->line, sorted[i]->name);
+    } else {
+      fprintf(stderr, "%s\n", sorted[i]->name);
+    }
+  }
+  free(sorted);
+}
+
+/**
+   @brief Fix the profile's paths before the script runs.  Both are made
+   absolute, since the script may change directory before the profile is
+   written at exit.
+ */
+void lsh_prof_start(void)
+{
+  char cwd[PATH_MAX];
+  size_t len;
+
+  lsh_prof_script = realpath(lsh_script, NULL);
+  if (!lsh_prof_script) {
+    lsh_prof_script = strdup(lsh_script);
+  }
+  if (!getcwd(cwd, sizeof(cwd))) {
+    strcpy(cwd, ".");
+  }
+  len = strlen(cwd) + 64;
+  lsh_prof_out = malloc(len);
+  if (!lsh_prof_script || !lsh_prof_out) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(lsh_prof_out, len, "%s%scallgrind.out.lsh.%d", cwd,
+           cwd[strlen(cwd) - 1] == '/' ? "" : "/", (int)getpid());
+}
+
+/**
+   @brief Write the profile in callgrind format.  Each command is a function
+   and its lines carry their costs, in microseconds.
+ */
+void lsh_prof_callgrind(void)
+{
+  struct lsh_prof_entry *e;
+  double wall = 0, user = 0, sys = 0;
+  FILE *f;
+  int i, j;
+
+  if ((f = fopen(lsh_prof_out, "we")) == NULL) {
+    fprintf(stderr, "lsh: %s: %s\n", lsh_prof_out, strerror(errno));
+    return;
+  }
+  for (i = 0; i < lsh_prof_ncmds; i++) {
+    wall += lsh_prof_cmds[i].wall;
+    user += lsh_prof_cmds[i].user;
+    sys += lsh_prof_cmds[i].sys;
+  }
+  fprintf(f, "# callgrind format\nversion: 1\ncreator: lsh\npid: %d\n"
+          "cmd: lsh --profile %s\npositions: line\n"
+          "events: Wall_us User_us Sys_us\nsummary: %.0f %.0f %.0f\n\n",
+          (int)getpid(), lsh_script, wall * 1e6, user * 1e6, sys * 1e6);
+  fprintf(f, "fl=%s\n", lsh_prof_script);
+  for (i = 0; i < lsh_prof_ncmds; i++) {
+    fprintf(f, "fn=%s\n", lsh_prof_cmds[i].name);
+    for (j = 0; j < lsh_prof_nlines; j++) {
+      e = &lsh_prof_lines[j];
+      if (e->count > 0 && strcmp(e->cmd, lsh_prof_cmds[i].name) == 0) {
+        fprintf(f, "%d %.0f %.0f %.0f\n", e->line, e->wall * 1e6,
+                e->user * 1e6, e->sys * 1e6);
+      }
+    }
+  }
+  fclose(f);
+  fprintf(stderr, "lsh: profile written to %s\n", lsh_prof_out);
+}
+
+/**
+   @brief Report the profile.  Registered with atexit(), since a script
+   ends wherever end of file or the exit builtin is reached.
+ */
+void lsh_prof_report(void)
+{
+  fflush(stdout);
+  fprintf(stderr, "lsh: profile of %s\n", lsh_script);
+  lsh_prof_print(lsh_prof_lines, lsh_prof_nlines, 1);
+  fprintf(stderr, "\n");
+  lsh_prof_print(lsh_prof_cmds, lsh_prof_ncmds, 0);
+  lsh_prof_callgrind();
+}
+
+/**
+   @brief Name a command for the profile: the first word after any
+   modifiers.
+ */
+const char *lsh_prof_command(char **args)
+{
+  int i;
+
+  for (i = 0; args[i] != NULL && args[i][0] == '@'; i++);
+  return args[i] ? args[i] : "(none)";
+}
+
+/*
+  Audit log.  With LSH_AUDIT_LOG=/path in the environment, every command
+  run from the rc file or read by the loop is appended to that file as one
+  line: time, uid, cwd, exit status, rusage of its children, and the command
+  itself.  The shell only fills in a slot of a single-producer,
+  single-consumer ring and publishes it with an atomic store; a background
+  thread formats batches of records into one write() and calls fdatasync() at
+  most once per interval.
+  When the ring is full, records are dropped rather than delaying the shell,
+  and the number dropped is logged once there is room again.
+*/
+#define LSH_AUDIT_RING 1024             // records, a power of two
+#define LSH_AUDIT_CMD 256
+#define LSH_AUDIT_CWD 256
+#define LSH_AUDIT_FLUSH_MS 100
+#define LSH_AUDIT_SYNC_MS 1000
+
+struct lsh_audit_rec {
+  struct timespec time;
+  uid_t uid;
+  int waited;                           // whether status is meaningful
+  int status;
+  struct timeval utime, stime;
+  long maxrss;
+  char cwd[LSH_AUDIT_CWD];
+  char cmd[LSH_AUDIT_CMD];
+};
+
+struct lsh_audit {
+  int fd;
+  int wakefd;                           // eventfd, to wake the writer
+  pid_t pid;                            // the shell that owns the writer
+  uid_t uid;
+  pthread_t thread;
+  uint64_t head;                        // next slot to fill (shell)
+  uint64_t tail;                        // next slot to write (writer)
+  uint64_t dropped;
+  int stop;
+  struct lsh_audit_rec *pending;        // reserved but not yet published
+  struct rusage children;               // RUSAGE_CHILDREN at reservation
+  long waits;                           // lsh_waits at reservation
+  struct lsh_audit_rec ring[LSH_AUDIT_RING];
+};
+
+struct lsh_audit *lsh_audit = NULL;
+
+/**
+   @brief Format one record as a log line.
+   @return Length written to buf.
+ */
+size_t lsh_audit_format(const struct lsh_audit_rec *r, char *buf, size_t size)
+{
+  char when[32], status[32];
+  struct tm tm;
+  int n;
+
+  gmtime_r(&r->time.tv_sec, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  if (!r->waited) {
+    snprintf(status, sizeof(status), "-");
+  } else if (WIFSIGNALED(r->status)) {
+    snprintf(status, sizeof(status), "sig%d", WTERMSIG(r->status));
+  } else {
+    snprintf(status, sizeof(status), "%d", WEXITSTATUS(r->status));
+  }
+  n = snprintf(buf, size, "%s.%06ldZ uid=%d status=%s user=%ld.%06ld "
+               "sys=%ld.%06ld maxrss=%ldK cwd=%s cmd=%s\n", when,
+               r->time.tv_nsec / 1000, (int)r->uid, status,
+               (long)r->utime.tv_sec, (long)r->utime.tv_usec,
+               (long)r->stime.tv_sec, (long)r->stime.tv_usec, r->maxrss,
+               r->cwd, r->cmd);
+  return n < 0 ? 0 : (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/**
+   @brief Writer thread: drain the ring in batches until told to stop.
+ */
+void *lsh_audit_writer(void *arg)
+{
+  struct lsh_audit *a = arg;
+  char buf[64 * 1024];
+  struct pollfd pfd;
+  struct timespec now, synced;
+  uint64_t head, tail, dropped, reported = 0, ev;
+  size_t len;
+  int dirty = 0, stop;
+
+  pfd.fd = a->wakefd;
+  pfd.events = POLLIN;
+  clock_gettime(CLOCK_MONOTONIC, &synced);
+  do {
+    stop = __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+    tail = a->tail;
+    len = 0;
+    while (tail != head) {
+      if (sizeof(buf) - len < LSH_AUDIT_CMD + LSH_AUDIT_CWD + 128) {
+        lsh_write_all(a->fd, buf, len);
+        len = 0;
+      }
+      len += lsh_audit_format(&a->ring[tail % LSH_AUDIT_RING], buf + len,
+                              sizeof(buf) - len);
+      tail++;
+      // Hand the slot back as soon as it is formatted.
+      __atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+    }
+    dropped = __atomic_load_n(&a->dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+      len += snprintf(buf + len, sizeof(buf) - len,
+                      "# lsh: %llu records dropped\n",
+                      (unsigned long long)(dropped - reported));
+      reported = dropped;
+    }
+    if (len > 0) {
+      lsh_write_all(a->fd, buf, len);
+      dirty = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (dirty && (stop || (now.tv_sec - synced.tv_sec) * 1000
+                  + (now.tv_nsec - synced.tv_nsec) / 1000000
+                  >= LSH_AUDIT_SYNC_MS)) {
+      fdatasync(a->fd);
+      synced = now;
+      dirty = 0;
+    }
+    if (!stop && poll(&pfd, 1, LSH_AUDIT_FLUSH_MS) > 0) {
+      if (read(a->wakefd, &ev, sizeof(ev)) < 0) {
+        // Nothing to do; the stop flag is checked on the next pass.
+      }
+    }
+  } while (!stop);
+  return NULL;
+}
+
+/**
+   @brief Flush the log and stop the writer.  Registered with atexit().
+ */
+void lsh_audit_stop(void)
+{
+  struct lsh_audit *a = lsh_audit;
+  uint64_t one = 1;
+
+  // Forked children inherit the atexit() handler but not the thread.
+  if (!a || a->pid != getpid()) {
+    return;
+  }
+  __atomic_store_n(&a->stop, 1, __ATOMIC_RELEASE);
+  if (write(a->wakefd, &one, sizeof(one)) < 0) {
+    perror("lsh: audit");
+  }
+  pthread_join(a->thread, NULL);
+  lsh_fd_close(a->wakefd);
+  lsh_fd_close(a->fd);
+  lsh_audit = NULL;
+  free(a);
+}
+
+/**
+   @brief Open the audit log and start the writer thread.
+   @param path Log file, appended to.
+ */
+void lsh_audit_start(const char *path)
+{
+  struct lsh_audit *a;
+
+  a = calloc(1, sizeof(struct lsh_audit));
+  if (!a) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  a->fd = lsh_fd_register(open(path, O_WRONLY | O_APPEND | O_CREAT, 0600));
+  if (a->fd < 0) {
+    fprintf(stderr, "lsh: audit log %s: %s\n", path, strerror(errno));
+    free(a);
+    return;
+  }
+  a->wakefd = lsh_fd_register(eventfd(0, EFD_CLOEXEC));
+  a->pid = getpid();
+  a->uid = getuid();
+  if (a->wakefd < 0 || pthread_create(&a->thread, NULL, lsh_audit_writer, a)) {
+    fprintf(stderr, "lsh: audit log: cannot start writer\n");
+    if (a->wakefd >= 0) {
+      lsh_fd_close(a->wakefd);
+    }
+    lsh_fd_close(a->fd);
+    free(a);
+    return;
+  }
+  lsh_audit = a;
+  atexit(lsh_audit_stop);
+}
+
+/**
+   @brief Claim a ring slot for a command about to run.
+   @param args The command, after expansion.
+ */
+void lsh_audit_begin(char **args)
+{
+  struct lsh_audit *a = lsh_audit;
+  struct lsh_audit_rec *r;
+  size_t len = 0;
+  int i;
+
+  if (a->head - __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE)
+      >= LSH_AUDIT_RING) {
+    __atomic_fetch_add(&a->dropped, 1, __ATOMIC_RELAXED);
+    a->pending = NULL;
+    return;
+  }
+  r = a->pending = &a->ring[a->head % LSH_AUDIT_RING];
+  clock_gettime(CLOCK_REALTIME, &r->time);
+  r->uid = a->uid;
+  if (!getcwd(r->cwd, sizeof(r->cwd))) {
+    strcpy(r->cwd, "?");
+  }
+  r->cmd[0] = '\0';
+  for (i = 0; args[i] != NULL && len + 1 < sizeof(r->cmd); i++) {
+    len += snprintf(r->cmd + len, sizeof(r->cmd) - len, i ? " %s" : "%s",
+                    args[i]);
+  }
+  getrusage(RUSAGE_CHILDREN, &a->children);
+  a->waits = lsh_waits;
+}
+
+/**
+   @brief Complete and publish the slot claimed by lsh_audit_begin().
+ */
+void lsh_audit_end(void)
+{
+  struct lsh_audit *a = lsh_audit;
+  struct lsh_audit_rec *r = a->pending;
+  struct rusage now;
+  uint64_t one = 1;
+
+  if (!r) {
+    return;
+  }
+  getrusage(RUSAGE_CHILDREN, &now);
+  timersub(&now.ru_utime, &a->children.ru_utime, &r->utime);
+  timersub(&now.ru_stime, &a->children.ru_stime, &r->stime);
+  r->waited = lsh_waits != a->waits;
+  r->status = lsh_last_usage.status;
+  r->maxrss = r->waited ? lsh_last_usage.ru.ru_maxrss : 0;
+  a->pending = NULL;
+  __atomic_store_n(&a->head, a->head + 1, __ATOMIC_RELEASE);
+  if (a->head - __atomic_load_n(&a->tail, __ATOMIC_RELAXED)
+      == LSH_AUDIT_RING / 2 && write(a->wakefd, &one, sizeof(one)) < 0) {
+    perror("lsh: audit");
+  }
+}
+
+/*
+  Session record and replay.  "--record FILE" appends every line the shell
+  reads to FILE, prefixed with the microseconds spent waiting for it.
+  "--replay FILE" feeds such a recording back in, either honoring the waits
+  (--replay-speed=orig, the default) or as fast as possible
+  (--replay-speed=max), and reports throughput and the distribution of
+  per-command latency (from a line being read to the next read) at exit.
+*/
+FILE *lsh_record = NULL;
+int lsh_replay = 0;
+int lsh_replay_max = 0;
+struct timespec lsh_session_mark;       // start of the current read
+struct timespec lsh_replay_start;
+struct timespec lsh_replay_fed;         // when the last line was returned
+double *lsh_replay_lat = NULL;
+size_t lsh_replay_n = 0;
+size_t lsh_replay_cap = 0;
+
+/**
+   @brief Called before each read: ends the latency of the last command.
+ */
+void lsh_session_before_read(void)
+{
+  double *grown;
+
+  clock_gettime(CLOCK_MONOTONIC, &lsh_session_mark);
+  if (!lsh_replay || lsh_replay_fed.tv_sec == 0) {
+    return;
+  }
+  if (lsh_replay_n >= lsh_replay_cap) {
+    lsh_replay_cap = lsh_replay_cap ? lsh_replay_cap * 2 : 1024;
+    grown = realloc(lsh_replay_lat, lsh_replay_cap * sizeof(double));
+    if (!grown) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    lsh_replay_lat = grown;
+  }
+  lsh_replay_lat[lsh_replay_n++] = lsh_elapsed(&lsh_replay_fed,
+                                               &lsh_session_mark);
+  lsh_replay_fed.tv_sec = 0;
+}
+
+/**
+   @brief Called with each line read: records it, or strips the recorded
+   wait from a replayed line and waits it out.
+   @param line The line, modified in place when replaying.
+ */
+void lsh_session_after_read(char *line)
+{
+  struct timespec now, wait;
+  long long us;
+  size_t len;
+  char *end;
+
+  if (lsh_record) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    len = strcspn(line, "\n");
+    fprintf(lsh_record, "%lld\t%.*s\n",
+            (long long)(lsh_elapsed(&lsh_session_mark, &now) * 1e6),
+            (int)len, line);
+    // Interactive input is slow enough that a crash should not lose it.
+    fflush(lsh_record);
+  }
+  if (!lsh_replay) {
+    return;
+  }
+  us = strtoll(line, &end, 10);
+  if (end != line && *end == '\t') {
+    memmove(line, end + 1, strlen(end + 1) + 1);
+    if (!lsh_replay_max && us > 0) {
+      wait.tv_sec = us / 1000000;
+      wait.tv_nsec = us % 1000000 * 1000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, &wait) == EINTR);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &lsh_replay_fed);
+  if (lsh_replay_start.tv_sec == 0) {
+    lsh_replay_start = lsh_replay_fed;
+  }
+}
+
+static int lsh_double_compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+   @brief Print replay throughput and latency percentiles.  Registered with
+   atexit(), since the replay ends at end of file.
+ */
+void lsh_replay_report(void)
+{
+  struct timespec now;
+  double elapsed, busy = 0;
+  size_t i, n;
+
+  // After the exit builtin, the last command ends with the shell.
+  lsh_session_before_read();
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  n = lsh_replay_n;
+  if (n == 0) {
+    fprintf(stderr, "lsh: replay: no commands\n");
+    return;
+  }
+  elapsed = lsh_elapsed(&lsh_replay_start, &now);
+  for (i = 0; i < n; i++) {
+    busy += lsh_replay_lat[i];
+  }
+  qsort(lsh_replay_lat, n, sizeof(double), lsh_double_compare);
+  fflush(stdout);
+  fprintf(stderr, "lsh: replay (%s speed): %zu commands in %.3fs, "
+          "%.1f commands/s", lsh_replay_max ? "max" : "orig", n, elapsed,
+          n / elapsed);
+  if (!lsh_replay_max && busy > 0) {
+    fprintf(stderr, " (%.1f/s excluding recorded waits)", n / busy);
+  }
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  latency  min %.3fms  p50 %.3fms  p90 %.3fms  "
+          "p99 %.3fms  max %.3fms\n", lsh_replay_lat[0] * 1e3,
+          lsh_replay_lat[n / 2] * 1e3, lsh_replay_lat[n * 9 / 10] * 1e3,
+          lsh_replay_lat[n * 99 / 100] * 1e3, lsh_replay_lat[n - 1] * 1e3);
+}
+
+/**
+   @brief Read a line of input from stdin, or from the script being run.
+   @return The line.
+ */
+char *lsh_read_line(void)
+{
+#ifdef LSH_USE_STD_GETLINE
+  char *line = NULL;
+  ssize_t bufsize = 0; // have getline allocate a buffer for us
+  if (getline(&line, &bufsize, lsh_input) == -1) {
+    if (feof(lsh_input)) {
+      exit(EXIT_SUCCESS);  // We received an EOF
+    } else  {
+      perror("lsh: getline\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  lsh_lineno++;
+  return line;
+#else
+#define LSH_RL_BUFSIZE 1024
+  int bufsize = LSH_RL_BUFSIZE;
+  int position = 0;
+  char *buffer = malloc(sizeof(char) * bufsize);
+  int c;
+
+  if (!buffer) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    // Read a character
+    c = getc(lsh_input);
+
+    if (c == EOF && position == 0) {
+      exit(EXIT_SUCCESS);
+    } else if (c == '\n' || c == EOF) {
+      // A final line without a newline still counts.
+      buffer[position] = '\0';
+      lsh_lineno++;
+      return buffer;
+    } else {
+      buffer[position] = c;
+    }
+    position++;
+
+    // If we have exceeded the buffer, reallocate.
+    if (position >= bufsize) {
+      bufsize += LSH_RL_BUFSIZE;
+      buffer = realloc(buffer, bufsize);
+      if (!buffer) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+#endif
+}
+
+#define LSH_TOK_BUFSIZE 64
+#define LSH_TOK_DELIM " \t\r\n\a"
+/**
+   @brief Split a line into tokens (very naively).
+   @param line The line.
+   @return Null-terminated array of tokens.
+ */
+char **lsh_split_line(char *line)
+{
+  int bufsize = LSH_TOK_BUFSIZE, position = 0;
+  char **tokens = malloc(bufsize * sizeof(char*));
+  char *token, **tokens_backup;
+
+  if (!tokens) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  token = strtok(line, LSH_TOK_DELIM);
+  while (token != NULL) {
+    tokens[position] = token;
+    position++;
+
+    if (position >= bufsize) {
+      bufsize += LSH_TOK_BUFSIZE;
+      tokens_backup = tokens;
+      tokens = realloc(tokens, bufsize * sizeof(char*));
+      if (!tokens) {
+		free(tokens_backup);
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    token = strtok(NULL, LSH_TOK_DELIM);
+  }
+  tokens[position] = NULL;
+  return tokens;
+}
+
+/*
+  Parameter expansion.  Variables are simply environment variables.  The
+  supported forms are:
+
+    $NAME ${NAME}       value
+    ${#NAME}            length in bytes
+    ${NAME:-word}       value, or word if unset or empty
+    ${NAME:off[:len]}   substring
+    ${NAME#pat}         remove shortest matching prefix (## for longest)
+    ${NAME%pat}         remove shortest matching suffix (%% for longest)
+    ${NAME/pat/rep}     replace first match (// for every match)
+
+  Patterns are globs (*, ?, [...]).  Most patterns people actually write are
+  a literal with at most one star on one end, so those are classified up front
+  and handled with memmem() and friends instead of the general matcher.
+*/
+enum lsh_pat_kind {
+  LSH_PAT_LITERAL,       // abc
+  LSH_PAT_STAR_LITERAL,  // *abc
+  LSH_PAT_LITERAL_STAR,  // abc*
+  LSH_PAT_GLOB           // anything else
+};
+
+struct lsh_glob_elem {
+  int star;                // matches any run of characters
+  unsigned char set[32];   // otherwise, bitmap of the bytes that match
+};
+
+struct lsh_pattern {
+  enum lsh_pat_kind kind;
+  const char *pat;  // full pattern, for LSH_PAT_GLOB
+  size_t patlen;
+  const char *lit;  // literal part, for the other kinds
+  size_t litlen;
+  struct lsh_glob_elem *elem;  // compiled LSH_PAT_GLOB
+  size_t nelem;
+  size_t *states;   // scratch for the matcher, two arrays of nelem + 1
+};
+
+/**
+   @brief Match one bracket expression against a character.
+   @param pat Points just after the opening '['.
+   @param end End of the pattern.
+   @param c Character to test.
+   @param next Set to just after the closing ']'.
+   @return 1 on match, 0 on mismatch, -1 if the bracket is unterminated.
+ */
+static int lsh_glob_bracket(const char *pat, const char *end, unsigned char c,
+                            const char **next)
+{
+  int negate = 0, matched = 0;
+  const char *p = pat;
+
+  if (p < end && (*p == '!' || *p == '^')) {
+    negate = 1;
+    p++;
+  }
+  if (p < end && *p == ']') {
+    matched |= (c == ']');
+    p++;
+  }
+  while (p < end && *p != ']') {
+    unsigned char lo = *p, hi = lo;
+    if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+      hi = p[2];
+      p += 3;
+    } else {
+      p++;
+    }
+    matched |= (lo <= c && c <= hi);
+  }
+  if (p >= end) {
+    return -1;
+  }
+  *next = p + 1;
+  return matched != negate;
+}
+
+/*
+  The general matcher.  A glob compiles to a list of elements, each either a
+  star or a set of bytes that one character must be in, and is run as an NFA
+  whose states are positions in that list.  All states advance together, one
+  character at a time, so a match costs O(string length x pattern length)
+  however many stars there are.  Each live state remembers where the match
+  that reached it started, keeping only the earliest (or, for the shortest
+  suffix, the latest): two matches in the same state finish the same way, so
+  the other one can never do better.
+*/
+#define LSH_GLOB_NONE ((size_t)-1)
+
+/**
+   @brief Compile a glob into NFA elements in the command arena.
+   @param out Pattern being compiled; pat and patlen must be set.
+ */
+static void lsh_glob_compile(struct lsh_pattern *out)
+{
+  const char *p = out->pat, *pend = out->pat + out->patlen, *next;
+  struct lsh_glob_elem *e;
+  int c, r;
+
+  out->elem = lsh_arena_alloc(&lsh_cmd_arena,
+                              out->patlen * sizeof(struct lsh_glob_elem));
+  out->nelem = 0;
+  while (p < pend) {
+    e = &out->elem[out->nelem++];
+    memset(e, 0, sizeof(*e));
+    if (*p == '*') {
+      e->star = 1;
+      // Consecutive stars are the same as one.
+      while (p < pend && *p == '*') {
+        p++;
+      }
+      continue;
+    }
+    if (*p == '?') {
+      memset(e->set, 0xff, sizeof(e->set));
+      p++;
+      continue;
+    }
+    if (*p == '[' && lsh_glob_bracket(p + 1, pend, 0, &next) >= 0) {
+      for (c = 0; c < 256; c++) {
+        r = lsh_glob_bracket(p + 1, pend, c, &next);
+        e->set[c >> 3] |= r << (c & 7);
+      }
+      p = next;
+      continue;
+    }
+    // A backslash quotes the next character; a trailing one is literal, as
+    // is a '[' with no closing ']'.
+    if (*p == '\\' && p + 1 < pend) {
+      p++;
+    }
+    c = (unsigned char)*p++;
+    e->set[c >> 3] |= 1 << (c & 7);
+  }
+  out->states = lsh_arena_alloc(&lsh_cmd_arena,
+                                2 * (out->nelem + 1) * sizeof(size_t));
+}
+
+/**
+   @brief Put a match start into an NFA state and the states a star skips to.
+   @param pat Compiled pattern.
+   @param states State array to add to.
+   @param i State to enter.
+   @param start Where the match started.
+   @param latest Nonzero to keep the latest start instead of the earliest.
+ */
+static void lsh_glob_add(const struct lsh_pattern *pat, size_t *states,
+                         size_t i, size_t start, int latest)
+{
+  while (states[i] == LSH_GLOB_NONE
+         || (latest ? start > states[i] : start < states[i])) {
+    states[i] = start;
+    if (i == pat->nelem || !pat->elem[i].star) {
+      break;
+    }
+    i++;
+  }
+}
+
+/**
+   @brief Advance every NFA state over one character.
+   @param pat Compiled pattern.
+   @param cur States before the character.
+   @param next Filled with the states after it.
+   @param c The character.
+   @param limit Drop matches that started after this.
+   @param latest As for lsh_glob_add().
+   @return Nonzero if any state is still live.
+ */
+static int lsh_glob_step(const struct lsh_pattern *pat, const size_t *cur,
+                         size_t *next, unsigned char c, size_t limit,
+                         int latest)
+{
+  size_t i;
+  int live = 0;
+
+  memset(next, 0xff, (pat->nelem + 1) * sizeof(size_t));
+  for (i = 0; i < pat->nelem; i++) {
+    if (cur[i] == LSH_GLOB_NONE || cur[i] > limit) {
+      continue;
+    }
+    if (pat->elem[i].star) {
+      lsh_glob_add(pat, next, i, cur[i], latest);
+      live = 1;
+    } else if (pat->elem[i].set[c >> 3] & (1 << (c & 7))) {
+      lsh_glob_add(pat, next, i + 1, cur[i], latest);
+      live = 1;
+    }
+  }
+  return live;
+}
+
+/**
+   @brief Classify a glob pattern so that simple cases can avoid the matcher.
+   @param pat Pattern text (not necessarily NUL terminated).
+   @param len Length of the pattern.
+   @param out Compiled pattern.
+ */
+void lsh_pattern_compile(const char *pat, size_t len, struct lsh_pattern *out)
+{
+  size_t i, stars = 0, others = 0;
+
+  for (i = 0; i < len; i++) {
+    if (pat[i] == '*') {
+      stars++;
+    } else if (pat[i] == '?' || pat[i] == '[' || pat[i] == '\\') {
+      others++;
+    }
+  }
+
+  out->pat = pat;
+  out->patlen = len;
+  out->lit = pat;
+  out->litlen = len;
+  if (others == 0 && stars == 0) {
+    out->kind = LSH_PAT_LITERAL;
+  } else if (others == 0 && stars == 1 && pat[0] == '*') {
+    out->kind = LSH_PAT_STAR_LITERAL;
+    out->lit = pat + 1;
+    out->litlen = len - 1;
+  } else if (others == 0 && stars == 1 && pat[len - 1] == '*') {
+    out->kind = LSH_PAT_LITERAL_STAR;
+    out->litlen = len - 1;
+  } else {
+    out->kind = LSH_PAT_GLOB;
+    lsh_glob_compile(out);
+  }
+}
+
+/**
+   @brief Find the last occurrence of a needle in a haystack.
+   @return Pointer to the match, or NULL.
+ */
+const char *lsh_memrmem(const char *hay, size_t haylen, const char *needle,
+                        size_t needlelen)
+{
+  const char *p;
+  size_t end = haylen;
+
+  if (needlelen == 0) {
+    return hay + haylen;
+  }
+  while (end >= needlelen) {
+    p = memrchr(hay + needlelen - 1, needle[needlelen - 1],
+                end - needlelen + 1);
+    if (!p) {
+      return NULL;
+    }
+    p -= needlelen - 1;
+    if (memcmp(p, needle, needlelen) == 0) {
+      return p;
+    }
+    end = p - hay + needlelen - 1;
+  }
+  return NULL;
+}
+
+/**
+   @brief Length of the prefix of str that a pattern removes.
+   @param pat Compiled pattern.
+   @param str String.
+   @param len String length.
+   @param longest Nonzero for ##, zero for #.
+   @return Number of bytes to remove from the front (0 if no match).
+ */
+size_t lsh_match_prefix(const struct lsh_pattern *pat, const char *str,
+                        size_t len, int longest)
+{
+  const char *m;
+  size_t *cur, *next, *tmp, pos, n = 0;
+
+  switch (pat->kind) {
+  case LSH_PAT_LITERAL:
+    if (len >= pat->litlen && memcmp(str, pat->lit, pat->litlen) == 0) {
+      return pat->litlen;
+    }
+    return 0;
+  case LSH_PAT_STAR_LITERAL:
+    if (longest) {
+      m = lsh_memrmem(str, len, pat->lit, pat->litlen);
+    } else {
+      m = memmem(str, len, pat->lit, pat->litlen);
+    }
+    return m ? (size_t)(m - str) + pat->litlen : 0;
+  case LSH_PAT_LITERAL_STAR:
+    if (len >= pat->litlen && memcmp(str, pat->lit, pat->litlen) == 0) {
+      return longest ? len : pat->litlen;
+    }
+    return 0;
+  default:
+    cur = pat->states;
+    next = cur + pat->nelem + 1;
+    memset(cur, 0xff, (pat->nelem + 1) * sizeof(size_t));
+    lsh_glob_add(pat, cur, 0, 0, 0);
+    for (pos = 0; ; pos++) {
+      if (cur[pat->nelem] != LSH_GLOB_NONE) {
+        n = pos;
+        if (!longest) {
+          break;
+        }
+      }
+      if (pos == len
+          || !lsh_glob_step(pat, cur, next, str[pos], LSH_GLOB_NONE, 0)) {
+        break;
+      }
+      tmp = cur;
+      cur = next;
+      next = tmp;
+    }
+    return n;
+  }
+}
+
+/**
+   @brief Length of the suffix of str that a pattern removes.
+   @param pat Compiled pattern.
+   @param str String.
+   @param len String length.
+   @param longest Nonzero for %%, zero for %.
+   @return Number of bytes to remove from the end (0 if no match).
+ */
+size_t lsh_match_suffix(const struct lsh_pattern *pat, const char *str,
+                        size_t len, int longest)
+{
+  const char *m;
+  size_t *cur, *next, *tmp, pos;
+
+  switch (pat->kind) {
+  case LSH_PAT_LITERAL:
+    if (len >= pat->litlen
+        && memcmp(str + len - pat->litlen, pat->lit, pat->litlen) == 0) {
+      return pat->litlen;
+    }
+    return 0;
+  case LSH_PAT_STAR_LITERAL:
+    if (len >= pat->litlen
+        && memcmp(str + len - pat->litlen, pat->lit, pat->litlen) == 0) {
+      return longest ? len : pat->litlen;
+    }
+    return 0;
+  case LSH_PAT_LITERAL_STAR:
+    if (longest) {
+      m = memmem(str, len, pat->lit, pat->litlen);
+    } else {
+      m = lsh_memrmem(str, len, pat->lit, pat->litlen);
+    }
+    return m ? len - (size_t)(m - str) : 0;
+  default:
+    // Start a match at every position and see which reach the end: the
+    // earliest start gives the longest suffix, the latest the shortest.
+    cur = pat->states;
+    next = cur + pat->nelem + 1;
+    memset(cur, 0xff, (pat->nelem + 1) * sizeof(size_t));
+    for (pos = 0; ; pos++) {
+      lsh_glob_add(pat, cur, 0, pos, !longest);
+      if (pos == len) {
+        break;
+      }
+      lsh_glob_step(pat, cur, next, str[pos], LSH_GLOB_NONE, !longest);
+      tmp = cur;
+      cur = next;
+      next = tmp;
+    }
+    return cur[pat->nelem] == LSH_GLOB_NONE ? 0 : len - cur[pat->nelem];
+  }
+}
+
+/**
+   @brief Find the leftmost, longest match of a pattern within a string.
+   @param pat Compiled pattern.
+   @param str String.
+   @param len String length.
+   @param matchlen Set to the length of the match.
+   @return Pointer to the start of the match, or NULL.
+ */
+const char *lsh_match_search(const struct lsh_pattern *pat, const char *str,
+                             size_t len, size_t *matchlen)
+{
+  const char *m;
+  size_t *cur, *next, *tmp, pos, best = LSH_GLOB_NONE, end = 0;
+  int live;
+
+  switch (pat->kind) {
+  case LSH_PAT_LITERAL:
+    if (pat->litlen == 0) {
+      return NULL;
+    }
+    m = memmem(str, len, pat->lit, pat->litlen);
+    *matchlen = pat->litlen;
+    return m;
+  case LSH_PAT_STAR_LITERAL:
+    // Matches from the start of the string up to the last occurrence.
+    m = lsh_memrmem(str, len, pat->lit, pat->litlen);
+    if (!m) {
+      return NULL;
+    }
+    *matchlen = (m - str) + pat->litlen;
+    return str;
+  case LSH_PAT_LITERAL_STAR:
+    // Matches from the first occurrence to the end of the string.
+    m = memmem(str, len, pat->lit, pat->litlen);
+    if (!m) {
+      return NULL;
+    }
+    *matchlen = len - (m - str);
+    return m;
+  default:
+    // Start a match at each position until one succeeds, then follow only
+    // matches starting no later than it, for as long as any could still get
+    // longer.  Empty matches don't count.
+    cur = pat->states;
+    next = cur + pat->nelem + 1;
+    memset(cur, 0xff, (pat->nelem + 1) * sizeof(size_t));
+    for (pos = 0; ; pos++) {
+      if (best == LSH_GLOB_NONE && pos < len) {
+        lsh_glob_add(pat, cur, 0, pos, 0);
+      }
+      if (cur[pat->nelem] != LSH_GLOB_NONE && cur[pat->nelem] < pos) {
+        best = cur[pat->nelem];
+        end = pos;
+      }
+      if (pos == len) {
+        break;
+      }
+      live = lsh_glob_step(pat, cur, next, str[pos], best, 0);
+      tmp = cur;
+      cur = next;
+      next = tmp;
+      if (!live && best != LSH_GLOB_NONE) {
+        break;
+      }
+    }
+    if (best == LSH_GLOB_NONE) {
+      return NULL;
+    }
+    *matchlen = end - best;
+    return str + best;
+  }
+}
+
+/**
+   @brief Perform ${NAME/pat/rep} or ${NAME//pat/rep}.
+   @param out Destination string.
+   @param pat Compiled pattern.
+   @param str Value being substituted.
+   @param len Value length.
+   @param rep Replacement text.
+   @param replen Replacement length.
+   @param all Nonzero to replace every match.
+ */
+void lsh_subst_pattern(struct lsh_buf *out, const struct lsh_pattern *pat,
+                       const char *str, size_t len, const char *rep,
+                       size_t replen, int all)
+{
+  const char *m;
+  size_t mlen;
+
+  while (len > 0 && (m = lsh_match_search(pat, str, len, &mlen)) != NULL
+         && mlen > 0) {
+    lsh_buf_append(out, str, m - str);
+    lsh_buf_append(out, rep, replen);
+    len -= (m - str) + mlen;
+    str = m + mlen;
+    if (!all) {
+      break;
+    }
+  }
+  lsh_buf_append(out, str, len);
+}
+
+/**
+   @brief Expand one ${...} expression.
+   @param out Destination string.
+   @param expr Contents between the braces.
+   @param exprlen Length of the contents.
+   @return 0 on success, -1 on a syntax error.
+ */
+int lsh_expand_brace(struct lsh_buf *out, const char *expr, size_t exprlen)
+{
+  const char *end = expr + exprlen, *op, *value, *slash;
+  char name[256];
+  size_t namelen, len, cut;
+  struct lsh_pattern pat;
+  char lenbuf[32];
+  int length = 0;
+
+  if (expr < end && *expr == '#' && exprlen > 1) {
+    length = 1;
+    expr++;
+  }
+  op = expr;
+  while (op < end && (*op == '_' || (*op >= 'a' && *op <= 'z')
+                      || (*op >= 'A' && *op <= 'Z')
+                      || (op > expr && *op >= '0' && *op <= '9'))) {
+    op++;
+  }
+  namelen = op - expr;
+  if (namelen == 0 || namelen >= sizeof(name) || (length && op != end)) {
+    return -1;
+  }
+  memcpy(name, expr, namelen);
+  name[namelen] = '\0';
+  value = getenv(name);
+  if (!value) {
+    value = "";
+  }
+  len = strlen(value);
+
+  if (length) {
+    snprintf(lenbuf, sizeof(lenbuf), "%zu", len);
+    lsh_buf_append(out, lenbuf, strlen(lenbuf));
+    return 0;
+  }
+
+  if (op == end) {
+    lsh_buf_append(out, value, len);
+  } else if (*op == '#' || *op == '%') {
+    int longest = (op + 1 < end && op[1] == *op);
+    const char *p = op + 1 + longest;
+    lsh_pattern_compile(p, end - p, &pat);
+    if (*op == '#') {
+      cut = lsh_match_prefix(&pat, value, len, longest);
+      lsh_buf_append(out, value + cut, len - cut);
+    } else {
+      cut = lsh_match_suffix(&pat, value, len, longest);
+      lsh_buf_append(out, value, len - cut);
+    }
+  } else if (*op == '/') {
+    int all = (op + 1 < end && op[1] == '/');
+    const char *p = op + 1 + all;
+    slash = memchr(p, '/', end - p);
+    if (!slash) {
+      slash = end;
+    }
+    lsh_pattern_compile(p, slash - p, &pat);
+    if (slash < end) {
+      lsh_subst_pattern(out, &pat, value, len, slash + 1, end - slash - 1, all);
+    } else {
+      lsh_subst_pattern(out, &pat, value, len, "", 0, all);
+    }
+  } else if (*op == ':' && op + 1 < end && op[1] == '-') {
+    if (len > 0) {
+      lsh_buf_append(out, value, len);
+    } else {
+      lsh_buf_append(out, op + 2, end - op - 2);
+    }
+  } else if (*op == ':') {
+    char *numend;
+    long off, sublen;
+    off = strtol(op + 1, &numend, 10);
+    if (numend == op + 1 || off < 0) {
+      return -1;
+    }
+    if ((size_t)off > len) {
+      off = len;
+    }
+    sublen = len - off;
+    if (numend < end && *numend == ':') {
+      const char *lenstr = numend + 1;
+      sublen = strtol(lenstr, &numend, 10);
+      if (numend == lenstr) {
+        return -1;
+      }
+      if (sublen < 0) {
+        // Negative length counts back from the end of the value.
+        sublen = (long)len - off + sublen;
+        if (sublen < 0) {
+          return -1;
+        }
+      }
+      if ((size_t)sublen > len - off) {
+        sublen = len - off;
+      }
+    }
+    if (numend != end) {
+      return -1;
+    }
+    lsh_buf_append(out, value + off, sublen);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+   @brief Expand parameters in a single token.
+   @param token The token.
+   @param expanded Set to 1 if the token contained any expansion.
+   @return The expanded token, allocated in the command arena, or NULL on a
+   syntax error.
+ */
+char *lsh_expand_token(char *token, int *expanded)
+{
+  struct lsh_buf out;
+  char *p = token, *dollar, *close, *name;
+
+  *expanded = 0;
+  dollar = strchr(p, '$');
+  if (!dollar) {
+    return token;
+  }
+
+  lsh_buf_init(&out, &lsh_cmd_arena, strlen(token));
+  while (dollar) {
+    lsh_buf_append(&out, p, dollar - p);
+    if (dollar[1] == '{') {
+      close = strchr(dollar + 2, '}');
+      if (!close) {
+        fprintf(stderr, "lsh: missing '}' in \"%s\"\n", token);
+        return NULL;
+      }
+      if (lsh_expand_brace(&out, dollar + 2, close - dollar - 2) != 0) {
+        fprintf(stderr, "lsh: bad substitution in \"%s\"\n", token);
+        return NULL;
+      }
+      *expanded = 1;
+      p = close + 1;
+    } else if (dollar[1] == '_' || (dollar[1] >= 'a' && dollar[1] <= 'z')
+               || (dollar[1] >= 'A' && dollar[1] <= 'Z')) {
+      name = dollar + 1;
+      p = name + 1;
+      while (*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+             || (*p >= '0' && *p <= '9')) {
+        p++;
+      }
+      lsh_expand_brace(&out, name, p - name);
+      *expanded = 1;
+    } else {
+      lsh_buf_append(&out, "$", 1);
+      p = dollar + 1;
+    }
+    dollar = strchr(p, '$');
+  }
+  lsh_buf_append(&out, p, strlen(p));
+  return out.data;
+}
+
+/**
+   @brief Expand parameters in every token of a command.
+   @param args Null terminated list of tokens, modified in place.
+   @return 0 on success, -1 if the command should not be run.
+   Tokens that consisted only of expansions and came out empty are dropped,
+   the same way an unquoted empty variable disappears in sh.
+ */
+int lsh_expand(char **args)
+{
+  int i, j, expanded;
+  char *token;
+
+  for (i = 0, j = 0; args[i] != NULL; i++) {
+    token = lsh_expand_token(args[i], &expanded);
+    if (!token) {
+      return -1;
+    }
+    if (expanded && token[0] == '\0') {
+      continue;
+    }
+    args[j++] = token;
+  }
+  args[j] = NULL;
+  return 0;
+}
+
+/*
+  Startup.  The rc file ($LSHRC, or ~/.lshrc) is mapped read-only and
+  prefaulted in one go rather than read.  Comment and blank lines are skipped
+  in place without being tokenized; only lines that run are copied out, into
+  one reused buffer.  (Writing terminators into a private mapping instead
+  would copy a whole page for every page holding a command.)  With
+  --startup-stats the time from main() to the first prompt is reported per
+  phase, along with the CPU time spent before main() (exec, dynamic loading
+  and libc start-up).
+*/
+enum lsh_startup_phase {
+  LSH_STARTUP_OPTIONS,
+  LSH_STARTUP_SERVICES,
+  LSH_STARTUP_RC,
+  LSH_STARTUP_PROMPT,
+  LSH_NSTARTUP
+};
+
+const char *lsh_startup_names[] = {
+  "options", "audit/profile setup", "rc file", "first prompt"
+};
+
+struct lsh_startup {
+  int enabled;
+  int reported;
+  double premain;                       // CPU seconds before main()
+  struct timespec start;                // entry to main()
+  struct timespec mark[LSH_NSTARTUP];
+  long rc_lines, rc_run;
+};
+
+struct lsh_startup lsh_startup;
+
+/**
+   @brief Note the time and CPU time at entry to main().
+ */
+void lsh_startup_begin(void)
+{
+  struct timespec cpu;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  clock_gettime(CLOCK_MONOTONIC, &lsh_startup.start);
+  lsh_startup.premain = cpu.tv_sec + cpu.tv_nsec / 1e9;
+}
+
+/**
+   @brief Note the time at which a startup phase ended.
+ */
+void lsh_startup_mark(enum lsh_startup_phase phase)
+{
+  clock_gettime(CLOCK_MONOTONIC, &lsh_startup.mark[phase]);
+}
+
+/**
+   @brief Print the startup breakdown, once, when the first prompt is due.
+ */
+void lsh_startup_report(void)
+{
+  const struct timespec *prev = &lsh_startup.start;
+  int i;
+
+  lsh_startup.reported = 1;
+  lsh_startup_mark(LSH_STARTUP_PROMPT);
+  fprintf(stderr, "lsh: startup: %.3fms from main() to first prompt, "
+          "%.3fms CPU before main()\n",
+          lsh_elapsed(&lsh_startup.start,
+                      &lsh_startup.mark[LSH_STARTUP_PROMPT]) * 1e3,
+          lsh_startup.premain * 1e3);
+  for (i = 0; i < LSH_NSTARTUP; i++) {
+    fprintf(stderr, "  %-20s %8.3fms", lsh_startup_names[i],
+            lsh_elapsed(prev, &lsh_startup.mark[i]) * 1e3);
+    if (i == LSH_STARTUP_RC) {
+      fprintf(stderr, "  (%ld lines, %ld run)", lsh_startup.rc_lines,
+              lsh_startup.rc_run);
+    }
+    fprintf(stderr, "\n");
+    prev = &lsh_startup.mark[i];
+  }
+}
+
+/**
+   @brief Execute an expanded command, auditing and profiling it.
+   @param args Null terminated list of arguments.
+   @param text The line as read, when profiling.
+   @param mark Profile mark taken before the line was tokenized.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int lsh_run(char **args, const char *text, const struct lsh_prof_mark *mark)
+{
+  const char *cmd;
+  int status;
+
+  // Taken first: lsh_execute() may rewrite the arguments.
+  cmd = lsh_prof_command(args);
+  if (lsh_audit) {
+    lsh_audit_begin(args);
+  }
+  lsh_phase_enter(LSH_PHASE_DISPATCH);
+  status = lsh_execute(args);
+  if (lsh_audit) {
+    lsh_audit_end();
+  }
+  if (lsh_profiling) {
+    lsh_prof_end(mark, text, cmd);
+  }
+  return status;
+}
+
+/**
+   @brief Run one line of the rc file.
+   @param line The line, NUL terminated and writable.
+   @return 1 to continue, 0 if the line asked the shell to exit.
+ */
+int lsh_rc_line(char *line)
+{
+  struct lsh_prof_mark mark;
+  char **args, *text = NULL;
+  int status = 1;
+
+  if (lsh_profiling) {
+    text = lsh_arena_alloc(&lsh_cmd_arena, strlen(line) + 1);
+    strcpy(text, line);
+    lsh_prof_begin(&mark);
+  }
+  args = lsh_split_line(line);
+  if (args[0] != NULL && lsh_expand(args) == 0) {
+    status = lsh_run(args, text, &mark);
+  }
+  lsh_arena_reset(&lsh_cmd_arena);
+  free(args);
+  return status;
+}
+
+/**
+   @brief Run the rc file, if there is one.
+   @return 1 to continue, 0 if the rc file asked the shell to exit.
+ */
+int lsh_load_rc(void)
+{
+  const char *path = getenv("LSHRC"), *home, *map, *p, *end, *nl;
+  char buf[PATH_MAX], *line = NULL, *grown;
+  size_t cap = 0;
+  struct stat st;
+  int fd, status = 1;
+
+  if (!path) {
+    home = getenv("HOME");
+    if (!home) {
+      return 1;
+    }
+    snprintf(buf, sizeof(buf), "%s/.lshrc", home);
+    path = buf;
+  }
+  if (*path == '\0' || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return 1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "lsh: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  end = map + st.st_size;
+  for (p = map; p < end && status; p = nl + 1) {
+    nl = memchr(p, '\n', end - p);
+    if (!nl) {
+      nl = end;
+    }
+    lsh_startup.rc_lines++;
+    while (p < nl && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if (p == nl || *p == '#') {
+      continue;
+    }
+    lsh_startup.rc_run++;
+    if ((size_t)(nl - p) >= cap) {
+      cap = (nl - p) + 256;
+      grown = realloc(line, cap);
+      if (!grown) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      line = grown;
+    }
+    memcpy(line, p, nl - p);
+    line[nl - p] = '\0';
+    status = lsh_rc_line(line);
+  }
+  free(line);
+  munmap((void *)map, st.st_size);
+  return status;
+}
+
+/**
+   @brief Loop getting input and executing it.
+ */
+void lsh_loop(void)
+{
+  struct lsh_prof_mark mark;
+  char *line, *text = NULL;
+  char **args;
+  int status = 1, n;
+  uint64_t t0;
+
+  do {
+    lsh_phase_enter(LSH_PHASE_READ);
+    if (lsh_startup.enabled && !lsh_startup.reported) {
+      lsh_startup_report();
+    }
+    lsh_jobs_reap();
+    if (!lsh_script) {
+      printf("> ");
+    }
+    t0 = LSH_PROBE_ENABLED(read_line_return) ? lsh_probe_now() : 0;
+    if (lsh_record || lsh_replay) {
+      lsh_session_before_read();
+      line = lsh_read_line();
+      lsh_session_after_read(line);
+    } else {
+      line = lsh_read_line();
+    }
+    if (LSH_PROBE_ENABLED(read_line_return)) {
+      LSH_PROBE2(read_line_return, line, lsh_probe_now() - t0);
+    }
+    if (lsh_profiling) {
+      text = lsh_arena_alloc(&lsh_cmd_arena, strlen(line) + 1);
+      strcpy(text, line);
+      lsh_prof_begin(&mark);
+    }
+    lsh_phase_enter(LSH_PHASE_TOKENIZE);
+    t0 = LSH_PROBE_ENABLED(split_line_return) ? lsh_probe_now() : 0;
+    args = lsh_split_line(line);
+    if (LSH_PROBE_ENABLED(split_line_return)) {
+      for (n = 0; args[n] != NULL; n++);
+      LSH_PROBE2(split_line_return, n, lsh_probe_now() - t0);
+    }
+    lsh_phase_enter(LSH_PHASE_EXPAND);
+    // Lines starting with '#' are comments (and "#!" lines in scripts).
+    if (args[0] != NULL && args[0][0] != '#' && lsh_expand(args) == 0) {
+      status = lsh_run(args, text, &mark);
+    }
+
+    lsh_arena_reset(&lsh_cmd_arena);
+    free(line);
+    free(args);
+  } while (status);
+}
+
+/**
+   @brief Main entry point.
+   @param argc Argument count.
+   @param argv Argument vector.
+   @return status code
+ */
+int main(int argc, char **argv)
+{
+  const char *record = NULL, *replay = NULL;
+  int i;
+
+  lsh_startup_begin();
+  lsh_input = stdin;
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    if (strcmp(argv[i], "--profile") == 0) {
+      lsh_profiling = 1;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (strcmp(argv[i], "--replay-speed=max") == 0) {
+      lsh_replay_max = 1;
+    } else if (strcmp(argv[i], "--replay-speed=orig") == 0) {
+      lsh_replay_max = 0;
+    } else if (strcmp(argv[i], "--startup-stats") == 0) {
+      lsh_startup.enabled = 1;
+    } else {
+      fprintf(stderr, "usage: lsh [--profile] [--startup-stats] "
+              "[--record FILE] [--replay FILE [--replay-speed=orig|max]] "
+              "[script]\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (replay && i < argc) {
+    fprintf(stderr, "lsh: --replay and a script cannot be combined\n");
+    return EXIT_FAILURE;
+  }
+  if (replay || i < argc) {
+    // A recording is replayed like a script whose lines carry timings.
+    lsh_script = replay ? replay : argv[i];
+    lsh_replay = replay != NULL;
+    lsh_input = fopen(lsh_script, "re");
+    if (!lsh_input) {
+      fprintf(stderr, "lsh: %s: %s\n", lsh_script, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    lsh_fd_register(fileno(lsh_input));
+  } else if (lsh_profiling) {
+    fprintf(stderr, "lsh: --profile needs a script\n");
+    return EXIT_FAILURE;
+  }
+  if (record) {
+    lsh_record = fopen(record, "ae");
+    if (!lsh_record) {
+      fprintf(stderr, "lsh: %s: %s\n", record, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    lsh_fd_register(fileno(lsh_record));
+  }
+  lsh_startup_mark(LSH_STARTUP_OPTIONS);
+  if (lsh_replay) {
+    atexit(lsh_replay_report);
+  }
+  if (lsh_profiling) {
+    lsh_prof_start();
+    atexit(lsh_prof_report);
+  }
+  if (getenv("LSH_AUDIT_LOG") && *getenv("LSH_AUDIT_LOG")) {
+    lsh_audit_start(getenv("LSH_AUDIT_LOG"));
+  }
+  if (getenv("LSH_PROFILE") && *getenv("LSH_PROFILE")) {
+    lsh_perf_start();
+    atexit(lsh_perf_report);
+  }
+  lsh_startup_mark(LSH_STARTUP_SERVICES);
+
+  // Load config files, if any.  Scripts run without them.
+  if (!lsh_script && lsh_load_rc() == 0) {
+    return EXIT_SUCCESS;
+  }
+  lsh_startup_mark(LSH_STARTUP_RC);
 
   // Run command loop.
   lsh_loop();
 
-  // Perform any shutdown/cleanup.
+  // Perform any shutdown/cleanup.  End of input exits from lsh_read_line(),
+  // so the audit log and the profiles are finished by atexit() handlers.
 
   return EXIT_SUCCESS;
 }